@@ -29,6 +29,14 @@ class PZQMessage
              
     private $ack_timeout = null;
 
+    private $attempt = 1;
+
+    private $flags = 0;
+
+    private $lease = 0;
+
+    private $trace = false;
+
     public function get_id ()
     {
         return $this->id;
@@ -59,6 +67,48 @@ class PZQMessage
         $this->ack_timeout = $timeout;
     }
 
+    public function get_attempt ()
+    {
+        return $this->attempt;
+    }
+
+    public function set_attempt ($attempt)
+    {
+        $this->attempt = $attempt;
+    }
+
+    public function get_lease ()
+    {
+        return $this->lease;
+    }
+
+    // Microseconds consumers get before redelivery, 0 for --ack-timeout
+    public function set_lease ($lease)
+    {
+        $this->lease = $lease;
+    }
+
+    public function get_trace ()
+    {
+        return $this->trace;
+    }
+
+    // Ask the node to record the stages of this message, see TRACE
+    public function set_trace ($trace)
+    {
+        $this->trace = $trace;
+    }
+
+    public function get_flags ()
+    {
+        return $this->flags;
+    }
+
+    public function set_flags ($flags)
+    {
+        $this->flags = $flags;
+    }
+
     public function get_peer ()
     {
         return $this->peer;
@@ -88,6 +138,8 @@ class PZQProducer
     
     private $ignore_ack;
     
+    private $producer_id;
+    
     public function __construct ($dsn = null)
     {
         $this->socket = new ZMQSocket (new ZMQContext (), ZMQ::SOCKET_DEALER);
@@ -111,9 +163,23 @@ class PZQProducer
         $this->ignore_ack = $value;
     }
     
+    // Lets the node recognise retries across reconnects, see --dedup-window
+    public function set_producer_id ($id)
+    {
+        $this->producer_id = $id;
+    }
+    
     public function produce (PZQMessage $message, $timeout = 5000)
     {
-        $out = array ($message->get_id (), "");
+        $out = array ($message->get_id ());
+        if ($message->get_lease ())
+            array_push ($out, "LEASE:" . $message->get_lease ());
+        if ($message->get_trace ())
+            array_push ($out, "TRACE");
+        if ($this->producer_id)
+            array_push ($out, "PRODUCER:" . $this->producer_id);
+        array_push ($out, "");
+
         $m = $message->get_message ();
   
         if (is_array ($m))
@@ -182,9 +248,23 @@ class PZQConsumer
         $message = new PZQMessage ();
         $message->set_peer ($parts [0]);
         $message->set_id ($parts [1]);
-        $message->set_sent_time ($parts [2]);
-        $message->set_ack_timeout ($parts [3]);
-        $message->set_message (array_slice ($parts, 5));
+
+        if ($parts [3] === '') {
+            // Binary header of --envelope 2, see the README
+            $h = unpack ('Cversion/Cflags/nsize/Nattempt/Nsent_hi/Nsent_lo/Ndeadline_hi/Ndeadline_lo', $parts [2]);
+            $sent     = $h ['sent_hi'] * 4294967296 + $h ['sent_lo'];
+            $deadline = $h ['deadline_hi'] * 4294967296 + $h ['deadline_lo'];
+
+            $message->set_sent_time ($sent);
+            $message->set_ack_timeout ($deadline - $sent);
+            $message->set_attempt ($h ['attempt']);
+            $message->set_flags ($h ['flags']);
+            $message->set_message (array_slice ($parts, 4));
+        } else {
+            $message->set_sent_time ($parts [2]);
+            $message->set_ack_timeout ($parts [3]);
+            $message->set_message (array_slice ($parts, 5));
+        }
 
         if ($this->filter_expired && $this->is_expired ($message)) {
             return $this->consume ($block);
@@ -201,6 +281,19 @@ class PZQConsumer
         return ($diff > ($message->get_ack_timeout () / 1000000));
     }
     
+    // Moves the redelivery deadline to lease microseconds from now
+    public function touch (PZQMessage $message, $lease = 0)
+    {
+        $this->socket->sendMulti (
+                        array (
+                            $message->get_peer (),
+                            "TOUCH",
+                            ($lease ? (string) $lease : ""),
+                            $message->get_id ()
+                        )
+                    );
+    }
+
     public function ack (PZQMessage $message, $success = true)
     {
         $this->socket->sendMulti (
@@ -242,5 +335,54 @@ class PZQMonitor
         
         return $data;
     }
+
+    // Prometheus text, or the decoded JSON object with $json
+    public function get_metrics ($json = false)
+    {
+        $this->socket->send ($json ? "METRICS JSON" : "METRICS");
+
+        $message = $this->socket->recv ();
+        return $json ? json_decode ($message, true) : $message;
+    }
+
+    // Histograms since the last call, as name => array (count => .., p50 => .., ...)
+    public function get_latency ()
+    {
+        $this->socket->send ("LATENCY");
+        return $this->parse_fields ($this->socket->recv ());
+    }
+
+    // Time of the manager loop per section since the last call
+    public function get_loop ()
+    {
+        $this->socket->send ("LOOP");
+        return $this->parse_fields ($this->socket->recv ());
+    }
+
+    // Lines of name: value or name: field=value ...
+    private function parse_fields ($message)
+    {
+        $parts = array_filter (explode ("\n", $message));
+
+        $data = array ();
+        foreach ($parts as $part)
+        {
+            $pieces = explode (': ', $part);
+            if (strpos ($pieces [1], '=') === false)
+            {
+                $data [$pieces [0]] = $pieces [1];
+                continue;
+            }
+
+            $data [$pieces [0]] = array ();
+            foreach (explode (' ', $pieces [1]) as $field)
+            {
+                list ($name, $value) = explode ('=', $field);
+                $data [$pieces [0]][$name] = $value;
+            }
+        }
+
+        return $data;
+    }
 }
 
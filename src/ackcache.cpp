@@ -21,89 +21,239 @@ using std::string;
 
 namespace pzq
 {
-    ackcache_t::ackcache_t( uint64_t timeoutReplication )
+    ackcache_t::ackcache_t( uint64_t timeoutReplication, shared_ptr< pzq::clock_service_t > clock )
     {
         pzq::log( "Initializing ack cache" );
         m_timeoutReplication = timeoutReplication;
+        m_clock = clock;
+        
+        m_slots.assign( 1024, (uint32_t)none );
+        m_size = 0;
+        m_free = none;
+        m_head = none;
+        m_tail = none;
     }
     
     ackcache_t::~ackcache_t()
     {
+        for( uint32_t e = m_head; e != none; e = m_entries[ e ].next )
+            pzq::slab_pool_t::local().deallocate( m_entries[ e ].data );
     }
     
-    void ackcache_t::push( const std::string& idMsg, pzq::message_t ack, int replicas )
+    void ackcache_t::setExpiryHandler( shared_ptr< pzq::timer_service_t > timers, expiry_handler_t handler )
     {
-        m_cache.insert( ack_t( idMsg, ack, microsecond_timestamp() + m_timeoutReplication, replicas ) );
+        m_timers = timers;
+        m_expired = handler;
+        m_timer = m_timers->create( boost::bind( &ackcache_t::expire, this ) );
     }
     
-    pzq::message_t ackcache_t::getAndRemoveById( string id )
+    size_t ackcache_t::size() const
     {
-        pzq::message_t msg;
+        return m_size;
+    }
+    
+    uint32_t ackcache_t::find( const char* key, size_t size, uint64_t hash, size_t* slot ) const
+    {
+        size_t mask = m_slots.size() - 1;
         
-        cache_t::nth_index< 0 >::type& index = m_cache.get< 0 >();
-        cache_t::nth_index< 0 >::type::iterator it = index.find( id );
-        if( it != index.end() )
+        for( size_t i = hash & mask; m_slots[ i ] != none; i = ( i + 1 ) & mask )
         {
-            it->decrementReplicas();
-            if(it->getReplicas() == 0 )
+            const entry_t& entry = m_entries[ m_slots[ i ] ];
+            if( entry.hash == hash && entry.keySize == size && !memcmp( entry.data, key, size ) )
             {
-                msg = it->getAck();
-                index.erase( it );
+                *slot = i;
+                return m_slots[ i ];
             }
         }
-        
-        return msg;
+        return none;
     }
     
-    int ackcache_t::getDelayUntilNextAck() const
+    void ackcache_t::insertSlot( uint32_t e )
     {
-        if( m_cache.size() == 0) return std::numeric_limits< int >::max();
+        size_t mask = m_slots.size() - 1;
+        size_t i = m_entries[ e ].hash & mask;
         
-        const cache_t::nth_index< 1 >::type& index = m_cache.get< 1 >();
-        return ( (int64_t)microsecond_timestamp() - (int64_t)index.begin()->m_ts ) / 1000;
+        while( m_slots[ i ] != none )
+            i = ( i + 1 ) & mask;
+        
+        m_slots[ i ] = e;
     }
     
-    pzq::message_t ackcache_t::pop()
+    void ackcache_t::eraseSlot( size_t i )
     {
-        if( m_cache.size() == 0) return pzq::message_t();
+        size_t mask = m_slots.size() - 1;
         
-        cache_t::nth_index< 1 >::type& index = m_cache.get< 1 >();
-        pzq::message_t msg = index.begin()->getAck();
-        index.erase( index.begin() );
-        return msg;
+        // shift back the entries that probed past the hole
+        for( size_t j = ( i + 1 ) & mask; m_slots[ j ] != none; j = ( j + 1 ) & mask )
+        {
+            size_t home = m_entries[ m_slots[ j ] ].hash & mask;
+            if( ( ( j - home ) & mask ) >= ( ( j - i ) & mask ) )
+            {
+                m_slots[ i ] = m_slots[ j ];
+                i = j;
+            }
+        }
+        m_slots[ i ] = none;
     }
     
-    ackcache_t::ack_t::ack_t( const string& idmsg, pzq::message_t ack, uint64_t ts, int replicas )
+    void ackcache_t::grow()
     {
-        m_idmsg = idmsg;
-        m_ts= ts;
-        m_ack = ack;
-        m_replicas = shared_ptr< int >( new int );
-        *m_replicas = replicas;
+        m_slots.assign( m_slots.size() * 2, (uint32_t)none );
+        
+        for( uint32_t e = m_head; e != none; e = m_entries[ e ].next )
+            insertSlot( e );
     }
     
-    ackcache_t::ack_t::~ack_t()
+    void ackcache_t::push( const std::string& idMsg, const pzq::message_t& ack, uint64_t peers, uint64_t tag )
     {
+        uint64_t hash = pzq::hash64( idMsg.data(), idMsg.size() );
+        size_t slot;
+        
+        if( find( idMsg.data(), idMsg.size(), hash, &slot ) != none )
+            return;
+        
+        // keep the table at most half full
+        if( ( m_size + 1 ) * 2 > m_slots.size() )
+            grow();
+        
+        size_t bytes = idMsg.size();
+        for( message_const_iterator_t it = ack.begin(); it != ack.end(); ++it )
+            bytes += sizeof( uint32_t ) + it->size();
+        
+        uint32_t e = m_free;
+        if( e != none )
+            m_free = m_entries[ e ].next;
+        else
+        {
+            e = m_entries.size();
+            m_entries.push_back( entry_t() );
+        }
+        
+        entry_t& entry = m_entries[ e ];
+        entry.hash = hash;
+        entry.deadline = m_clock->now() + m_timeoutReplication;
+        entry.peers = peers;
+        entry.tag = tag;
+        entry.keySize = idMsg.size();
+        entry.parts = ack.size();
+        entry.data = static_cast< char* >( pzq::slab_pool_t::local().allocate( bytes ) );
+        
+        char* p = entry.data;
+        memcpy( p, idMsg.data(), idMsg.size() );
+        p += idMsg.size();
+        
+        for( message_const_iterator_t it = ack.begin(); it != ack.end(); ++it )
+        {
+            uint32_t size = it->size();
+            memcpy( p, &size, sizeof( uint32_t ) );
+            memcpy( p + sizeof( uint32_t ), it->data(), size );
+            p += sizeof( uint32_t ) + size;
+        }
+        
+        // the clock is monotonic and the timeout fixed, so the tail is the latest
+        entry.prev = m_tail;
+        entry.next = none;
+        if( m_tail != none )
+            m_entries[ m_tail ].next = e;
+        else
+            m_head = e;
+        m_tail = e;
+        
+        insertSlot( e );
+        m_size++;
+        
+        // every entry gets the same timeout, a running timer is already earlier
+        if( m_timers && !m_timers->is_scheduled( m_timer ) )
+            m_timers->schedule( m_timer, entry.deadline );
     }
     
-    ackcache_t::ack_t::ack_t( const ack_t& ack )
+    void ackcache_t::take( uint32_t e, size_t slot, pzq::message_t& ack, uint64_t* tag )
     {
-        m_idmsg = ack.m_idmsg;
-        m_ts = ack.m_ts;
+        entry_t& entry = m_entries[ e ];
+        
+        if( tag )
+            *tag = entry.tag;
+        
+        if( entry.prev != none )
+            m_entries[ entry.prev ].next = entry.next;
+        else
+            m_head = entry.next;
+        
+        if( entry.next != none )
+            m_entries[ entry.next ].prev = entry.prev;
+        else
+            m_tail = entry.prev;
+        
+        eraseSlot( slot );
+        
+        ack.clear();
+        const char* p = entry.data + entry.keySize;
+        for( uint32_t i = 0; i < entry.parts; i++ )
+        {
+            uint32_t size;
+            memcpy( &size, p, sizeof( uint32_t ) );
+            ack.append( p + sizeof( uint32_t ), size );
+            p += sizeof( uint32_t ) + size;
+        }
+        
+        pzq::slab_pool_t::local().deallocate( entry.data );
+        entry.data = NULL;
+        entry.next = m_free;
+        m_free = e;
+        m_size--;
     }
     
-    pzq::message_t ackcache_t::ack_t::getAck() const
+    void ackcache_t::expire()
     {
-        return m_ack;
+        uint64_t now = m_clock->now();
+        
+        while( m_head != none && m_entries[ m_head ].deadline <= now )
+        {
+            entry_t& entry = m_entries[ m_head ];
+            pzq::message_t ack;
+            uint64_t tag;
+            size_t slot;
+            
+            find( entry.data, entry.keySize, entry.hash, &slot );
+            take( m_head, slot, ack, &tag );
+            m_expired( ack, tag );
+        }
+        
+        if( m_head != none )
+            m_timers->schedule( m_timer, m_entries[ m_head ].deadline );
     }
     
-    void ackcache_t::ack_t::decrementReplicas() const
+    bool ackcache_t::acknowledge( const string& id, int peer, bool success,
+                                  pzq::message_t& ack, uint64_t* tag )
     {
-        (*m_replicas)--;
+        uint64_t bit = uint64_t( 1 ) << peer;
+        size_t slot;
+        
+        uint32_t e = find( id.data(), id.size(), pzq::hash64( id.data(), id.size() ), &slot );
+        if( e == none || !( m_entries[ e ].peers & bit ) )
+            return false;
+        
+        m_entries[ e ].peers &= ~bit;
+        
+        if( success && m_entries[ e ].peers )
+            return true;
+        
+        take( e, slot, ack, tag );
+        return true;
     }
     
-    int ackcache_t::ack_t::getReplicas() const
+    pzq::message_t ackcache_t::pop()
     {
-        return *m_replicas;
+        pzq::message_t msg;
+        
+        if( m_head == none )
+            return msg;
+        
+        entry_t& entry = m_entries[ m_head ];
+        size_t slot;
+        
+        find( entry.data, entry.keySize, entry.hash, &slot );
+        take( m_head, slot, msg, NULL );
+        return msg;
     }
 }
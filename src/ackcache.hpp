@@ -18,67 +18,106 @@
 #define PZQ_ACKCACHE_HPP
 
 #include "pzq.hpp"
+#include "time.hpp"
+#include "timer.hpp"
 
-#include <boost/multi_index_container.hpp>
-#include <boost/multi_index/hashed_index.hpp>
-#include <boost/multi_index/ordered_index.hpp>
-#include <boost/multi_index/member.hpp>
+#include <vector>
 
 using namespace ::boost;
-using namespace ::boost::multi_index;
 
 namespace pzq
 {
+    /*
+     * Producer ACKs waiting for replicas, keyed by message key.
+     *
+     * Entries sit in one array and point at each other by index. An open
+     * addressed table with linear probing finds them by key, and a linked
+     * list through the entries keeps them in deadline order: every entry
+     * gets the same timeout on a monotonic clock, so push order is
+     * deadline order. The key and the ACK frames of an entry are packed
+     * into one buffer from the slab pool. Insert, acknowledge and expire
+     * are O(1) and reach the heap only when the arrays grow.
+     *
+     * Used from the manager thread only.
+     */
     class ackcache_t
     {
     public:
-        ackcache_t( uint64_t timeoutReplication );
+        typedef boost::function< void ( pzq::message_t&, uint64_t ) > expiry_handler_t;
+        
+        ackcache_t( uint64_t timeoutReplication, shared_ptr< pzq::clock_service_t > clock );
         ~ackcache_t();
         
-        void push( const std::string& idMsg, pzq::message_t ack, int replicas );
+        /*
+         * Acks still waiting for replicas when timeoutReplication runs out
+         * are handed to handler with their tag, driven by a timer on the
+         * given service
+         */
+        void setExpiryHandler( shared_ptr< pzq::timer_service_t > timers, expiry_handler_t handler );
         
-        pzq::message_t getAndRemoveById( std::string id );
+        /*
+         * peers is a bitmask of the cluster peers the replicas went to.
+         * tag is handed back with the ACK. An id already waiting keeps its
+         * first entry.
+         */
+        void push( const std::string& idMsg, const pzq::message_t& ack, uint64_t peers, uint64_t tag = 0 );
         
-        int getDelayUntilNextAck() const;
+        /*
+         * Records the answer of one peer. Returns false if the id is not
+         * waiting for that peer. When the last peer answers, or on the first
+         * failure, the entry is removed and ack receives the producer ACK
+         * and tag, if given, the tag it was pushed with
+         */
+        bool acknowledge( const std::string& id, int peer, bool success,
+                          pzq::message_t& ack, uint64_t* tag = NULL );
         
+        /*
+         * Removes the entry with the earliest deadline
+         */
         pzq::message_t pop();
         
-        class ack_t
-        {
-        public:
-            ack_t( const std::string& idMsg, pzq::message_t ack, uint64_t ts, int replicas );
-            ack_t( const ack_t& );
-            ~ack_t();
-            
-            pzq::message_t getAck() const;
-            void decrementReplicas() const;
-            int getReplicas() const;
-            
-        private:
-            ack_t();
-            ack_t& operator=( const ack_t& );
-            
-            pzq::message_t m_ack;
-            
-        public:
-            std::string m_idmsg;
-            uint64_t m_ts;
-            shared_ptr< int > m_replicas;
-        };
-        
-        typedef multi_index_container<
-            ack_t,
-            indexed_by<
-            hashed_unique< member< ack_t, std::string, &ack_t::m_idmsg > >,
-            ordered_unique< member< ack_t, uint64_t, &ack_t::m_ts > > > > cache_t;
+        size_t size() const;
         
     private:
         ackcache_t();
         ackcache_t( const ackcache_t& );
         ackcache_t& operator=( const ackcache_t& );
         
-        cache_t  m_cache;
+        enum { none = 0xffffffff };
+        
+        struct entry_t
+        {
+            uint64_t hash;
+            uint64_t deadline;
+            uint64_t peers;
+            uint64_t tag;
+            char*    data;      // key, then [u32 size][bytes] per ACK frame
+            uint32_t keySize;
+            uint32_t parts;
+            uint32_t prev;      // deadline order
+            uint32_t next;      // deadline order, or the next free entry
+        };
+        
+        void expire();
+        
+        uint32_t find( const char* key, size_t size, uint64_t hash, size_t* slot ) const;
+        void insertSlot( uint32_t e );
+        void eraseSlot( size_t slot );
+        void grow();
+        void take( uint32_t e, size_t slot, pzq::message_t& ack, uint64_t* tag );
+        
+        std::vector< entry_t >  m_entries;
+        std::vector< uint32_t > m_slots;
+        size_t                  m_size;
+        uint32_t                m_free;
+        uint32_t                m_head;
+        uint32_t                m_tail;
+        
         uint64_t m_timeoutReplication;
+        shared_ptr< pzq::clock_service_t > m_clock;
+        shared_ptr< pzq::timer_service_t > m_timers;
+        pzq::timer_id_t m_timer;
+        expiry_handler_t m_expired;
     };
 }
 
@@ -18,68 +18,226 @@
 #include "time.hpp"
 #include "ackcache.hpp"
 
+#include <algorithm>
+
 using std::vector;
 using std::string;
 using boost::shared_ptr;
 
+namespace
+{
+    bool hasPrefix( zmq::message_t& part, const char* prefix, size_t len )
+    {
+        return part.size() >= len && !memcmp( part.data(), prefix, len );
+    }
+    
+    int countBits( uint64_t mask )
+    {
+        int count = 0;
+        for( ; mask; mask &= mask - 1 )
+            count++;
+        return count;
+    }
+}
+
 namespace pzq
 {
-    cluster_t::cluster_t( int replicas, const vector< string >& nodeNames, uint64_t timeoutNode, 
-                          boost::shared_ptr< pzq::socket_t > clusterSocket,
+    cluster_t::cluster_t( zmq::context_t& context, int replicas, const peerlist_t& peers, int window, uint64_t timeoutNode,
                           boost::shared_ptr< pzq::socket_t > broadcastSocket,
                           boost::shared_ptr< pzq::socket_t > subscribeSocket,
                           string currentNode,
-                          boost::shared_ptr< pzq::datastore_t > store )
+                          boost::shared_ptr< pzq::datastore_t > store,
+                          boost::shared_ptr< pzq::clock_service_t > clock )
+        : m_io( context, broadcastSocket )
     {
         m_replicas = replicas;
+        m_clock = clock;
+        m_timeoutNode = timeoutNode;
+        
+        uint64_t curtime = m_clock->now();
+        
+        // Named peers are members from the start, unnamed ones are seeds
+        m_peers = peers;
+        for( size_t p = 0; p < m_peers.size(); p++ )
+        {
+            m_io.set_peer( p, m_peers[ p ].socket );
+            m_peers[ p ].socket.reset();
+            
+            if( m_peers[ p ].name.empty() )
+                continue;
+            
+            member_t member( m_timeoutNode / 10, curtime );
+            member.address = m_peers[ p ].address;
+            member.peer = (int)p;
+            m_members.insert( std::make_pair( m_peers[ p ].name, member ) );
+            m_live.push_back( p );
+        }
         
-        uint64_t curtime = microsecond_timestamp();
+        // A restarted node starts above anything it announced before
+        m_heartbeat = m_clock->wall();
+        m_phiThreshold = 8.0;
+        m_lastGossip = 0;
+        m_partitions = 0;
+        m_vnodes = 0;
+        m_bootstrapRate = 0;
+        m_bootstrapped = 0;
+        m_membershipChanges = 0;
         
-        for( vector< string >::const_iterator it = nodeNames.begin(); it != nodeNames.end(); ++it )
-            m_nodelist[ *it ] = curtime;
+        m_window = window;
+        m_nextPeer = 0;
+        m_maxBatch = 1;
+        m_linger = 0;
+        m_timeoutReplication = 0;
+        m_antiEntropyInterval = 0;
         
-        m_timeoutNode = timeoutNode;
-        m_out = clusterSocket;
-        m_pub = broadcastSocket;
+        // Receivers spot a restarted sender by the epoch
+        std::ostringstream header;
+        header << m_clock->wall() << ":" << currentNode;
+        m_streamHeader = "BATCH:" + header.str();
+        m_removeHeader = "REMOVES:" + header.str();
+        m_removeSeq = 1;
+        m_removeGaps = 0;
         m_sub = subscribeSocket;
         m_currentNode = currentNode;
         m_store= store;
         
-        m_nextBroadcast = microsecond_timestamp();
-        m_timeoutState = false;
         pzq::log( "Connect to cluster" );
     }
     
-    cluster_t::~cluster_t()
+    void cluster_t::setTimers( shared_ptr< pzq::timer_service_t > timers,
+                               boost::function< void ( const string& ) > onNodeTimeout )
+    {
+        m_timers = timers;
+        m_onNodeTimeout = onNodeTimeout;
+        
+        m_flushTimer = m_timers->create( boost::bind( &cluster_t::flushAll, this ) );
+        
+        m_bootstrapTimer = m_timers->create( boost::bind( &cluster_t::stepBootstraps, this ) );
+        
+        m_removeTimer = m_timers->create( boost::bind( &cluster_t::flushRemoves, this ) );
+        
+        m_gossipTimer = m_timers->create( boost::bind( &cluster_t::gossip, this ) );
+        m_timers->schedule( m_gossipTimer, m_clock->now() );
+        
+        if( m_antiEntropyInterval )
+        {
+            m_antiEntropyTimer = m_timers->create( boost::bind( &cluster_t::sendDigests, this ) );
+            m_timers->schedule_after( m_antiEntropyTimer, m_antiEntropyInterval );
+        }
+        
+        m_io.start();
+    }
+    
+    void cluster_t::setMembership( const string& address, connector_t connector, double phiThreshold )
+    {
+        m_address = address;
+        m_connector = connector;
+        m_phiThreshold = phiThreshold;
+    }
+    
+    void cluster_t::setPeerBuffer( size_t bytes )
+    {
+        m_io.set_limit( bytes );
+    }
+    
+    uint64_t cluster_t::backlog() const
+    {
+        uint64_t bytes = 0;
+        for( size_t p = 0; p < m_peers.size(); p++ )
+            bytes += m_io.backlog( p );
+        
+        return bytes;
+    }
+    
+    uint64_t cluster_t::droppedSends() const
+    {
+        return m_io.dropped();
+    }
+    
+    uint64_t cluster_t::membershipChanges() const
+    {
+        return m_membershipChanges;
+    }
+    
+    void cluster_t::setPartitions( int partitions, int vnodes )
+    {
+        m_partitions = partitions;
+        m_vnodes = vnodes;
+        rebuildRing();
+    }
+    
+    int cluster_t::partition( const string& id ) const
+    {
+        return m_partitions ? ring_t::partition( id.data(), id.size(), m_partitions ) : -1;
+    }
+    
+    bool cluster_t::redirect( int partition, string& address ) const
+    {
+        if( partition < 0 || m_ring.owners( partition ).empty() )
+            return false;
+        
+        int p = m_ringPeers[ m_ring.owners( partition ).front() ];
+        if( p < 0 || m_peers[ p ].address.empty() )
+            return false;
+        
+        address = m_peers[ p ].address;
+        return true;
+    }
+    
+    int cluster_t::ownedPartitions() const
     {
+        int owned = 0;
+        
+        for( int p = 0; p < m_partitions; p++ )
+            if( !m_ring.owners( p ).empty() && m_ringPeers[ m_ring.owners( p ).front() ] < 0 )
+                owned++;
+        
+        return owned;
     }
     
-    message_t cluster_t::createReplica( message_t orig ) const
+    void cluster_t::describePartitions( std::ostream& out ) const
     {
-        message_t replica;
+        out << "partitions: " << m_partitions << std::endl;
         
-        message_iterator_t it = orig.begin();
-        ++it;
+        for( int p = 0; p < m_partitions; p++ )
+        {
+            if( m_ring.owners( p ).empty() )
+                continue;
+            
+            int peer = m_ringPeers[ m_ring.owners( p ).front() ];
+            out << "partition: " << p << " " << ( peer < 0 ? m_address : m_peers[ peer ].address ) << std::endl;
+        }
+    }
+    
+    void cluster_t::rebuildRing()
+    {
+        if( !m_partitions )
+            return;
         
-        replica.append( *it );
-        ++it;
+        // ourselves first, then the live peers
+        std::vector< string > nodes;
+        m_ringPeers.clear();
         
-        string srcReplica = "REPLICA:";
-        srcReplica += m_currentNode;
-        replica.append( srcReplica );
+        nodes.push_back( m_currentNode );
+        m_ringPeers.push_back( -1 );
         
-        while( it != orig.end() )
+        for( size_t i = 0; i < m_live.size(); i++ )
         {
-            replica.append( *it );
-            ++it;
+            nodes.push_back( m_peers[ m_live[ i ] ].name );
+            m_ringPeers.push_back( (int)m_live[ i ] );
         }
         
-        return replica;
+        m_ring.build( nodes, m_partitions, m_vnodes, m_replicas + 1 );
     }
     
-    void cluster_t::setTimeoutState()
+    bool cluster_t::isAlive( const string& node ) const
+    {
+        members_t::const_iterator it = m_members.find( node );
+        return it != m_members.end() && it->second.state == member_alive;
+    }
+    
+    cluster_t::~cluster_t()
     {
-        m_timeoutState = true;
     }
     
     int cluster_t::replicas() const
@@ -89,50 +247,292 @@ namespace pzq
     
     int cluster_t::countActiveNodes() const
     {
-        uint64_t curtime = microsecond_timestamp();
-        int count = 0;
+        return (int)m_live.size();
+    }
+    
+    bool cluster_t::shouldSendReplica( string replicaSource ) const
+    {
+        return !isAlive( replicaSource );
+    }
+    
+    size_t cluster_t::countPeers() const
+    {
+        return m_peers.size();
+    }
+    
+    boost::shared_ptr< pzq::socket_t > cluster_t::getEventSocket()
+    {
+        return m_io.get_event_socket();
+    }
+    
+    int cluster_t::peerIndex( const string& name ) const
+    {
+        for( size_t p = 0; p < m_peers.size(); p++ )
+            if( m_peers[ p ].name == name )
+                return (int)p;
         
-        for( nodelist_t::const_iterator it = m_nodelist.begin(); it != m_nodelist.end(); ++it )
-            if( ( (int64_t)it->second - (int64_t)curtime ) < m_timeoutNode )
-                count++;
+        return -1;
+    }
+    
+    void cluster_t::setBatching( size_t maxBatch, uint64_t linger, uint64_t timeoutReplication )
+    {
+        m_maxBatch = maxBatch;
+        m_linger = linger;
+        m_timeoutReplication = timeoutReplication;
+    }
+    
+    void cluster_t::setAntiEntropy( uint64_t interval )
+    {
+        m_antiEntropyInterval = interval;
+    }
+    
+    uint64_t cluster_t::placeReplicas( int count, int partition )
+    {
+        uint64_t placed = 0;
+        size_t n = m_live.size();
         
-        return count;
+        if( n == 0 )
+            return 0;
+        
+        if( partition >= 0 && m_partitions )
+        {
+            const std::vector< int >& owners = m_ring.owners( partition );
+            
+            for( size_t i = 0; i < owners.size() && count > 0; i++ )
+            {
+                int p = m_ringPeers[ owners[ i ] ];
+                if( p < 0 )
+                    continue;
+                
+                expireBatches( m_peers[ p ] );
+                if( m_peers[ p ].outstanding >= m_window || m_io.congested( p ) )
+                    continue;
+                
+                placed |= uint64_t( 1 ) << p;
+                count--;
+            }
+            return placed;
+        }
+        
+        for( size_t i = 0; i < n; i++ )
+            expireBatches( m_peers[ m_live[ i ] ] );
+        
+        // start at a different peer every time so ties spread evenly
+        size_t start = m_nextPeer++ % n;
+        
+        for( int i = 0; i < count; i++ )
+        {
+            size_t best = m_peers.size();
+            for( size_t j = 0; j < n; j++ )
+            {
+                size_t p = m_live[ ( start + j ) % n ];
+                if( ( placed & ( uint64_t( 1 ) << p ) ) ||
+                    m_peers[ p ].outstanding >= m_window || m_io.congested( p ) )
+                    continue;
+                
+                if( best == m_peers.size() || m_peers[ p ].outstanding < m_peers[ best ].outstanding )
+                    best = p;
+            }
+            
+            if( best == m_peers.size() )
+                break;
+            
+            placed |= uint64_t( 1 ) << best;
+        }
+        
+        return placed;
     }
     
-    bool cluster_t::shouldSendReplica( string replicaSource ) const
+    void cluster_t::sendReplicas( const string& key, message_t& parts, uint64_t mask, uint64_t lease )
+    {
+        for( size_t p = 0; p < m_peers.size(); p++ )
+            if( mask & ( uint64_t( 1 ) << p ) )
+                queueReplica( p, key, parts, lease );
+    }
+    
+    void cluster_t::queueReplica( size_t p, const string& key, message_t& parts, uint64_t lease )
     {
-        uint64_t curtime = microsecond_timestamp();
+        peer_t& peer = m_peers[ p ];
         
-        nodelist_t::const_iterator it = m_nodelist.find( replicaSource );
-        if( it != m_nodelist.end() &&
-            ( (int64_t)it->second - (int64_t)curtime ) < m_timeoutNode )
-            return false;
+        // [key][number of parts[:lease]][parts]
+        char count[ 48 ];
+        int len = lease ? snprintf( count, sizeof( count ), "%lu:%llu", (unsigned long)parts.size(),
+                                    (unsigned long long)lease )
+                        : snprintf( count, sizeof( count ), "%lu", (unsigned long)parts.size() );
         
-        return true;
+        peer.batch.append( key );
+        peer.batch.append( count, len );
+        for( message_iterator_t it = parts.begin(); it != parts.end(); ++it )
+            peer.batch.append_copy( *it );
+        
+        peer.batchKeys.push_back( key );
+        peer.outstanding++;
+        
+        if( peer.batchKeys.size() >= m_maxBatch )
+            flush( p );
+        else if( m_timers && !m_timers->is_scheduled( m_flushTimer ) )
+            m_timers->schedule_after( m_flushTimer, m_linger );
     }
     
-    /*
-     * If a replica is here since m_timeoutNode we broadcast a checkmessage. 
-     * The replica source will broadcast a remove message if it is no longer in its database
-     */
-    void cluster_t::checkReplica( const string& key,
-                                  const string& owner )
+    void cluster_t::flush( size_t p )
     {
-        uint64_t curtime = microsecond_timestamp();
+        peer_t& peer = m_peers[ p ];
         
-        string sts = key.substr( 0, key.find_first_of( '|' ) );
-        std::istringstream ss( sts );
+        if( peer.batchKeys.empty() )
+            return;
         
-        uint64_t ts;
-        ss >> ts;
+        // [seq][BATCH:<epoch>:<node>][""][replicas]
+        char seq[ 24 ];
+        int len = snprintf( seq, sizeof( seq ), "%llu", (unsigned long long)peer.nextSeq );
+        
+        pzq::message_t msg;
+        msg.append( seq, len );
+        msg.append( m_streamHeader );
+        msg.append();
+        for( message_iterator_t it = peer.batch.begin(); it != peer.batch.end(); ++it )
+            msg.append( *it );
+        peer.batch.clear();
+        
+        // placement stops choosing the peer while its buffer is full
+        if( m_io.send( p, msg, cluster_io_t::send_backpressure ) )
+        {
+            peer.inflight.push_back( batch_t() );
+            batch_t& batch = peer.inflight.back();
+            batch.seq = peer.nextSeq++;
+            batch.sent = m_clock->now();
+            batch.keys.swap( peer.batchKeys );
+        }
+        else
+        {
+            // only once the I/O thread has stopped, the ack cache reports
+            // these to the producer when they time out
+            pzq::log( "Cluster I/O thread stopped, dropping %lu replicas for %s",
+                      (unsigned long)peer.batchKeys.size(), peer.name.c_str() );
+            peer.outstanding -= peer.batchKeys.size();
+            peer.batchKeys.clear();
+        }
+    }
+    
+    void cluster_t::flushAll()
+    {
+        for( size_t p = 0; p < m_peers.size(); p++ )
+            flush( p );
+    }
+    
+    void cluster_t::expireBatches( peer_t& peer )
+    {
+        uint64_t now = m_clock->now();
         
-        if( ( ( int64_t )curtime - ( int64_t )ts ) > m_timeoutNode )
-            broadcastCheck( key, owner );
+        // lost batches or ACKs, the producer has already been told
+        while( !peer.inflight.empty() && peer.inflight.front().sent + m_timeoutReplication <= now )
+        {
+            peer.outstanding -= peer.inflight.front().keys.size();
+            peer.inflight.pop_front();
+        }
     }
     
-    boost::shared_ptr< pzq::socket_t > cluster_t::getOutSocket()
+    bool cluster_t::isNodeMessage( zmq::message_t& header ) const
     {
-        return m_out;
+        return hasPrefix( header, "BATCH:", 6 ) ||
+               hasPrefix( header, "DIGEST:", 7 ) ||
+               hasPrefix( header, "KEYS:", 5 ) ||
+               hasPrefix( header, "RESYNC:", 7 ) ||
+               hasPrefix( header, "JOIN:", 5 );
+    }
+    
+    void cluster_t::handleNodeMessage( zmq::message_t& seq, zmq::message_t& header,
+                                       message_t& parts, message_t& reply )
+    {
+        string type( (char*)header.data(), header.size() );
+        
+        if( hasPrefix( header, "BATCH:", 6 ) )
+            applyBatch( seq, type.substr( 6 ), parts, reply );
+        else if( hasPrefix( header, "DIGEST:", 7 ) )
+            handleDigest( type.substr( 7 ), parts, reply );
+        else if( hasPrefix( header, "JOIN:", 5 ) )
+            handleJoin( type.substr( 5 ), parts, reply );
+        else if( hasPrefix( header, "RESYNC:", 7 ) )
+            handleResync( parts, reply );
+        else
+            handleKeys( parts, reply );
+    }
+    
+    void cluster_t::applyBatch( zmq::message_t& seqPart, const string& source,
+                                message_t& parts, message_t& ack )
+    {
+        string seqStr( (char*)seqPart.data(), seqPart.size() );
+        uint64_t seq = strtoull( seqStr.c_str(), NULL, 10 );
+        
+        // <epoch>:<node>
+        size_t colon = source.find( ':' );
+        uint64_t epoch = strtoull( source.substr( 0, colon ).c_str(), NULL, 10 );
+        string node = ( colon == string::npos ) ? "" : source.substr( colon + 1 );
+        
+        stream_t& stream = m_streams[ node ];
+        if( stream.epoch != epoch || seq != stream.expected )
+        {
+            // new stream or batches went missing, start a new run
+            stream.epoch = epoch;
+            stream.runStart = seq;
+        }
+        stream.expected = seq + 1;
+        
+        string key;
+        bool success = true, inBatch = false;
+        
+        try
+        {
+            m_store->begin_batch();
+            inBatch = true;
+            
+            while( parts.size() >= 2 )
+            {
+                parts.front( key );
+                parts.pop_front();
+                
+                string count;
+                parts.front( count );
+                parts.pop_front();
+                
+                char* end;
+                size_t n = strtoul( count.c_str(), &end, 10 );
+                uint64_t lease = ( *end == ':' ) ? strtoull( end + 1, NULL, 10 ) : 0;
+                if( n == 0 || n > parts.size() )
+                    throw std::runtime_error( "Malformed replication batch" );
+                
+                pzq::message_t record;
+                for( size_t i = 0; i < n; i++ )
+                {
+                    record.append( parts.front() );
+                    parts.pop_front();
+                }
+                m_store->save_replica( node, record, key, lease );
+            }
+            
+            inBatch = false;
+            m_store->end_batch( true );
+        }
+        catch( std::exception& e )
+        {
+            pzq::log( "Failed to store replication batch %llu from %s: %s",
+                      (unsigned long long)seq, node.c_str(), e.what() );
+            success = false;
+            
+            if( inBatch )
+            {
+                try { m_store->end_batch( false ); } catch( std::exception& e ) {}
+            }
+        }
+        
+        // [first seq of the run][seq][status]
+        char runStart[ 24 ];
+        int len = snprintf( runStart, sizeof( runStart ), "%llu", (unsigned long long)stream.runStart );
+        ack.append( runStart, len );
+        ack.append( seqPart );
+        ack.append( (void*)( success ? "1" : "0" ), 1 );
+        
+        if( !success )
+            stream.runStart = seq + 1;
     }
     
     boost::shared_ptr< pzq::socket_t > cluster_t::getSubSocket()
@@ -140,179 +540,962 @@ namespace pzq
         return m_sub;
     }
     
-    void cluster_t::handleAck( shared_ptr< pzq::socket_t > in,
-                               shared_ptr< ackcache_t > ackCache )
+    void cluster_t::handleEvents( shared_ptr< pzq::socket_t > in,
+                                  shared_ptr< ackcache_t > ackCache )
     {
+        // Signals first, anything queued after the drain brings a new one
+        zmq::message_t signal;
+        while( m_io.get_event_socket()->recv( &signal, ZMQ_NOBLOCK ) )
+            ;
+        
+        size_t p;
         pzq::message_t parts;
         
-        if( m_out.get()->recv_many(parts) >= 2 )
+        while( m_io.next_event( p, parts ) )
         {
-            message_iterator_t it = parts.begin();
-            string id = string( (char*)(*it)->data(), (*it)->size() );
-            ++it;
+            if( p < m_peers.size() && parts.size() > 0 )
+                handleAck( p, parts, in, ackCache );
+            parts.clear();
+        }
+    }
+    
+    void cluster_t::handleAck( size_t p, message_t& parts,
+                               shared_ptr< pzq::socket_t > in,
+                               shared_ptr< ackcache_t > ackCache )
+    {
+        peer_t& peer = m_peers[ p ];
+        
+        if( hasPrefix( parts.front(), "DIFF", 4 ) )
+            handleDiff( p, parts );
+        else if( hasPrefix( parts.front(), "ORPHANS", 7 ) )
+            handleOrphans( p, parts );
+        else if( hasPrefix( parts.front(), "MEMBERS", 7 ) )
+            handleMembers( p, parts );
+        else if( hasPrefix( parts.front(), "REMOVES:", 8 ) )
+            handleReplay( parts );
+        else if( parts.size() >= 3 )
+        {
+            string from, to;
+            parts.front( from );
+            parts.pop_front();
+            parts.front( to );
+            parts.pop_front();
             
-            string success = string( (char*)(*it)->data(), (*it)->size() );
-            if( success.size() == 0 || success[0] != '1' )
-                sendAndEraseNegativeAck( in, ackCache, id );
-            else
-                sendAndErasePositiveAck( in, ackCache, id );
+            uint64_t first = strtoull( from.c_str(), NULL, 10 );
+            uint64_t last = strtoull( to.c_str(), NULL, 10 );
+            bool success = ( parts.front().size() > 0 && *(char*)parts.front().data() == '1' );
+            
+            // Everything up to last has been seen. Batches before the run
+            // never arrived, the status only applies to the last one
+            while( !peer.inflight.empty() && peer.inflight.front().seq <= last )
+            {
+                batch_t& batch = peer.inflight.front();
+                bool stored = batch.seq >= first && ( batch.seq < last || success );
+                
+                if( stored )
+                    m_replicationLatency.record( m_clock->now() > batch.sent ? m_clock->now() - batch.sent : 0 );
+                
+                for( std::vector< string >::iterator it = batch.keys.begin(); it != batch.keys.end(); ++it )
+                {
+                    if( stored && m_tracer && m_tracer->active() )
+                        m_tracer->record( *it, pzq::trace_replica_ack );
+                    ackReplica( p, *it, stored, in, ackCache );
+                }
+                
+                peer.outstanding -= batch.keys.size();
+                peer.inflight.pop_front();
+            }
         }
     }
     
-    void cluster_t::sendAndEraseNegativeAck( shared_ptr< pzq::socket_t > in,
-                                             shared_ptr< ackcache_t > ackCache,
-                                             std::string id )
+    void cluster_t::ackReplica( size_t p, const string& key, bool success,
+                                shared_ptr< pzq::socket_t > in,
+                                shared_ptr< ackcache_t > ackCache )
     {
-        pzq::message_t ack = ackCache->getAndRemoveById( id );
-        if( ack.size() )
+        pzq::message_t ack;
+        uint64_t tag;
+        
+        if( !ackCache->acknowledge( key, (int)p, success, ack, &tag ) || ack.size() == 0 )
+            return;
+        
+        if( !success )
         {
             message_iterator_t it = ack.begin();
             ++it;
             ++it;
-            ((char*)(*it)->data())[0] = '0';
-            
-            sendAck( in, ack );
+            ((char*)it->data())[0] = '0';
         }
+        sendAck( in, ack, tag );
     }
     
-    void cluster_t::sendAndErasePositiveAck( shared_ptr< pzq::socket_t > in,
-                                             shared_ptr< ackcache_t > ackCache,
-                                             std::string id )
+    void cluster_t::sendAck( shared_ptr< pzq::socket_t > in,
+                             pzq::message_t& ack, uint64_t tag )
     {
-        pzq::message_t ack = ackCache->getAndRemoveById( id );
-        if( ack.size() )
-            sendAck( in, ack );
+        if( m_ackHandler )
+            m_ackHandler( ack, tag );
         else
-            broadcastRemove( id );
+            in->send_many( ack );
     }
     
-    void cluster_t::sendAck( shared_ptr< pzq::socket_t > in,
-                             pzq::message_t ack )
+    void cluster_t::broadcastRemove( const string& id )
+    {
+        broadcastRemove( id.data(), id.size() );
+    }
+    
+    void cluster_t::broadcastRemove( const char* id, size_t size )
+    {
+        m_removes.add( id, size );
+        
+        if( m_removes.size() >= remove_max || !m_timers )
+            flushRemoves();
+        else if( !m_timers->is_scheduled( m_removeTimer ) )
+            m_timers->schedule_after( m_removeTimer, remove_interval );
+    }
+    
+    uint64_t cluster_t::removeGaps() const
+    {
+        return m_removeGaps;
+    }
+    
+    pzq::histogram_t& cluster_t::replicationLatency()
     {
-        in->send_many( ack );
+        return m_replicationLatency;
     }
     
-    int cluster_t::getDelayUntilNextBroadcast() const
+    void cluster_t::setTracer( boost::shared_ptr< pzq::tracer_t > tracer )
     {
-        uint64_t curtime = microsecond_timestamp();
-        return ( (int64_t)m_nextBroadcast - (int64_t)curtime ) / 1000;
+        m_tracer = tracer;
     }
     
-    int cluster_t::getDelayUntilNextNodeTimeout() const
+    void cluster_t::setAckHandler( ack_handler_t handler )
     {
-        uint64_t next = std::numeric_limits<uint64_t>::max();
+        m_ackHandler = handler;
+    }
+    
+    /*
+     * Removals. The keys consumed since the last frame go out on the bus
+     * as [REMOVES:<epoch>:<node>][seq][key set], numbered per sender. A
+     * receiver that sees a sequence number jump asks the sender for the
+     * frames in between with RESYNC, the sender answers from the frames
+     * it still has and anti-entropy catches whatever is older.
+     */
+    void cluster_t::flushRemoves()
+    {
+        if( m_removes.empty() )
+            return;
+        
+        m_removes.encode( m_removeFrame );
+        
+        char seq[ 24 ];
+        int len = snprintf( seq, sizeof( seq ), "%llu", (unsigned long long)m_removeSeq );
+        
+        pzq::message_t msg;
+        msg.append( "CLUSTER", 7 );
+        msg.append( m_removeHeader );
+        msg.append( seq, len );
+        msg.append( m_removeFrame );
+        m_io.publish( msg );
         
-        if( !m_timeoutState )
+        m_removeHistory.push_back( std::make_pair( m_removeSeq++, m_removeFrame ) );
+        if( m_removeHistory.size() > remove_history )
+            m_removeHistory.pop_front();
+    }
+    
+    void cluster_t::applyRemoves( const string& source, zmq::message_t& seqPart, zmq::message_t& keys, bool replay )
+    {
+        string seqStr( (char*)seqPart.data(), seqPart.size() );
+        uint64_t seq = strtoull( seqStr.c_str(), NULL, 10 );
+        
+        // <epoch>:<node>
+        size_t colon = source.find( ':' );
+        uint64_t epoch = strtoull( source.substr( 0, colon ).c_str(), NULL, 10 );
+        string node = ( colon == string::npos ) ? "" : source.substr( colon + 1 );
+        
+        stream_t& stream = m_removeStreams[ node ];
+        if( replay )
+        {
+            // the sender restarted since we asked
+            if( stream.epoch != epoch )
+                return;
+        }
+        else if( stream.epoch != epoch )
         {
-            for( nodelist_t::const_iterator it = m_nodelist.begin(); it != m_nodelist.end(); ++it )
+            // first frame we hear from this run of the sender
+            stream.epoch = epoch;
+            stream.expected = seq + 1;
+        }
+        else if( seq >= stream.expected )
+        {
+            int p = peerIndex( node );
+            if( seq > stream.expected && p >= 0 )
             {
-                if( it->second < next )
-                    next = it->second;
+                // [0][RESYNC:<node>][""][from][to]
+                char from[ 24 ], to[ 24 ];
+                int fromLen = snprintf( from, sizeof( from ), "%llu", (unsigned long long)stream.expected );
+                int toLen = snprintf( to, sizeof( to ), "%llu", (unsigned long long)seq );
+                
+                pzq::message_t msg;
+                msg.append( "0", 1 );
+                msg.append( "RESYNC:" + m_currentNode );
+                msg.append();
+                msg.append( from, fromLen );
+                msg.append( to, toLen );
+                m_io.send( p, msg, cluster_io_t::send_drop );
+                
+                m_removeGaps += seq - stream.expected;
             }
+            stream.expected = seq + 1;
+        }
+        
+        std::vector< string > ids;
+        if( !key_set_t::decode( (const char*)keys.data(), keys.size(), ids ) )
+        {
+            pzq::log( "Malformed removal frame %llu from %s", (unsigned long long)seq, node.c_str() );
+            return;
         }
         
-        uint64_t curtime = microsecond_timestamp();
-        return ( (int64_t)next - (int64_t)curtime ) / 1000;
+        try
+        {
+            m_store->remove_replicas( ids );
+        }
+        catch( std::exception& e )
+        {
+            pzq::log( "Failed to apply removal frame %llu from %s: %s",
+                      (unsigned long long)seq, node.c_str(), e.what() );
+        }
     }
     
-    void cluster_t::broadcastKeepAlive()
+    void cluster_t::handleResync( message_t& parts, message_t& reply )
     {
-        pzq::message_t kalv;
-        kalv.append( "CLUSTER" );
-        kalv.append( "KALV" );
-        kalv.append( m_currentNode );
+        if( parts.size() < 2 )
+            return;
         
-        m_pub->send_many( kalv );
+        string fromStr, toStr;
+        parts.front( fromStr );
+        parts.pop_front();
+        parts.front( toStr );
         
-        uint64_t curtime = microsecond_timestamp();
-        m_nextBroadcast = curtime + m_timeoutNode / 10;
-    }
-    
-    void cluster_t::broadcastRemove( const string& id )
-    {
-        pzq::message_t rm;
-        rm.append( "CLUSTER" );
-        rm.append( "REMOVE" );
-        rm.append( id );
+        uint64_t from = strtoull( fromStr.c_str(), NULL, 10 );
+        uint64_t to = strtoull( toStr.c_str(), NULL, 10 );
+        
+        if( m_removeHistory.empty() || m_removeHistory.front().first > from )
+            pzq::log( "Removal frames from %llu are no longer kept, anti-entropy will catch up",
+                      (unsigned long long)from );
         
-        m_pub->send_many( rm );
+        // [REMOVES:<epoch>:<node>][seq][key set]...
+        reply.append( m_removeHeader );
+        
+        for( std::deque< std::pair< uint64_t, string > >::const_iterator it = m_removeHistory.begin();
+             it != m_removeHistory.end(); ++it )
+        {
+            if( it->first < from || it->first >= to )
+                continue;
+            
+            char seq[ 24 ];
+            int len = snprintf( seq, sizeof( seq ), "%llu", (unsigned long long)it->first );
+            reply.append( seq, len );
+            reply.append( it->second );
+        }
+        
+        if( reply.size() == 2 )
+            reply.pop_back();
     }
     
-    void cluster_t::broadcastCheck( const string& id,
-                                    const string& owner )
+    void cluster_t::handleReplay( message_t& parts )
     {
-        pzq::message_t chk;
-        chk.append( "CLUSTER" );
-        chk.append( "CHECK" );
-        chk.append( id );
-        chk.append( owner );
+        string header;
+        parts.front( header );
+        parts.pop_front();
         
-        m_pub->send_many( chk );
+        while( parts.size() >= 2 )
+        {
+            applyRemoves( header.substr( 8 ), parts[ 0 ], parts[ 1 ], true );
+            parts.pop_front();
+            parts.pop_front();
+        }
     }
     
     void cluster_t::handleNodesMessage()
     {
         pzq::message_t msg;
-        if( m_sub->recv_many( msg ) > 1 )
+        int flags = 0;
+        
+        // Drain the bus, heartbeats left queued would look like silence
+        // to the failure detector
+        while( m_sub->recv_many( msg, flags ) > 0 )
         {
+            flags = ZMQ_NOBLOCK;
+            if( msg.size() < 2 )
+            {
+                msg.clear();
+                continue;
+            }
+            
             msg.pop_front();
-            pzq::message_part_t part = msg.front();
-            string type = string( ( char* )part->data(), part->size() );
+            string type;
+            msg.front( type );
             
-            if( type == "KALV" )
-                handleKeepAlive( msg );
+            if( type == "GOSSIP" )
+            {
+                msg.pop_front();
+                mergeMembers( msg );
+            }
+            else if( hasPrefix( msg.front(), "REMOVES:", 8 ) && msg.size() >= 3 )
+                applyRemoves( type.substr( 8 ), msg[ 1 ], msg[ 2 ], false );
             else if( type == "REMOVE" )
+            {
+                // single key from a node running an older version
                 handleRemove( msg );
-            else if( type == "CHECK" )
-                handleCheck( msg );
+            }
+            
+            msg.clear();
         }
     }
     
-    void cluster_t::handleKeepAlive( pzq::message_t msg )
+    void cluster_t::handleRemove( pzq::message_t& msg )
     {
         msg.pop_front();
         
-        pzq::message_part_t part = msg.front();
-        string node = string( ( char* )part->data(), part->size() );
+        string id;
+        msg.front( id );
         
-        uint64_t curtime = microsecond_timestamp();
-        m_nodelist[ node ] = curtime;
-        m_timeoutState = false;
+        try
+        {
+            m_store->removeReplica( id );
+        }
+        catch( pzq::datastore_exception e )
+        {
+            printf("could not find %s", id.c_str());
+        }
     }
     
-    void cluster_t::handleRemove( pzq::message_t msg )
+    /*
+     * Membership. Every timeoutNode / 10 each node gossips its member list
+     * on the cluster bus, one [name][address][heartbeat] triple per node
+     * with itself first and a fresh heartbeat. Nodes keep the highest
+     * heartbeat they hear for every node, so news of a node reaches even
+     * the nodes that do not hear it directly. Each node decides on its
+     * own when another one is down, a node leaving on purpose marks its
+     * last heartbeat with an L. New nodes JOIN through any seed node and
+     * get its member list back.
+     */
+    void cluster_t::gossip()
     {
-        msg.pop_front();
+        uint64_t now = m_clock->now();
+        uint64_t interval = m_timeoutNode / 10;
         
-        pzq::message_part_t part = msg.front();
-        string id = string( ( char* )part->data(), part->size() );
+        // After a stall of our own the silence of the others says nothing
+        bool stalled = m_lastGossip && now - m_lastGossip > 2 * interval;
+        m_lastGossip = now;
+        m_heartbeat++;
         
-        try
+        pzq::message_t msg;
+        msg.append( "CLUSTER", 7 );
+        msg.append( "GOSSIP", 6 );
+        appendMembers( msg );
+        m_io.publish( msg );
+        
+        // Seeds that have not answered yet
+        for( size_t p = 0; m_connector && p < m_peers.size(); p++ )
         {
-            m_store->removeReplica( id );
+            if( !m_peers[ p ].name.empty() || m_peers[ p ].address.empty() )
+                continue;
+            
+            char heartbeat[ 24 ];
+            int len = snprintf( heartbeat, sizeof( heartbeat ), "%llu", (unsigned long long)m_heartbeat );
+            
+            // [0][JOIN:<node>][""][address][heartbeat]
+            pzq::message_t join;
+            join.append( "0", 1 );
+            join.append( "JOIN:" + m_currentNode );
+            join.append();
+            join.append( m_address );
+            join.append( heartbeat, len );
+            m_io.send( p, join, cluster_io_t::send_drop );
         }
-        catch( pzq::datastore_exception e )
+        
+        if( !stalled )
+            checkMembers();
+        
+        if( m_timers )
+            m_timers->schedule( m_gossipTimer, now + interval );
+    }
+    
+    void cluster_t::leave()
+    {
+        flushRemoves();
+        
+        char heartbeat[ 24 ];
+        int len = snprintf( heartbeat, sizeof( heartbeat ), "%lluL", (unsigned long long)++m_heartbeat );
+        
+        pzq::message_t msg;
+        msg.append( "CLUSTER", 7 );
+        msg.append( "GOSSIP", 6 );
+        msg.append( m_currentNode );
+        msg.append( m_address );
+        msg.append( heartbeat, len );
+        m_io.publish( msg );
+        
+        m_io.shutdown();
+    }
+    
+    void cluster_t::appendMembers( pzq::message_t& msg ) const
+    {
+        char heartbeat[ 24 ];
+        int len = snprintf( heartbeat, sizeof( heartbeat ), "%llu", (unsigned long long)m_heartbeat );
+        
+        msg.append( m_currentNode );
+        msg.append( m_address );
+        msg.append( heartbeat, len );
+        
+        for( members_t::const_iterator it = m_members.begin(); it != m_members.end(); ++it )
         {
-            printf("could not find %s", id.c_str());
+            len = snprintf( heartbeat, sizeof( heartbeat ), "%llu%s",
+                            (unsigned long long)it->second.heartbeat,
+                            it->second.state == member_left ? "L" : "" );
+            msg.append( it->first );
+            msg.append( it->second.address );
+            msg.append( heartbeat, len );
         }
     }
     
-    void cluster_t::handleCheck( pzq::message_t msg )
+    void cluster_t::mergeMembers( pzq::message_t& parts )
     {
-        msg.pop_front();
+        string name, address, heartbeat;
         
-        pzq::message_part_t part = msg.front();
-        string id = string( ( char* )part->data(), part->size() );
+        while( parts.size() >= 3 )
+        {
+            parts.front( name );
+            parts.pop_front();
+            parts.front( address );
+            parts.pop_front();
+            parts.front( heartbeat );
+            parts.pop_front();
+            
+            char* end;
+            uint64_t counter = strtoull( heartbeat.c_str(), &end, 10 );
+            merge( name, address, counter, *end == 'L' );
+        }
+    }
+    
+    void cluster_t::merge( const string& name, const string& address, uint64_t heartbeat, bool left )
+    {
+        if( name.empty() || name == m_currentNode )
+            return;
         
-        msg.pop_front();
+        uint64_t now = m_clock->now();
+        members_t::iterator it = m_members.find( name );
+        
+        if( it == m_members.end() )
+        {
+            // nothing to gain from learning about a node that is gone
+            if( left )
+                return;
+            
+            member_t member( m_timeoutNode / 10, now );
+            member.heartbeat = heartbeat;
+            member.address = address;
+            member.peer = addPeer( name, address );
+            m_members.insert( std::make_pair( name, member ) );
+            
+            if( member.peer >= 0 )
+                addLive( member.peer );
+            if( m_connector )
+                m_io.connect_bus( name );
+            
+            memberEvent( "joined", name );
+            return;
+        }
+        
+        member_t& member = it->second;
+        if( heartbeat <= member.heartbeat )
+            return;
+        
+        member.heartbeat = heartbeat;
+        if( left )
+        {
+            setState( name, member, member_left );
+            return;
+        }
+        
+        if( !address.empty() && address != member.address )
+        {
+            member.address = address;
+            
+            if( member.peer < 0 )
+            {
+                member.peer = addPeer( name, address );
+                if( member.peer >= 0 && member.state == member_alive )
+                    addLive( member.peer );
+            }
+            else if( m_connector && m_peers[ member.peer ].address != address )
+            {
+                // came back somewhere else
+                resetPeer( member.peer );
+                m_io.set_peer( member.peer, m_connector( address ) );
+                m_peers[ member.peer ].address = address;
+            }
+        }
+        
+        if( member.state == member_alive )
+            member.detector.heartbeat( now );
+        else
+        {
+            // the downtime says nothing about its heartbeat interval
+            member.detector = phi_detector_t( m_timeoutNode / 10, now );
+            setState( name, member, member_alive );
+        }
+    }
+    
+    void cluster_t::checkMembers()
+    {
+        uint64_t now = m_clock->now();
+        
+        for( members_t::iterator it = m_members.begin(); it != m_members.end(); ++it )
+        {
+            member_t& member = it->second;
+            if( member.state != member_alive )
+                continue;
+            
+            if( member.detector.phi( now ) >= m_phiThreshold ||
+                now - member.detector.last() >= (uint64_t)m_timeoutNode )
+                setState( it->first, member, member_dead );
+        }
+    }
+    
+    void cluster_t::setState( const string& name, member_t& member, member_state_t state )
+    {
+        if( member.state == state )
+            return;
         
-        part = msg.front();
-        string owner = string( ( char* )part->data(), part->size() );
+        member.state = state;
         
-        if( owner == m_currentNode )
+        if( member.peer >= 0 && state == member_alive )
+            addLive( member.peer );
+        else if( member.peer >= 0 )
+        {
+            std::vector< size_t >::iterator it = std::find( m_live.begin(), m_live.end(), (size_t)member.peer );
+            if( it != m_live.end() )
+                m_live.erase( it );
+            m_bootstraps.erase( member.peer );
+            
+            // whatever it had queued or in flight is not coming back
+            resetPeer( member.peer );
+            rebuildRing();
+        }
+        
+        memberEvent( state == member_alive ? "alive" : ( state == member_dead ? "down" : "left" ), name );
+        
+        if( state != member_alive && m_onNodeTimeout )
+            m_onNodeTimeout( name );
+    }
+    
+    void cluster_t::addLive( size_t p )
+    {
+        if( std::find( m_live.begin(), m_live.end(), p ) != m_live.end() || m_bootstraps.count( p ) )
+            return;
+        
+        if( m_replicas > 0 && m_timers )
+        {
+            startBootstrap( p );
+            return;
+        }
+        
+        m_live.push_back( p );
+        rebuildRing();
+    }
+    
+    /*
+     * Bootstrap. A node that joins or comes back has missed the writes
+     * made without it, so before it takes part in placement every owner
+     * streams it the local records short of replicas. The cursor walks
+     * the store in key order, and keys grow with time, so it first covers
+     * everything stored when the bootstrap started and then runs on into
+     * the writes made during the transfer. The records go out on the
+     * normal replication stream, window by window and within the byte
+     * rate. Once a pass finds nothing new and nothing is in flight the
+     * node has caught up and joins placement.
+     */
+    void cluster_t::startBootstrap( size_t p )
+    {
+        bootstrap_t& bootstrap = m_bootstraps[ p ];
+        bootstrap.key.clear();
+        bootstrap.started = m_clock->wall();
+        bootstrap.last = m_clock->now();
+        bootstrap.budget = 0;
+        bootstrap.sent = 0;
+        bootstrap.snapshot = 0;
+        
+        pzq::log( "Bootstrapping %s", m_peers[ p ].name.c_str() );
+        
+        if( !m_timers->is_scheduled( m_bootstrapTimer ) )
+            m_timers->schedule( m_bootstrapTimer, m_clock->now() );
+    }
+    
+    void cluster_t::stepBootstraps()
+    {
+        uint64_t now = m_clock->now();
+        
+        uint64_t live = 0;
+        for( size_t i = 0; i < m_live.size(); i++ )
+            live |= uint64_t( 1 ) << m_live[ i ];
+        
+        for( bootstraps_t::iterator it = m_bootstraps.begin(); it != m_bootstraps.end(); )
+        {
+            size_t p = it->first;
+            bootstrap_t& bootstrap = it->second;
+            peer_t& peer = m_peers[ p ];
+            
+            expireBatches( peer );
+            
+            // a second worth of rate at most, so a stall does not turn into a burst
+            if( m_bootstrapRate )
+            {
+                bootstrap.budget = std::min( bootstrap.budget + ( now - bootstrap.last ) * m_bootstrapRate / 1000000.0,
+                                             (double)m_bootstrapRate );
+                bootstrap.last = now;
+            }
+            
+            bool caughtUp = false;
+            int scanned = 0;
+            
+            while( peer.outstanding < m_window && !m_io.congested( p ) && scanned < bootstrap_scan &&
+                   ( !m_bootstrapRate || bootstrap.budget > 0 ) )
+            {
+                pzq::message_t parts;
+                uint64_t peers, lease;
+                
+                if( !m_store->next_record( bootstrap.key, parts, peers, lease ) )
+                {
+                    caughtUp = true;
+                    break;
+                }
+                scanned++;
+                
+                if( countBits( peers & live ) >= m_replicas || ( peers & ( uint64_t( 1 ) << p ) ) )
+                    continue;
+                
+                size_t bytes = 0;
+                for( message_iterator_t part = parts.begin(); part != parts.end(); ++part )
+                    bytes += part->size();
+                
+                if( !m_store->place( bootstrap.key, p ) )
+                    continue;
+                
+                queueReplica( p, bootstrap.key, parts, lease );
+                bootstrap.budget -= bytes;
+                bootstrap.sent++;
+                if( strtoull( bootstrap.key.c_str(), NULL, 10 ) < bootstrap.started )
+                    bootstrap.snapshot++;
+            }
+            flush( p );
+            
+            if( !caughtUp || peer.outstanding > 0 )
+            {
+                ++it;
+                continue;
+            }
+            
+            pzq::log( "Bootstrapped %s with %llu records, %llu from the snapshot and %llu written during the transfer",
+                      peer.name.c_str(), (unsigned long long)bootstrap.sent,
+                      (unsigned long long)bootstrap.snapshot,
+                      (unsigned long long)( bootstrap.sent - bootstrap.snapshot ) );
+            
+            m_bootstrapped += bootstrap.sent;
+            m_bootstraps.erase( it++ );
+            m_live.push_back( p );
+            rebuildRing();
+        }
+        
+        if( !m_bootstraps.empty() )
+            m_timers->schedule_after( m_bootstrapTimer, bootstrap_step );
+    }
+    
+    void cluster_t::setBootstrap( uint64_t rate )
+    {
+        m_bootstrapRate = rate;
+    }
+    
+    size_t cluster_t::activeBootstraps() const
+    {
+        return m_bootstraps.size();
+    }
+    
+    uint64_t cluster_t::bootstrapped() const
+    {
+        return m_bootstrapped;
+    }
+    
+    void cluster_t::resetPeer( size_t p )
+    {
+        peer_t& peer = m_peers[ p ];
+        
+        m_io.reset( p );
+        peer.batch.clear();
+        peer.batchKeys.clear();
+        peer.inflight.clear();
+        peer.outstanding = 0;
+    }
+    
+    int cluster_t::addPeer( const string& name, const string& address )
+    {
+        int p = peerIndex( name );
+        if( p >= 0 )
+            return p;
+        
+        // a seed that has not answered our JOIN yet
+        for( size_t i = 0; i < m_peers.size() && !address.empty(); i++ )
+        {
+            if( m_peers[ i ].name.empty() && m_peers[ i ].address == address )
+            {
+                m_peers[ i ].name = name;
+                return (int)i;
+            }
+        }
+        
+        if( address.empty() || !m_connector )
+            return -1;
+        
+        if( m_peers.size() >= max_peers )
+        {
+            pzq::log( "Not replicating to %s, at most %d nodes are supported", name.c_str(), (int)max_peers );
+            return -1;
+        }
+        
+        m_io.set_peer( m_peers.size(), m_connector( address ) );
+        m_peers.push_back( peer_t( name, shared_ptr< pzq::socket_t >(), address ) );
+        return (int)m_peers.size() - 1;
+    }
+    
+    void cluster_t::memberEvent( const char* what, const string& name )
+    {
+        pzq::log( "Node %s %s", name.c_str(), what );
+        
+        std::ostringstream event;
+        event << m_clock->wall() << " " << what << " " << name;
+        m_events.push_back( event.str() );
+        
+        // the latest changes are enough to see what happened
+        if( m_events.size() > 32 )
+            m_events.pop_front();
+        
+        m_membershipChanges++;
+    }
+    
+    void cluster_t::handleJoin( const string& name, message_t& parts, message_t& reply )
+    {
+        string address, heartbeat;
+        
+        if( parts.size() >= 2 )
+        {
+            parts.front( address );
+            parts.pop_front();
+            parts.front( heartbeat );
+        }
+        merge( name, address, strtoull( heartbeat.c_str(), NULL, 10 ), false );
+        
+        // [MEMBERS][name][address][heartbeat]...
+        reply.append( "MEMBERS", 7 );
+        appendMembers( reply );
+    }
+    
+    void cluster_t::handleMembers( size_t p, message_t& parts )
+    {
+        parts.pop_front();
+        
+        if( parts.size() < 3 )
+            return;
+        
+        // the seed comes first
+        string seed;
+        parts.front( seed );
+        
+        if( m_peers[ p ].name.empty() )
+        {
+            if( peerIndex( seed ) < 0 )
+                m_peers[ p ].name = seed;
+            else
+                // connected to it under another address already
+                m_peers[ p ].address.clear();
+        }
+        
+        mergeMembers( parts );
+    }
+    
+    void cluster_t::describeMembers( std::ostream& out ) const
+    {
+        uint64_t now = m_clock->now();
+        
+        out << "node: " << m_currentNode << " " << ( m_address.empty() ? "-" : m_address ) << " self" << std::endl;
+        
+        for( members_t::const_iterator it = m_members.begin(); it != m_members.end(); ++it )
+        {
+            const member_t& member = it->second;
+            
+            out << "node: " << it->first << " " << ( member.address.empty() ? "-" : member.address );
+            if( member.state == member_alive )
+                out << " alive phi=" << member.detector.phi( now );
+            else
+                out << ( member.state == member_dead ? " down" : " left" );
+            
+            // bytes the I/O thread has not got out to it yet and for how long
+            if( member.peer >= 0 )
+                out << " backlog=" << m_io.backlog( member.peer ) << " lag=" << m_io.lag( member.peer );
+            out << std::endl;
+        }
+        
+        for( std::deque< string >::const_iterator it = m_events.begin(); it != m_events.end(); ++it )
+            out << "event: " << *it << std::endl;
+    }
+    
+    /*
+     * Anti-entropy. REMOVE broadcasts can be lost, so every replica holder
+     * periodically sends each live owner a digest per settled bucket of
+     * the replicas it holds for it. The owner compares them with the
+     * digests of what it placed on the holder and names the buckets that
+     * differ, the holder lists its keys in those buckets only and the
+     * owner answers with the ones it no longer has.
+     */
+    void cluster_t::sendDigests()
+    {
+        // keys newer than this may still have replicas or removes on the way
+        uint64_t settled = m_clock->wall() / digest_set_t::bucket_width;
+        
+        const std::map< string, digest_set_t >& held = m_store->held_digests();
+        for( std::map< string, digest_set_t >::const_iterator it = held.begin(); it != held.end(); ++it )
+        {
+            // while the owner is down its replicas are ours to deliver
+            int p = peerIndex( it->first );
+            if( p < 0 || !isAlive( it->first ) )
+                continue;
+            
+            // [0][DIGEST:<node>][""][bucket:count:hash]...
+            pzq::message_t msg;
+            msg.append( "0", 1 );
+            msg.append( "DIGEST:" + m_currentNode );
+            msg.append();
+            
+            const digest_set_t::buckets_t& buckets = it->second.buckets();
+            for( digest_set_t::buckets_t::const_iterator b = buckets.begin(); b != buckets.end(); ++b )
+            {
+                if( b->first + 2 > settled )
+                    break;
+                
+                char digest[ 72 ];
+                int len = snprintf( digest, sizeof( digest ), "%llu:%llu:%llu",
+                                    (unsigned long long)b->first,
+                                    (unsigned long long)b->second.count,
+                                    (unsigned long long)b->second.hash );
+                msg.append( digest, len );
+            }
+            
+            if( msg.size() > 3 )
+                m_io.send( p, msg, cluster_io_t::send_drop );
+        }
+        
+        if( m_timers )
+            m_timers->schedule_after( m_antiEntropyTimer, m_antiEntropyInterval );
+    }
+    
+    void cluster_t::handleDigest( const string& holder, message_t& parts, message_t& reply )
+    {
+        int p = peerIndex( holder );
+        const digest_set_t* placed = ( p < 0 ) ? NULL : m_store->placed_digests( p );
+        
+        // [DIFF][bucket]...
+        reply.append( "DIFF", 4 );
+        
+        for( message_iterator_t it = parts.begin(); it != parts.end(); ++it )
+        {
+            string digest( (char*)it->data(), it->size() );
+            char* end;
+            
+            digest_t theirs;
+            uint64_t bucket = strtoull( digest.c_str(), &end, 10 );
+            theirs.count = strtoull( end + ( *end == ':' ), &end, 10 );
+            theirs.hash = strtoull( end + ( *end == ':' ), &end, 10 );
+            
+            if( !placed || placed->get( bucket ) != theirs )
+            {
+                char b[ 24 ];
+                int len = snprintf( b, sizeof( b ), "%llu", (unsigned long long)bucket );
+                reply.append( b, len );
+            }
+        }
+        
+        // in sync, nothing to answer
+        if( reply.size() == 2 )
+            reply.pop_back();
+    }
+    
+    void cluster_t::handleDiff( size_t p, message_t& parts )
+    {
+        peer_t& peer = m_peers[ p ];
+        parts.pop_front();
+        
+        for( message_iterator_t it = parts.begin(); it != parts.end(); ++it )
+        {
+            string bucket( (char*)it->data(), it->size() );
+            
+            std::vector< string > keys;
+            m_store->replica_keys( peer.name, strtoull( bucket.c_str(), NULL, 10 ), keys );
+            
+            if( keys.empty() )
+                continue;
+            
+            // [0][KEYS:<node>][""][bucket][key]...
+            pzq::message_t msg;
+            msg.append( "0", 1 );
+            msg.append( "KEYS:" + m_currentNode );
+            msg.append();
+            msg.append( bucket );
+            for( std::vector< string >::iterator k = keys.begin(); k != keys.end(); ++k )
+                msg.append( *k );
+            
+            m_io.send( p, msg, cluster_io_t::send_drop );
+        }
+    }
+    
+    void cluster_t::handleKeys( message_t& parts, message_t& reply )
+    {
+        if( parts.size() == 0 )
+            return;
+        
+        // bucket
+        parts.pop_front();
+        
+        // [ORPHANS][key]...
+        reply.append( "ORPHANS", 7 );
+        
+        string key;
+        for( message_iterator_t it = parts.begin(); it != parts.end(); ++it )
+        {
+            key.assign( (char*)it->data(), it->size() );
+            if( !m_store->check( key ) )
+                reply.append( *it );
+        }
+        
+        if( reply.size() == 2 )
+            reply.pop_back();
+    }
+    
+    void cluster_t::handleOrphans( size_t p, message_t& parts )
+    {
+        peer_t& peer = m_peers[ p ];
+        parts.pop_front();
+        
+        std::vector< string > keys;
+        for( message_iterator_t it = parts.begin(); it != parts.end(); ++it )
+            keys.push_back( string( (char*)it->data(), it->size() ) );
+        
+        try
+        {
+            size_t removed = m_store->remove_replicas( peer.name, keys );
+            pzq::log( "Removed %lu orphaned replicas of %s", (unsigned long)removed, peer.name.c_str() );
+        }
+        catch( std::exception& e )
         {
-            if( !m_store->check( id ) )
-                broadcastRemove( id );
+            pzq::log( "Failed to remove orphaned replicas of %s: %s", peer.name.c_str(), e.what() );
         }
     }
 }
@@ -18,77 +18,405 @@
 #define PZQ_CLUSTER_HPP
 
 #include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <deque>
+#include <ostream>
 
 #include "socket.hpp"
 #include "ackcache.hpp"
 #include "store.hpp"
+#include "time.hpp"
+#include "timer.hpp"
+#include "detector.hpp"
+#include "ring.hpp"
+#include "cluster_io.hpp"
+#include "keyset.hpp"
+#include "histogram.hpp"
+#include "trace.hpp"
 
 namespace pzq
 {
-    typedef std::map< std::string, uint64_t > nodelist_t;
+    /*
+     * A batch of replicas sent to a peer and not acknowledged yet
+     */
+    struct batch_t
+    {
+        uint64_t                   seq;
+        uint64_t                   sent;
+        std::vector< std::string > keys;
+    };
+    
+    /*
+     * Another node replicas can be placed on. name is what the node
+     * announces itself as on the cluster bus, socket is a DEALER connected
+     * to that node only, handed to the cluster I/O thread when the cluster
+     * is created, address is where it is connected to. A seed node has no
+     * name until it has answered our JOIN. Replicas are collected in batch
+     * and sent as one numbered message, outstanding counts replicas queued
+     * or in flight.
+     */
+    struct peer_t
+    {
+        peer_t( const std::string& name, boost::shared_ptr< pzq::socket_t > socket,
+                const std::string& address = "" )
+            : name( name ), address( address ), socket( socket ), outstanding( 0 ), nextSeq( 1 )
+        {}
+        
+        std::string                        name;
+        std::string                        address;
+        boost::shared_ptr< pzq::socket_t > socket;
+        int                                outstanding;
+        pzq::message_t                     batch;
+        std::vector< std::string >         batchKeys;
+        uint64_t                           nextSeq;
+        std::deque< batch_t >              inflight;
+    };
+    
+    /*
+     * Receiving side of a replication or removal stream. runStart is the
+     * first sequence number of the current gapless run.
+     */
+    struct stream_t
+    {
+        stream_t() : epoch( 0 ), expected( 0 ), runStart( 0 )
+        {}
+        
+        uint64_t epoch;
+        uint64_t expected;
+        uint64_t runStart;
+    };
+    
+    typedef std::map< std::string, stream_t > streams_t;
+    
+    /*
+     * Catch-up of a peer that joined or came back. key is where the
+     * cursor is, started the wall time the snapshot was taken at and
+     * budget the bytes the rate still allows.
+     */
+    struct bootstrap_t
+    {
+        std::string key;
+        uint64_t    started;
+        uint64_t    last;
+        double      budget;
+        uint64_t    sent;
+        uint64_t    snapshot;
+    };
+    
+    typedef std::map< size_t, bootstrap_t > bootstraps_t;
+    
+    typedef std::vector< peer_t > peerlist_t;
+    
+    enum member_state_t { member_alive, member_dead, member_left };
+    
+    /*
+     * What this node knows about another node. heartbeat is the highest
+     * counter heard for it from anyone, first hand or gossiped, and every
+     * increase counts as a sign of life for the failure detector. peer is
+     * the index of its socket in the peer list, -1 without an address.
+     */
+    struct member_t
+    {
+        member_t( uint64_t expected, uint64_t now )
+            : heartbeat( 0 ), state( member_alive ), peer( -1 ), detector( expected, now )
+        {}
+        
+        std::string          address;
+        uint64_t             heartbeat;
+        member_state_t       state;
+        int                  peer;
+        pzq::phi_detector_t  detector;
+    };
+    
+    typedef std::map< std::string, member_t > members_t;
+    
+    // peers are tracked in 64 bit masks
+    enum { max_peers = 64 };
+    
+    // a bootstrap looks at this many records every step microseconds
+    enum { bootstrap_scan = 1024, bootstrap_step = 10000 };
+    
+    /*
+     * Removals go out every remove_interval microseconds or once
+     * remove_max keys are waiting, the last remove_history frames are
+     * kept for nodes that missed some
+     */
+    enum { remove_interval = 10000, remove_max = 4096, remove_history = 64 };
     
     class cluster_t
     {
     public:
-        cluster_t( int replicas, const std::vector< std::string >& nodeNames, uint64_t timeoutNode,
-                   boost::shared_ptr< pzq::socket_t > clusterSocket,
+        cluster_t( zmq::context_t& context, int replicas, const peerlist_t& peers, int window, uint64_t timeoutNode,
                    boost::shared_ptr< pzq::socket_t > broadcastSocket,
                    boost::shared_ptr< pzq::socket_t > subscribeSocket,
                    std::string currentNode,
-                   boost::shared_ptr< pzq::datastore_t > store );
+                   boost::shared_ptr< pzq::datastore_t > store,
+                   boost::shared_ptr< pzq::clock_service_t > clock );
         ~cluster_t();
         
+        /*
+         * Registers gossip, batching and anti-entropy with the timer
+         * service and starts the cluster I/O thread, so it is called from
+         * the thread that runs the cluster. onNodeTimeout gets the name of
+         * a node that went down.
+         */
+        void setTimers( boost::shared_ptr< pzq::timer_service_t > timers,
+                        boost::function< void ( const std::string& ) > onNodeTimeout );
+        
+        /*
+         * A batch goes out when it holds maxBatch replicas or linger
+         * microseconds after its first replica, whichever comes first.
+         * Batches not acknowledged within timeoutReplication are dropped.
+         */
+        void setBatching( size_t maxBatch, uint64_t linger, uint64_t timeoutReplication );
+        
+        /*
+         * Every interval microseconds the digests of the replicas held for
+         * each live owner are sent to it, 0 turns reconciliation off.
+         * Must be called before setTimers.
+         */
+        void setAntiEntropy( uint64_t interval );
+        
+        /*
+         * Turns on gossip membership. address is where other nodes reach
+         * our producer socket, connector returns a DEALER connected to the
+         * address of a node learned from gossip. A node is considered down
+         * once its phi passes phiThreshold, or after timeoutNode of silence.
+         * Must be called before setTimers.
+         */
+        typedef boost::function< boost::shared_ptr< pzq::socket_t > ( const std::string& ) > connector_t;
+        void setMembership( const std::string& address, connector_t connector, double phiThreshold );
+        
+        /*
+         * Tells the other nodes we are leaving so they take over our
+         * replicas right away instead of waiting for the detector, then
+         * stops the cluster I/O thread once that has gone out
+         */
+        void leave();
+        
+        /*
+         * Bytes that can wait for a peer before replicas skip it, control
+         * messages beyond it are dropped
+         */
+        void setPeerBuffer( size_t bytes );
+        
+        // Bytes waiting for all peers and messages dropped on the way
+        uint64_t backlog() const;
+        uint64_t droppedSends() const;
+        
+        /*
+         * One line per known node and the latest membership changes
+         */
+        void describeMembers( std::ostream& out ) const;
+        uint64_t membershipChanges() const;
+        
+        /*
+         * Nodes joining or coming back are sent the records short of
+         * replicas at up to rate bytes per second, 0 for no limit, and
+         * only take part in placement once they have caught up
+         */
+        void setBootstrap( uint64_t rate );
+        size_t activeBootstraps() const;
+        uint64_t bootstrapped() const;
+        
+        /*
+         * Partitioned mode. Message ids hash onto partitions, spread over
+         * the live nodes on a consistent hash ring with vnodes points per
+         * node. A partition is stored by its primary and replicated to the
+         * next nodes on the ring, writes for partitions of other nodes are
+         * redirected. With 0 partitions every node takes every write.
+         */
+        void setPartitions( int partitions, int vnodes );
+        
+        // -1 when not partitioned
+        int partition( const std::string& id ) const;
+        
+        /*
+         * True when another node is the primary of partition, address is
+         * where the producer should send it
+         */
+        bool redirect( int partition, std::string& address ) const;
+        
+        int ownedPartitions() const;
+        
+        // "partitions: N" and the primary of every partition
+        void describePartitions( std::ostream& out ) const;
+        
         int replicas() const;
+        
+        // Live nodes with a socket, kept up to date as members come and go
         int countActiveNodes() const;
         
-        boost::shared_ptr< pzq::socket_t > getOutSocket();
+        size_t countPeers() const;
         boost::shared_ptr< pzq::socket_t > getSubSocket();
         
-        pzq::message_t createReplica( pzq::message_t orig ) const;
+        /*
+         * Signalled by the cluster I/O thread when peers have answered,
+         * handleEvents takes the answers
+         */
+        boost::shared_ptr< pzq::socket_t > getEventSocket();
         
-        void handleAck( boost::shared_ptr< pzq::socket_t > in,
-                        boost::shared_ptr< ackcache_t > ackCache );
+        /*
+         * Chooses up to count distinct live peers, least loaded first,
+         * skipping peers whose outstanding window or send buffer is full. In partitioned
+         * mode the peers are the ones following us on the ring for the
+         * partition. Returns the mask of peers chosen.
+         */
+        uint64_t placeReplicas( int count, int partition = -1 );
         
-        bool shouldSendReplica( std::string replicaSource ) const;
+        /*
+         * Queues the stored parts of key for the peers in mask, with the
+         * lease the producer asked for or 0
+         */
+        void sendReplicas( const std::string& key, pzq::message_t& parts, uint64_t mask, uint64_t lease = 0 );
         
-        int getDelayUntilNextBroadcast() const;
+        /*
+         * Messages from other nodes on the producer socket carry a
+         * BATCH:, DIGEST:, KEYS:, RESYNC: or JOIN: header
+         */
+        bool isNodeMessage( zmq::message_t& header ) const;
         
-        int getDelayUntilNextNodeTimeout() const;
+        /*
+         * Handles a message from another node. Anything to send back is
+         * appended to reply, which starts out with the routing id.
+         */
+        void handleNodeMessage( zmq::message_t& seq, zmq::message_t& header,
+                                pzq::message_t& parts, pzq::message_t& reply );
         
-        void broadcastKeepAlive();
+        /*
+         * Cumulative ACKs for the batches of the peers, their answers to
+         * our digests and key lists, or the member list of a seed we joined
+         */
+        void handleEvents( boost::shared_ptr< pzq::socket_t > in,
+                           boost::shared_ptr< ackcache_t > ackCache );
+        
+        bool shouldSendReplica( std::string replicaSource ) const;
+        
+        /*
+         * Queues the removal of the replicas of a consumed message. The
+         * keys go out together on the cluster bus, as a numbered frame of
+         * sorted keys that receivers remove in one transaction.
+         */
         void broadcastRemove( const std::string& id );
+        void broadcastRemove( const char* id, size_t size );
         
-        void handleNodesMessage();
-        void setTimeoutState();
+        // Removal frames this node noticed it had missed
+        uint64_t removeGaps() const;
+        
+        // Time from sending a replica batch to its ACK
+        pzq::histogram_t& replicationLatency();
         
-        void checkReplica( const std::string& key,
-                           const std::string& owner );
+        // Replica ACKs of traced messages are recorded here
+        void setTracer( boost::shared_ptr< pzq::tracer_t > tracer );
+        
+        /*
+         * Producer ACKs completed by the replicas go to handler with the
+         * tag they were pushed into the ack cache with, instead of
+         * straight to the receive socket
+         */
+        typedef boost::function< void ( pzq::message_t&, uint64_t ) > ack_handler_t;
+        void setAckHandler( ack_handler_t handler );
+        
+        void handleNodesMessage();
         
     private:
         cluster_t();
         cluster_t( const cluster_t& );
         cluster_t& operator=( const cluster_t& );
         
-        void sendAndEraseNegativeAck( boost::shared_ptr< pzq::socket_t > in, boost::shared_ptr< ackcache_t > ackCache, std::string id );
-        void sendAndErasePositiveAck( boost::shared_ptr< pzq::socket_t > in, boost::shared_ptr< ackcache_t > ackCache, std::string id );
-        void sendAck( boost::shared_ptr< pzq::socket_t > in, pzq::message_t ack );
-        void handleKeepAlive( pzq::message_t msg );
-        void handleRemove( pzq::message_t msg );
-        void handleCheck( pzq::message_t msg );
+        bool isAlive( const std::string& node ) const;
+        int peerIndex( const std::string& name ) const;
+        void queueReplica( size_t peer, const std::string& key, pzq::message_t& parts, uint64_t lease );
+        void flush( size_t peer );
+        void flushAll();
+        void expireBatches( peer_t& peer );
+        void handleAck( size_t peer, pzq::message_t& parts,
+                        boost::shared_ptr< pzq::socket_t > in,
+                        boost::shared_ptr< ackcache_t > ackCache );
+        void ackReplica( size_t peer, const std::string& key, bool success,
+                         boost::shared_ptr< pzq::socket_t > in,
+                         boost::shared_ptr< ackcache_t > ackCache );
+        void sendAck( boost::shared_ptr< pzq::socket_t > in, pzq::message_t& ack, uint64_t tag );
+        void handleRemove( pzq::message_t& msg );
+        void flushRemoves();
+        void applyRemoves( const std::string& source, zmq::message_t& seq, zmq::message_t& keys, bool replay );
+        void handleResync( pzq::message_t& parts, pzq::message_t& reply );
+        void handleReplay( pzq::message_t& parts );
+        
+        void gossip();
+        void appendMembers( pzq::message_t& msg ) const;
+        void mergeMembers( pzq::message_t& parts );
+        void merge( const std::string& name, const std::string& address, uint64_t heartbeat, bool left );
+        void checkMembers();
+        void setState( const std::string& name, member_t& member, member_state_t state );
+        void resetPeer( size_t peer );
+        void memberEvent( const char* what, const std::string& name );
+        void rebuildRing();
+        void addLive( size_t peer );
+        void startBootstrap( size_t peer );
+        void stepBootstraps();
+        int addPeer( const std::string& name, const std::string& address );
+        void handleJoin( const std::string& name, pzq::message_t& parts, pzq::message_t& reply );
+        void handleMembers( size_t peer, pzq::message_t& parts );
+        
+        void applyBatch( zmq::message_t& seq, const std::string& source,
+                         pzq::message_t& parts, pzq::message_t& ack );
         
-        void broadcastCheck( const std::string& id,
-                             const std::string& owner );
+        void sendDigests();
+        void handleDigest( const std::string& holder, pzq::message_t& parts, pzq::message_t& reply );
+        void handleDiff( size_t peer, pzq::message_t& parts );
+        void handleKeys( pzq::message_t& parts, pzq::message_t& reply );
+        void handleOrphans( size_t peer, pzq::message_t& parts );
         
         int                                   m_replicas;
-        nodelist_t                            m_nodelist;
+        members_t                             m_members;
+        std::vector< size_t >                 m_live;
+        uint64_t                              m_heartbeat;
+        uint64_t                              m_lastGossip;
+        std::string                           m_address;
+        connector_t                           m_connector;
+        double                                m_phiThreshold;
+        uint64_t                              m_membershipChanges;
+        std::deque< std::string >             m_events;
+        int                                   m_partitions;
+        int                                   m_vnodes;
+        pzq::ring_t                           m_ring;
+        std::vector< int >                    m_ringPeers;
+        bootstraps_t                          m_bootstraps;
+        uint64_t                              m_bootstrapRate;
+        uint64_t                              m_bootstrapped;
+        pzq::timer_id_t                       m_bootstrapTimer;
+        peerlist_t                            m_peers;
+        int                                   m_window;
+        size_t                                m_nextPeer;
+        size_t                                m_maxBatch;
+        uint64_t                              m_linger;
+        uint64_t                              m_timeoutReplication;
+        std::string                           m_streamHeader;
+        streams_t                             m_streams;
+        pzq::timer_id_t                       m_flushTimer;
+        uint64_t                              m_antiEntropyInterval;
+        pzq::timer_id_t                       m_antiEntropyTimer;
+        pzq::key_set_t                        m_removes;
+        std::string                           m_removeFrame;
+        std::string                           m_removeHeader;
+        uint64_t                              m_removeSeq;
+        std::deque< std::pair< uint64_t, std::string > > m_removeHistory;
+        streams_t                             m_removeStreams;
+        uint64_t                              m_removeGaps;
+        pzq::histogram_t                      m_replicationLatency;
+        boost::shared_ptr< pzq::tracer_t >    m_tracer;
+        ack_handler_t                         m_ackHandler;
+        pzq::timer_id_t                       m_removeTimer;
         int64_t                               m_timeoutNode;
-        uint64_t                              m_nextBroadcast;
-        boost::shared_ptr< pzq::socket_t >    m_out;
-        boost::shared_ptr< pzq::socket_t >    m_pub;
+        pzq::cluster_io_t                     m_io;
         boost::shared_ptr< pzq::socket_t >    m_sub;
         boost::shared_ptr< pzq::datastore_t > m_store;
+        boost::shared_ptr< pzq::clock_service_t > m_clock;
         std::string                           m_currentNode;
-        bool                                  m_timeoutState;
+        boost::shared_ptr< pzq::timer_service_t > m_timers;
+        pzq::timer_id_t                       m_gossipTimer;
+        boost::function< void ( const std::string& ) > m_onNodeTimeout;
     };
 }
 
@@ -0,0 +1,410 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cluster_io.hpp"
+
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+    // One pending signal is as good as many
+    boost::shared_ptr<pzq::socket_t> signal_socket (zmq::context_t &context, int type)
+    {
+        int linger = 0, hwm = 1;
+
+        boost::shared_ptr<pzq::socket_t> socket (new pzq::socket_t (context, type));
+        socket->setsockopt (ZMQ_LINGER, &linger, sizeof (int));
+        socket->setsockopt (ZMQ_SNDHWM, &hwm, sizeof (int));
+        socket->setsockopt (ZMQ_RCVHWM, &hwm, sizeof (int));
+        return socket;
+    }
+
+    void drain (boost::shared_ptr<pzq::socket_t> socket)
+    {
+        zmq::message_t signal;
+        while (socket->recv (&signal, ZMQ_NOBLOCK))
+            ;
+    }
+
+    // How often a quiet thread looks at whether it should stop (ms)
+    const long idle_timeout = 100;
+}
+
+pzq::cluster_io_t::cluster_io_t (zmq::context_t &context, boost::shared_ptr<pzq::socket_t> pub)
+    : m_commands (queue_size), m_events (queue_size), m_count (0), m_limit (16777216), m_dropped (0), m_pub (pub)
+{
+    char endpoint [64];
+
+    // inproc wants the bind before the connect
+    snprintf (endpoint, sizeof (endpoint), "inproc://pzq-cluster-io-%p-wakeup", (void *) this);
+    m_wakeup_in = signal_socket (context, ZMQ_PULL);
+    m_wakeup_in->bind (endpoint);
+    m_wakeup_out = signal_socket (context, ZMQ_PUSH);
+    m_wakeup_out->connect (endpoint);
+
+    snprintf (endpoint, sizeof (endpoint), "inproc://pzq-cluster-io-%p-events", (void *) this);
+    m_events_in = signal_socket (context, ZMQ_PULL);
+    m_events_in->bind (endpoint);
+    m_events_out = signal_socket (context, ZMQ_PUSH);
+    m_events_out->connect (endpoint);
+}
+
+pzq::cluster_io_t::~cluster_io_t ()
+{
+    shutdown ();
+}
+
+pzq::cluster_io_t::command_t *pzq::cluster_io_t::reserve (command_type_t type, size_t peer, bool wait)
+{
+    command_t *command = m_commands.reserve ();
+
+    // This thread empties the queue into the peer buffers without
+    // waiting on any socket, so room comes back quickly
+    while (!command && wait && is_running ())
+    {
+        boost::this_thread::yield ();
+        command = m_commands.reserve ();
+    }
+
+    if (command)
+    {
+        command->type = type;
+        command->peer = peer;
+        command->bytes = 0;
+    }
+    return command;
+}
+
+void pzq::cluster_io_t::commit ()
+{
+    m_commands.commit ();
+
+    // A full pipe means the thread is already being woken up
+    zmq::message_t signal;
+    m_wakeup_out->send (signal, ZMQ_NOBLOCK);
+}
+
+void pzq::cluster_io_t::set_peer (size_t peer, boost::shared_ptr<pzq::socket_t> socket)
+{
+    command_t *command = reserve (command_peer, peer, true);
+    if (!command)
+    {
+        pzq::log ("Cluster I/O queue is full, could not hand over socket of peer %lu", (unsigned long) peer);
+        return;
+    }
+    command->socket = socket;
+    commit ();
+}
+
+void pzq::cluster_io_t::connect_bus (const std::string &address)
+{
+    command_t *command = reserve (command_connect, 0, true);
+    if (!command)
+    {
+        pzq::log ("Cluster I/O queue is full, could not connect to %s", address.c_str ());
+        return;
+    }
+    command->address = address;
+    commit ();
+}
+
+bool pzq::cluster_io_t::send (size_t peer, pzq::message_t &parts, send_policy_t policy)
+{
+    peer_state_t &state = m_peers [peer];
+
+    size_t bytes = 0;
+    for (pzq::message_iterator_t it = parts.begin (); it != parts.end (); it++)
+        bytes += it->size ();
+
+    // Backpressured messages wait for room in the queue rather than get
+    // dropped, the sender has checked congested () already
+    command_t *command = (policy == send_drop && congested (peer)) ? NULL :
+                         reserve (command_send, peer, policy == send_backpressure);
+    if (!command)
+    {
+        parts.clear ();
+        m_dropped++;
+        return false;
+    }
+
+    command->bytes = bytes;
+    command->parts.move (parts);
+
+    state.submitted = state.submitted + 1;
+    state.submitted_bytes = state.submitted_bytes + bytes;
+    commit ();
+    return true;
+}
+
+bool pzq::cluster_io_t::publish (pzq::message_t &parts)
+{
+    command_t *command = reserve (command_publish, 0, false);
+    if (!command)
+    {
+        parts.clear ();
+        m_dropped++;
+        return false;
+    }
+
+    command->parts.move (parts);
+    commit ();
+    return true;
+}
+
+void pzq::cluster_io_t::reset (size_t peer)
+{
+    command_t *command = reserve (command_reset, peer, true);
+    if (command)
+        commit ();
+}
+
+uint64_t pzq::cluster_io_t::backlog (size_t peer) const
+{
+    const peer_state_t &state = m_peers [peer];
+    return state.submitted_bytes - state.done_bytes;
+}
+
+uint64_t pzq::cluster_io_t::lag (size_t peer) const
+{
+    uint64_t oldest = m_peers [peer].oldest;
+    uint64_t now = pzq::monotonic_timestamp ();
+
+    return (oldest && now > oldest) ? now - oldest : 0;
+}
+
+bool pzq::cluster_io_t::congested (size_t peer) const
+{
+    return backlog (peer) >= m_limit;
+}
+
+uint64_t pzq::cluster_io_t::dropped () const
+{
+    return m_dropped;
+}
+
+boost::shared_ptr<pzq::socket_t> pzq::cluster_io_t::get_event_socket ()
+{
+    return m_events_in;
+}
+
+bool pzq::cluster_io_t::next_event (size_t &peer, pzq::message_t &parts)
+{
+    event_t *event = m_events.front ();
+    if (!event)
+        return false;
+
+    peer = event->peer;
+    parts.move (event->parts);
+    m_events.pop ();
+    return true;
+}
+
+void pzq::cluster_io_t::shutdown ()
+{
+    if (!is_running ())
+        return;
+
+    // The manager calls this on its way out of an interrupted run, the
+    // join must not be cut short by the same interruption
+    boost::this_thread::disable_interruption guard;
+
+    zmq::message_t signal;
+    m_wakeup_out->send (signal, ZMQ_NOBLOCK);
+    stop ();
+}
+
+void pzq::cluster_io_t::handle_commands ()
+{
+    command_t *command;
+
+    while ((command = m_commands.front ()) != NULL)
+    {
+        peer_state_t &state = m_peers [command->peer];
+
+        switch (command->type)
+        {
+            case command_peer:
+                discard (command->peer);
+                state.socket = command->socket;
+                command->socket.reset ();
+
+                if (command->peer >= m_count)
+                    m_count = command->peer + 1;
+            break;
+
+            case command_send:
+                if (!state.socket)
+                {
+                    state.done = state.done + 1;
+                    state.done_bytes = state.done_bytes + command->bytes;
+                    break;
+                }
+
+                if (state.buffer.empty ())
+                    state.oldest = m_clock.now ();
+
+                state.buffer.push_back (pending_t ());
+                state.buffer.back ().parts.move (command->parts);
+                state.buffer.back ().bytes = command->bytes;
+                state.buffer.back ().queued = m_clock.now ();
+            break;
+
+            case command_publish:
+                // PUB drops at the high water mark rather than block
+                m_pub->send_many (command->parts, ZMQ_NOBLOCK);
+            break;
+
+            case command_connect:
+                m_pub->connect (command->address.c_str ());
+            break;
+
+            case command_reset:
+                discard (command->peer);
+            break;
+        }
+
+        command->parts.clear ();
+        m_commands.pop ();
+    }
+}
+
+void pzq::cluster_io_t::receive (size_t peer)
+{
+    peer_state_t &state = m_peers [peer];
+    event_t *event;
+
+    // Whatever does not fit stays in the socket until the manager catches up
+    while ((event = m_events.reserve ()) != NULL)
+    {
+        if (state.socket->recv_many (event->parts, ZMQ_NOBLOCK) == 0)
+            break;
+
+        event->peer = peer;
+        m_events.commit ();
+    }
+}
+
+bool pzq::cluster_io_t::flush (size_t peer)
+{
+    peer_state_t &state = m_peers [peer];
+
+    while (!state.buffer.empty ())
+    {
+        pending_t &pending = state.buffer.front ();
+        if (!state.socket->send_many (pending.parts, ZMQ_NOBLOCK))
+            break;
+
+        state.done = state.done + 1;
+        state.done_bytes = state.done_bytes + pending.bytes;
+        state.buffer.pop_front ();
+    }
+
+    state.oldest = state.buffer.empty () ? 0 : state.buffer.front ().queued;
+    return state.buffer.empty ();
+}
+
+void pzq::cluster_io_t::discard (size_t peer)
+{
+    peer_state_t &state = m_peers [peer];
+
+    for (std::deque<pending_t>::iterator it = state.buffer.begin (); it != state.buffer.end (); it++)
+    {
+        state.done = state.done + 1;
+        state.done_bytes = state.done_bytes + it->bytes;
+    }
+    state.buffer.clear ();
+    state.oldest = 0;
+}
+
+void pzq::cluster_io_t::run ()
+{
+    std::vector<zmq::pollitem_t> items;
+    std::vector<size_t> polled;
+
+    while (is_running ())
+    {
+        items.resize (1);
+        polled.clear ();
+
+        items [0].socket  = *m_wakeup_in;
+        items [0].fd      = 0;
+        items [0].events  = ZMQ_POLLIN;
+        items [0].revents = 0;
+
+        // Only read from the peers while there is room to pass it on, and
+        // only wait for a peer to be writable when something is waiting
+        bool room = m_events.reserve () != NULL;
+
+        for (size_t i = 0; i < m_count; i++)
+        {
+            peer_state_t &state = m_peers [i];
+            short events = (room ? ZMQ_POLLIN : 0) | (state.buffer.empty () ? 0 : ZMQ_POLLOUT);
+
+            if (!state.socket || !events)
+                continue;
+
+            zmq::pollitem_t item = { *state.socket, 0, events, 0 };
+            items.push_back (item);
+            polled.push_back (i);
+        }
+
+        try {
+            zmq::poll (&items [0], (int) items.size (), idle_timeout);
+        } catch (zmq::error_t &e) {
+            break;
+        }
+
+        m_clock.update ();
+
+        if (items [0].revents & ZMQ_POLLIN)
+            drain (m_wakeup_in);
+
+        handle_commands ();
+
+        bool received = false;
+        for (size_t i = 0; i < polled.size (); i++)
+        {
+            if (items [i + 1].revents & ZMQ_POLLIN)
+            {
+                receive (polled [i]);
+                received = true;
+            }
+        }
+
+        for (size_t i = 0; i < m_count; i++)
+        {
+            if (m_peers [i].socket)
+                flush (i);
+        }
+
+        if (received)
+        {
+            zmq::message_t signal;
+            m_events_out->send (signal, ZMQ_NOBLOCK);
+        }
+    }
+
+    // Whatever was queued before the stop, the leave message among it
+    m_clock.update ();
+    handle_commands ();
+
+    for (size_t i = 0; i < m_count; i++)
+    {
+        if (m_peers [i].socket)
+            flush (i);
+    }
+}
@@ -0,0 +1,165 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_CLUSTER_IO_HPP
+# define PZQ_CLUSTER_IO_HPP
+
+#include "pzq.hpp"
+#include "socket.hpp"
+#include "thread.hpp"
+#include "time.hpp"
+#include "spsc.hpp"
+
+#include <deque>
+
+namespace pzq {
+
+    /*
+      Thread that owns the sockets to the other nodes, the DEALER to every
+      peer and the PUB of the cluster bus. The manager thread never touches
+      them: it queues commands, and this thread sends and receives and
+      queues back what the peers answer. A congested peer therefore only
+      grows its own send buffer here, it can not stall produce or dispatch.
+
+      Every peer has a buffer of messages its socket has not taken yet.
+      Messages sent with send_drop are refused once the buffer holds the
+      limit, they are periodic and the next round makes up for them.
+      Messages sent with send_backpressure are always taken, waiting for
+      room in the command queue when it is full, and the sender checks
+      congested () before producing more for that peer. Sockets, connects
+      and resets wait the same way, a lost one would cut a peer off.
+    */
+    class cluster_io_t : public thread_t
+    {
+    public:
+        enum send_policy_t { send_drop, send_backpressure };
+        enum { max_peers = 64, queue_size = 4096 };
+
+    private:
+        enum command_type_t { command_peer, command_send, command_publish, command_connect, command_reset };
+
+        struct command_t
+        {
+            command_type_t type;
+            size_t peer;
+            size_t bytes;
+            std::string address;
+            boost::shared_ptr<pzq::socket_t> socket;
+            pzq::message_t parts;
+        };
+
+        struct event_t
+        {
+            size_t peer;
+            pzq::message_t parts;
+        };
+
+        struct pending_t
+        {
+            pzq::message_t parts;
+            size_t bytes;
+            uint64_t queued;
+        };
+
+        /*
+          Counters of a peer. The manager thread writes the submitted
+          ones, this thread the rest, so either side reads the other's
+          without a lock.
+        */
+        struct peer_state_t
+        {
+            peer_state_t () : submitted (0), submitted_bytes (0), done (0), done_bytes (0), oldest (0)
+            {}
+
+            volatile uint64_t submitted;
+            volatile uint64_t submitted_bytes;
+            volatile uint64_t done;
+            volatile uint64_t done_bytes;
+            volatile uint64_t oldest;
+
+            // This thread only
+            boost::shared_ptr<pzq::socket_t> socket;
+            std::deque<pending_t> buffer;
+        };
+
+        pzq::spsc_queue_t<command_t> m_commands;
+        pzq::spsc_queue_t<event_t> m_events;
+        peer_state_t m_peers [max_peers];
+        size_t m_count;
+        size_t m_limit;
+        uint64_t m_dropped;
+
+        boost::shared_ptr<pzq::socket_t> m_pub;
+
+        // Signals both ways, the first socket of each pair belongs to this thread
+        boost::shared_ptr<pzq::socket_t> m_wakeup_in, m_wakeup_out;
+        boost::shared_ptr<pzq::socket_t> m_events_out, m_events_in;
+
+        pzq::clock_service_t m_clock;
+
+        command_t *reserve (command_type_t type, size_t peer, bool wait);
+        void commit ();
+        void handle_commands ();
+        void receive (size_t peer);
+        bool flush (size_t peer);
+        void discard (size_t peer);
+
+    public:
+        cluster_io_t (zmq::context_t &context, boost::shared_ptr<pzq::socket_t> pub);
+        ~cluster_io_t ();
+
+        // Bytes a peer can have waiting before it counts as congested
+        void set_limit (size_t limit)
+        {
+            m_limit = limit;
+        }
+
+        /*
+          The calls below are for the manager thread. A socket handed over
+          with set_peer belongs to this thread from then on, one given for
+          a peer that has one replaces it along with whatever was waiting.
+        */
+        void set_peer (size_t peer, boost::shared_ptr<pzq::socket_t> socket);
+        void connect_bus (const std::string &address);
+
+        // Both consume parts, false when the message was dropped
+        bool send (size_t peer, pzq::message_t &parts, send_policy_t policy);
+        bool publish (pzq::message_t &parts);
+
+        // Drops whatever is waiting for peer
+        void reset (size_t peer);
+
+        // Bytes waiting for peer and the age of the oldest in microseconds
+        uint64_t backlog (size_t peer) const;
+        uint64_t lag (size_t peer) const;
+        bool congested (size_t peer) const;
+        uint64_t dropped () const;
+
+        /*
+          Signalled when messages from the peers are waiting, the manager
+          polls it and takes them with next_event
+        */
+        boost::shared_ptr<pzq::socket_t> get_event_socket ();
+        bool next_event (size_t &peer, pzq::message_t &parts);
+
+        // Stops after sending out what was queued before
+        void shutdown ();
+
+        void run ();
+    };
+}
+
+#endif
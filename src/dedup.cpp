@@ -0,0 +1,208 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "dedup.hpp"
+#include "pzq.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+pzq::dedup_window_t::dedup_window_t (size_t size)
+    : m_records (size ? size : 1), m_tickets (0), m_count (0), m_random (2463534242U), m_lost (0)
+{
+    // Half full at most, inserts rarely have to push anything out
+    size_t buckets = 1;
+    while (buckets * bucket_slots < 2 * m_records.size ())
+        buckets <<= 1;
+
+    slot_t empty = { 0, 0 };
+    m_slots.assign (buckets * bucket_slots, empty);
+    m_mask = buckets - 1;
+}
+
+uint64_t pzq::dedup_window_t::hash (const char *identity, size_t isize, const char *id, size_t size)
+{
+    // Identity, a zero byte and the id as one. Mixed, as the bucket and
+    // the fingerprint come from opposite ends and must not depend on
+    // each other
+    const char separator = '\0';
+
+    uint64_t h = pzq::hash64 (identity, isize);
+    h = pzq::hash64 (&separator, 1, false, h);
+    return pzq::hash64 (id, size, true, h);
+}
+
+uint16_t pzq::dedup_window_t::fingerprint (uint64_t hash)
+{
+    // 0 marks an empty slot
+    uint16_t fp = (uint16_t) (hash >> 48);
+    return fp ? fp : 1;
+}
+
+size_t pzq::dedup_window_t::alternate (size_t bucket, uint16_t fingerprint) const
+{
+    // Works both ways, the alternate of the alternate is the bucket
+    return (bucket ^ (size_t) (fingerprint * 0x5bd1e995U)) & m_mask;
+}
+
+bool pzq::dedup_window_t::matches (uint32_t entry, const char *identity, size_t isize, const char *id, size_t size) const
+{
+    const std::string &stored = m_records [entry].key;
+
+    return stored.size () == isize + 1 + size &&
+           !memcmp (stored.data (), identity, isize) &&
+           !memcmp (stored.data () + isize + 1, id, size);
+}
+
+pzq::dedup_window_t::record_t *pzq::dedup_window_t::record (uint64_t ticket)
+{
+    if (!ticket)
+        return NULL;
+
+    record_t &r = m_records [(ticket - 1) % m_records.size ()];
+    return r.ticket == ticket ? &r : NULL;
+}
+
+const pzq::dedup_window_t::record_t *pzq::dedup_window_t::record (uint64_t ticket) const
+{
+    return const_cast<dedup_window_t *> (this)->record (ticket);
+}
+
+uint64_t pzq::dedup_window_t::find (const char *identity, size_t isize, const char *id, size_t size) const
+{
+    uint64_t h = hash (identity, isize, id, size);
+    uint16_t fp = fingerprint (h);
+    size_t buckets [2] = { h & m_mask, 0 };
+    buckets [1] = alternate (buckets [0], fp);
+
+    for (int b = 0; b < 2; b++)
+    {
+        const slot_t *slot = &m_slots [buckets [b] * bucket_slots];
+
+        for (int i = 0; i < bucket_slots; i++)
+            if (slot [i].fingerprint == fp && matches (slot [i].entry, identity, isize, id, size))
+                return m_records [slot [i].entry].ticket;
+    }
+    return 0;
+}
+
+bool pzq::dedup_window_t::place (size_t bucket, uint16_t fingerprint, uint32_t entry)
+{
+    slot_t *slot = &m_slots [bucket * bucket_slots];
+
+    for (int i = 0; i < bucket_slots; i++)
+    {
+        if (!slot [i].fingerprint)
+        {
+            slot [i].fingerprint = fingerprint;
+            slot [i].entry = entry;
+            return true;
+        }
+    }
+    return false;
+}
+
+void pzq::dedup_window_t::forget (uint32_t entry)
+{
+    uint64_t h = m_records [entry].hash;
+    uint16_t fp = fingerprint (h);
+    size_t buckets [2] = { h & m_mask, 0 };
+    buckets [1] = alternate (buckets [0], fp);
+
+    for (int b = 0; b < 2; b++)
+    {
+        slot_t *slot = &m_slots [buckets [b] * bucket_slots];
+
+        for (int i = 0; i < bucket_slots; i++)
+        {
+            if (slot [i].fingerprint == fp && slot [i].entry == entry)
+            {
+                slot [i].fingerprint = 0;
+                return;
+            }
+        }
+    }
+}
+
+uint64_t pzq::dedup_window_t::insert (const char *identity, size_t isize, const char *id, size_t size)
+{
+    uint64_t ticket = ++m_tickets;
+    uint32_t entry = (uint32_t) ((ticket - 1) % m_records.size ());
+
+    // The ring is full, the oldest id goes, retries still waiting on it
+    // get no answer and send again
+    if (m_count == m_records.size ())
+        forget (entry);
+    else
+        m_count++;
+
+    record_t &r = m_records [entry];
+    r.key.assign (identity, isize);
+    r.key.push_back ('\0');
+    r.key.append (id, size);
+    r.ticket = ticket;
+    r.status = 0;
+    r.message.clear ();
+    r.waiters.clear ();
+
+    uint64_t h = hash (identity, isize, id, size);
+    r.hash = h;
+
+    uint16_t fp = fingerprint (h);
+    size_t bucket = h & m_mask;
+
+    if (place (bucket, fp, entry) || place (alternate (bucket, fp), fp, entry))
+        return ticket;
+
+    // Both buckets full, push a random slot to its other bucket
+    for (int kick = 0; kick < max_kicks; kick++)
+    {
+        m_random ^= m_random << 13;
+        m_random ^= m_random >> 17;
+        m_random ^= m_random << 5;
+
+        slot_t &victim = m_slots [bucket * bucket_slots + m_random % bucket_slots];
+        std::swap (victim.fingerprint, fp);
+        std::swap (victim.entry, entry);
+
+        bucket = alternate (bucket, fp);
+        if (place (bucket, fp, entry))
+            return ticket;
+    }
+    m_lost++;
+    return ticket;
+}
+
+void pzq::dedup_window_t::complete (uint64_t ticket, char status, const std::string &message,
+                                    std::vector<std::string> &waiters)
+{
+    waiters.clear ();
+
+    record_t *r = record (ticket);
+    if (!r)
+        return;
+
+    r->status = status;
+    r->message = message;
+    waiters.swap (r->waiters);
+}
+
+void pzq::dedup_window_t::wait (uint64_t ticket, const char *peer, size_t size)
+{
+    record_t *r = record (ticket);
+    if (r)
+        r->waiters.push_back (std::string (peer, size));
+}
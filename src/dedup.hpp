@@ -0,0 +1,139 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_DEDUP_HPP
+# define PZQ_DEDUP_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+namespace pzq {
+
+    /*
+      The last size message ids stored, each with the identity of the
+      producer that sent it and the ACK it got. The ids sit in a ring,
+      the oldest is forgotten when a new one comes in. A cuckoo filter
+      finds them: every id has a 16 bit fingerprint in one of two
+      buckets of four slots, and the slot also holds the position of the
+      id in the ring. A lookup compares the stored id only on a
+      fingerprint match, so ids never seen are turned away after two
+      bucket reads, and a match is always exact. The filter has room for
+      twice the window, an insert that still finds no place forgets the
+      id it pushed out last.
+
+      An id goes in when its message is stored, and its ACK follows once
+      it is final, which with replicas is after they answer. Each id gets
+      a ticket, the number of ids inserted before it plus one, that
+      stays valid until the id leaves the window. Retries that come in
+      before the ACK is final wait on the ticket.
+
+      Used from the manager thread only.
+    */
+    class dedup_window_t
+    {
+    private:
+        struct slot_t
+        {
+            uint16_t fingerprint;
+            uint32_t entry;
+        };
+
+        struct record_t
+        {
+            std::string key;        // identity, '\0', id
+            uint64_t hash;
+            uint64_t ticket;
+            char status;            // 0 until the ACK is final
+            std::string message;
+            std::vector<std::string> waiters;
+        };
+
+        enum { bucket_slots = 4, max_kicks = 500 };
+
+        std::vector<record_t> m_records;
+        uint64_t m_tickets;
+        size_t m_count;
+
+        std::vector<slot_t> m_slots;
+        size_t m_mask;
+        uint32_t m_random;
+        uint64_t m_lost;
+
+        static uint64_t hash (const char *identity, size_t isize, const char *id, size_t size);
+        static uint16_t fingerprint (uint64_t hash);
+        size_t alternate (size_t bucket, uint16_t fingerprint) const;
+
+        bool matches (uint32_t entry, const char *identity, size_t isize, const char *id, size_t size) const;
+        bool place (size_t bucket, uint16_t fingerprint, uint32_t entry);
+        void forget (uint32_t entry);
+
+        // NULL once the ticket has left the window
+        record_t *record (uint64_t ticket);
+        const record_t *record (uint64_t ticket) const;
+
+    public:
+        explicit dedup_window_t (size_t size);
+
+        // Ticket of id if identity has sent it within the window, 0 if not
+        uint64_t find (const char *identity, size_t isize, const char *id, size_t size) const;
+
+        bool seen (const char *identity, size_t isize, const char *id, size_t size) const
+        {
+            return find (identity, isize, id, size) != 0;
+        }
+
+        // Remembers a stored message whose ACK is not final yet
+        uint64_t insert (const char *identity, size_t isize, const char *id, size_t size);
+
+        // The final ACK of ticket, waiters gets the retries that waited for it
+        void complete (uint64_t ticket, char status, const std::string &message, std::vector<std::string> &waiters);
+
+        // Answers a retry with routing id peer once the ACK of ticket is final
+        void wait (uint64_t ticket, const char *peer, size_t size);
+
+        bool pending (uint64_t ticket) const
+        {
+            const record_t *r = record (ticket);
+            return r && !r->status;
+        }
+
+        char status (uint64_t ticket) const
+        {
+            const record_t *r = record (ticket);
+            return r ? r->status : 0;
+        }
+
+        const std::string &message (uint64_t ticket) const
+        {
+            return record (ticket)->message;
+        }
+
+        size_t size () const
+        {
+            return m_count;
+        }
+
+        // Ids the filter had no room for
+        uint64_t lost () const
+        {
+            return m_lost;
+        }
+    };
+}
+
+#endif
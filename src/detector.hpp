@@ -0,0 +1,104 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_DETECTOR_HPP
+# define PZQ_DETECTOR_HPP
+
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+
+namespace pzq {
+
+    /*
+      Phi accrual failure detector. Keeps the last intervals between
+      heartbeats of a node and turns the time since the last one into
+      phi, the confidence that the node is down on a log10 scale: phi 1
+      means a 10% chance of a false alarm, phi 8 one in 10^8. The
+      interval distribution is taken to be normal, with the deviation
+      floored at a quarter of the mean so that a very regular node does
+      not get declared down by the first late heartbeat.
+    */
+    class phi_detector_t
+    {
+    public:
+        enum { window = 64 };
+
+    private:
+        double m_intervals [window];
+        size_t m_count;
+        size_t m_next;
+        double m_sum;
+        double m_squares;
+        uint64_t m_last;
+
+    public:
+        // expected is the interval assumed until real ones come in
+        explicit phi_detector_t (uint64_t expected = 1000000, uint64_t now = 0)
+            : m_count (0), m_next (0), m_sum (0), m_squares (0), m_last (now)
+        {
+            sample (expected);
+        }
+
+        void heartbeat (uint64_t now)
+        {
+            if (now > m_last)
+                sample (now - m_last);
+            m_last = now;
+        }
+
+        uint64_t last () const
+        {
+            return m_last;
+        }
+
+        double phi (uint64_t now) const
+        {
+            double mean = m_sum / m_count;
+            double variance = m_squares / m_count - mean * mean;
+            double deviation = std::max (std::sqrt (variance > 0 ? variance : 0), mean / 4);
+
+            // Logistic approximation of the normal CDF
+            double y = ((double) (now > m_last ? now - m_last : 0) - mean) / deviation;
+            double e = std::exp (-y * (1.5976 + 0.070566 * y * y));
+
+            if (y > 0)
+                return -std::log10 (e / (1.0 + e));
+            return -std::log10 (1.0 - 1.0 / (1.0 + e));
+        }
+
+    private:
+        void sample (uint64_t interval)
+        {
+            double value = (double) interval;
+
+            if (m_count == window)
+            {
+                m_sum -= m_intervals [m_next];
+                m_squares -= m_intervals [m_next] * m_intervals [m_next];
+            }
+            else
+                m_count++;
+
+            m_intervals [m_next] = value;
+            m_next = (m_next + 1) % window;
+            m_sum += value;
+            m_squares += value * value;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_DIGEST_HPP
+# define PZQ_DIGEST_HPP
+
+#include "pzq.hpp"
+
+#include <map>
+#include <cstdlib>
+#include <stdint.h>
+
+namespace pzq {
+
+    /*
+      Summary of a set of keys: how many there are and the XOR of their
+      hashes. Adding and removing a key are the same operation on the hash,
+      so the digest follows the set in constant time per change.
+    */
+    struct digest_t
+    {
+        uint64_t count;
+        uint64_t hash;
+
+        digest_t () : count (0), hash (0)
+        {}
+
+        bool operator== (const digest_t &other) const
+        {
+            return count == other.count && hash == other.hash;
+        }
+
+        bool operator!= (const digest_t &other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    /*
+      Digests of a key set split into buckets by the timestamp at the
+      start of the key, so that two nodes can narrow a difference down
+      to the buckets that actually differ.
+    */
+    class digest_set_t
+    {
+    public:
+        typedef std::map<uint64_t, digest_t> buckets_t;
+
+        // One minute of keys per bucket
+        enum { bucket_width = 60000000 };
+
+    private:
+        buckets_t m_buckets;
+
+        static uint64_t hash (const char *kbuf, size_t ksiz)
+        {
+            return pzq::hash64 (kbuf, ksiz);
+        }
+
+    public:
+        static uint64_t bucket (const char *kbuf, size_t ksiz)
+        {
+            uint64_t ts = 0;
+            for (size_t i = 0; i < ksiz && kbuf [i] >= '0' && kbuf [i] <= '9'; i++)
+                ts = ts * 10 + (kbuf [i] - '0');
+            return ts / bucket_width;
+        }
+
+        void add (const char *kbuf, size_t ksiz)
+        {
+            digest_t &d = m_buckets [bucket (kbuf, ksiz)];
+            d.count++;
+            d.hash ^= hash (kbuf, ksiz);
+        }
+
+        void remove (const char *kbuf, size_t ksiz)
+        {
+            buckets_t::iterator it = m_buckets.find (bucket (kbuf, ksiz));
+            if (it == m_buckets.end ())
+                return;
+
+            it->second.count--;
+            it->second.hash ^= hash (kbuf, ksiz);
+
+            if (it->second.count == 0)
+                m_buckets.erase (it);
+        }
+
+        digest_t get (uint64_t b) const
+        {
+            buckets_t::const_iterator it = m_buckets.find (b);
+            return (it == m_buckets.end ()) ? digest_t () : it->second;
+        }
+
+        const buckets_t &buckets () const
+        {
+            return m_buckets;
+        }
+
+        bool empty () const
+        {
+            return m_buckets.empty ();
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_ESTIMATOR_HPP
+# define PZQ_ESTIMATOR_HPP
+
+#include <stdint.h>
+
+namespace pzq {
+
+    /*
+      ACK timeout derived from the time consumers take between a delivery
+      and its ACK, the way TCP derives its retransmission timeout from
+      round trips: a moving average of the latency plus four times its
+      mean deviation, with gains of 1/8 and 1/4. The result is kept
+      within the bounds. Without an upper bound, or before the first
+      sample, the fixed timeout is used.
+
+      Deliveries that expire back the timeout off the way TCP backs off
+      its retransmission timer: it doubles, at most once per timeout
+      however many expire together, up to the upper bound. The next
+      sample takes over again.
+    */
+    class ack_estimator_t
+    {
+    private:
+        uint64_t m_fixed;
+        uint64_t m_min;
+        uint64_t m_max;
+        uint64_t m_smoothed;
+        uint64_t m_deviation;
+        uint64_t m_samples;
+        uint64_t m_backoff;
+        uint64_t m_backoff_at;
+
+        uint64_t estimate () const
+        {
+            if (!m_samples)
+                return m_fixed;
+
+            uint64_t timeout = m_smoothed + 4 * m_deviation;
+            if (timeout < m_min)
+                return m_min;
+            if (timeout > m_max)
+                return m_max;
+            return timeout;
+        }
+
+    public:
+        ack_estimator_t () : m_fixed (5000000ULL), m_min (0), m_max (0),
+                             m_smoothed (0), m_deviation (0), m_samples (0),
+                             m_backoff (0), m_backoff_at (0)
+        {}
+
+        void set_fixed (uint64_t timeout)
+        {
+            m_fixed = timeout;
+        }
+
+        // max 0 keeps the fixed timeout
+        void set_bounds (uint64_t min, uint64_t max)
+        {
+            m_min = min;
+            m_max = max;
+        }
+
+        bool adaptive () const
+        {
+            return m_max > 0;
+        }
+
+        void sample (uint64_t latency)
+        {
+            if (!m_samples)
+            {
+                m_smoothed = latency;
+                m_deviation = latency / 2;
+            }
+            else
+            {
+                uint64_t diff = (latency > m_smoothed) ? latency - m_smoothed : m_smoothed - latency;
+                m_deviation = m_deviation - m_deviation / 4 + diff / 4;
+                m_smoothed = m_smoothed - m_smoothed / 8 + latency / 8;
+            }
+            m_samples++;
+            m_backoff = 0;
+        }
+
+        // A delivery expired at monotonic time now
+        void backoff (uint64_t now)
+        {
+            if (!adaptive () || (m_backoff && now - m_backoff_at < m_backoff))
+                return;
+
+            uint64_t timeout = this->timeout () * 2;
+            m_backoff = (timeout > m_max) ? m_max : timeout;
+            m_backoff_at = now;
+        }
+
+        uint64_t timeout () const
+        {
+            if (!adaptive ())
+                return m_fixed;
+
+            uint64_t timeout = estimate ();
+            return (m_backoff > timeout) ? m_backoff : timeout;
+        }
+
+        // Smoothed delivery to ACK latency in microseconds
+        uint64_t latency () const
+        {
+            return m_smoothed;
+        }
+
+        uint64_t samples () const
+        {
+            return m_samples;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "histogram.hpp"
+
+#include <cstring>
+
+size_t pzq::histogram_t::index (uint64_t value)
+{
+    if (value < linear)
+        return (size_t) value;
+
+    // Position of the highest bit, 5 or more here
+    int bit = 63;
+    while (!(value >> bit))
+        bit--;
+
+    // The top five bits pick the bucket within the power of two
+    int shift = bit - 4;
+    return linear + (shift - 1) * sub_buckets + (size_t) ((value >> shift) - sub_buckets);
+}
+
+uint64_t pzq::histogram_t::highest (size_t index)
+{
+    if (index < linear)
+        return index;
+
+    int shift = (int) ((index - linear) / sub_buckets) + 1;
+    uint64_t top = (index - linear) % sub_buckets + sub_buckets;
+    return ((top + 1) << shift) - 1;
+}
+
+void pzq::histogram_t::reset ()
+{
+    memset (m_counts, 0, sizeof (m_counts));
+    m_count = 0;
+    m_min = ~(uint64_t) 0;
+    m_max = 0;
+    m_sum = 0;
+}
+
+void pzq::histogram_t::merge (const histogram_t &other)
+{
+    for (size_t i = 0; i < buckets; i++)
+        m_counts [i] += other.m_counts [i];
+
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+
+    if (other.m_min < m_min)
+        m_min = other.m_min;
+    if (other.m_max > m_max)
+        m_max = other.m_max;
+}
+
+uint64_t pzq::histogram_t::percentile (double percentile) const
+{
+    if (!m_count)
+        return 0;
+
+    // The rank of the value asked for, 1 based
+    uint64_t rank = (uint64_t) (percentile / 100.0 * m_count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > m_count)
+        rank = m_count;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets; i++)
+    {
+        seen += m_counts [i];
+        if (seen >= rank)
+            return (highest (i) < m_max) ? highest (i) : m_max;
+    }
+    return m_max;
+}
+
+void pzq::histogram_t::print (std::ostream &out) const
+{
+    out << "count="  << count ()
+        << " min="   << min ()
+        << " mean="  << mean ()
+        << " p50="   << percentile (50.0)
+        << " p90="   << percentile (90.0)
+        << " p99="   << percentile (99.0)
+        << " p999="  << percentile (99.9)
+        << " max="   << max ();
+}
@@ -0,0 +1,100 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_HISTOGRAM_HPP
+# define PZQ_HISTOGRAM_HPP
+
+#include <ostream>
+#include <stdint.h>
+
+namespace pzq {
+
+    /*
+      Latency histogram in the manner of HdrHistogram. Values below 32
+      have a bucket each, above that every power of two is split into 16
+      buckets, so a value is off by less than 1/16 of itself. Recording
+      is an index computation and an increment, a percentile walks at
+      most all 976 buckets. Values are microseconds. An instance belongs
+      to one thread.
+    */
+    class histogram_t
+    {
+    private:
+        enum { linear = 32, sub_buckets = 16, buckets = linear + 59 * sub_buckets };
+
+        uint64_t m_counts [buckets];
+        uint64_t m_count;
+        uint64_t m_min;
+        uint64_t m_max;
+        uint64_t m_sum;
+
+        static size_t index (uint64_t value);
+
+        // Largest value that falls into the bucket
+        static uint64_t highest (size_t index);
+
+    public:
+        histogram_t ()
+        {
+            reset ();
+        }
+
+        void record (uint64_t value)
+        {
+            m_counts [index (value)]++;
+            m_count++;
+            m_sum += value;
+
+            if (value < m_min)
+                m_min = value;
+            if (value > m_max)
+                m_max = value;
+        }
+
+        void reset ();
+
+        // Adds the values of another histogram, such as one per thread
+        void merge (const histogram_t &other);
+
+        uint64_t count () const
+        {
+            return m_count;
+        }
+
+        uint64_t min () const
+        {
+            return m_count ? m_min : 0;
+        }
+
+        uint64_t max () const
+        {
+            return m_max;
+        }
+
+        uint64_t mean () const
+        {
+            return m_count ? m_sum / m_count : 0;
+        }
+
+        // Value at or below which percentile % of the values fall, 0 when empty
+        uint64_t percentile (double percentile) const;
+
+        // count=N min=N mean=N p50=N p90=N p99=N p999=N max=N
+        void print (std::ostream &out) const;
+    };
+}
+
+#endif
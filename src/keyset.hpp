@@ -0,0 +1,154 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_KEYSET_HPP
+# define PZQ_KEYSET_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+
+namespace pzq {
+
+    /*
+      Set of keys collected one by one and written out sorted, each key
+      as the length of the prefix it shares with the one before, the
+      length of the rest and the rest. Keys start with their timestamp,
+      so neighbours share most of it. Lengths are unsigned LEB128. The
+      buffers are kept between rounds, adding does not allocate once
+      they have grown to the size of a round.
+    */
+    class key_set_t
+    {
+    private:
+        typedef std::pair<size_t, size_t> span_t;
+
+        std::string m_data;
+        std::vector<span_t> m_spans;
+
+        struct less_t
+        {
+            const char *m_base;
+
+            less_t (const char *base) : m_base (base)
+            {}
+
+            bool operator() (const span_t &a, const span_t &b) const
+            {
+                int cmp = memcmp (m_base + a.first, m_base + b.first, std::min (a.second, b.second));
+                return cmp < 0 || (cmp == 0 && a.second < b.second);
+            }
+        };
+
+        static void put (std::string &out, uint64_t value)
+        {
+            while (value >= 0x80)
+            {
+                out.push_back ((char) ((value & 0x7f) | 0x80));
+                value >>= 7;
+            }
+            out.push_back ((char) value);
+        }
+
+        static bool get (const char *&p, const char *end, uint64_t &value)
+        {
+            value = 0;
+            for (int shift = 0; p < end && shift < 64; shift += 7)
+            {
+                unsigned char c = (unsigned char) *p++;
+                value |= (uint64_t) (c & 0x7f) << shift;
+                if (!(c & 0x80))
+                    return true;
+            }
+            return false;
+        }
+
+    public:
+        void add (const char *key, size_t size)
+        {
+            m_spans.push_back (span_t (m_data.size (), size));
+            m_data.append (key, size);
+        }
+
+        size_t size () const
+        {
+            return m_spans.size ();
+        }
+
+        bool empty () const
+        {
+            return m_spans.empty ();
+        }
+
+        // Writes the keys to out without duplicates and empties the set
+        void encode (std::string &out)
+        {
+            const char *base = m_data.data ();
+            std::sort (m_spans.begin (), m_spans.end (), less_t (base));
+
+            out.clear ();
+            const char *prev = NULL;
+            size_t prev_size = 0;
+
+            for (std::vector<span_t>::const_iterator it = m_spans.begin (); it != m_spans.end (); it++)
+            {
+                const char *key = base + it->first;
+                size_t shared = 0, limit = std::min (prev_size, it->second);
+
+                while (shared < limit && prev [shared] == key [shared])
+                    shared++;
+
+                if (prev && shared == prev_size && shared == it->second)
+                    continue;
+
+                put (out, shared);
+                put (out, it->second - shared);
+                out.append (key + shared, it->second - shared);
+
+                prev = key;
+                prev_size = it->second;
+            }
+
+            m_data.clear ();
+            m_spans.clear ();
+        }
+
+        // Appends the keys of an encoded set, false if it is malformed
+        static bool decode (const char *data, size_t size, std::vector<std::string> &keys)
+        {
+            const char *p = data, *end = data + size;
+            std::string key;
+
+            while (p < end)
+            {
+                uint64_t shared, rest;
+                if (!get (p, end, shared) || !get (p, end, rest) ||
+                    shared > key.size () || rest > (uint64_t) (end - p))
+                    return false;
+
+                key.resize (shared);
+                key.append (p, rest);
+                p += rest;
+                keys.push_back (key);
+            }
+            return true;
+        }
+    };
+}
+
+#endif
@@ -78,22 +78,24 @@ bool drop_privileges(uid_t uid, gid_t gid)
     return true;
 }
 
-static std::string buildBroadcastDsn( const std::string& nodeDsn, const std::string& currentNodeDsn )
+// Host of the broadcast DSN with the port of the receive DSN, where the
+// other nodes reach our receive socket unless --node-dsn says otherwise
+static std::string buildNodeDsn( const std::string& broadcastDsn, const std::string& receiveDsn )
 {
-    std::vector< std::string > nodeDsnParts;
-    split( nodeDsnParts, nodeDsn, boost::is_any_of(":"), boost::algorithm::token_compress_on );
+    std::vector< std::string > broadcastDsnParts;
+    split( broadcastDsnParts, broadcastDsn, boost::is_any_of(":"), boost::algorithm::token_compress_on );
     
-    std::vector< std::string > currentNodeDsnParts;
-    split( currentNodeDsnParts, currentNodeDsn, boost::is_any_of(":"), boost::algorithm::token_compress_on );
+    std::vector< std::string > receiveDsnParts;
+    split( receiveDsnParts, receiveDsn, boost::is_any_of(":"), boost::algorithm::token_compress_on );
     
-    if( nodeDsnParts.size() == 3 && currentNodeDsnParts.size() == 3 )
+    if( broadcastDsnParts.size() == 3 && receiveDsnParts.size() == 3 )
     {
-        std::vector< std::string > broadcastDsnParts;
-        broadcastDsnParts.push_back( nodeDsnParts[ 0 ] );
-        broadcastDsnParts.push_back( nodeDsnParts[ 1 ] );
-        broadcastDsnParts.push_back( currentNodeDsnParts[ 2 ] );
-        pzq::log("%s\n", boost::algorithm::join( broadcastDsnParts, ":" ).c_str());
-        return boost::algorithm::join( broadcastDsnParts, ":" );
+        std::vector< std::string > nodeDsnParts;
+        nodeDsnParts.push_back( broadcastDsnParts[ 0 ] );
+        nodeDsnParts.push_back( broadcastDsnParts[ 1 ] );
+        nodeDsnParts.push_back( receiveDsnParts[ 2 ] );
+        pzq::log("node:%s\n", boost::algorithm::join( nodeDsnParts, ":" ).c_str());
+        return boost::algorithm::join( nodeDsnParts, ":" );
     }
     else
     {
@@ -120,16 +122,30 @@ static std::string buildSubscribeDsn( const std::string& currentNodeDsn )
     }
 }
 
+// One DEALER per node so replicas can be placed on a chosen node,
+// the send HWM is the node's replication window
+static boost::shared_ptr<pzq::socket_t> connectNode( zmq::context_t *context, int linger, uint64_t hwm,
+                                                     const std::string& dsn )
+{
+    boost::shared_ptr<pzq::socket_t> peerSocket( new pzq::socket_t( *context, ZMQ_DEALER ) );
+    peerSocket.get()->setsockopt( ZMQ_LINGER, &linger, sizeof( int ) );
+    peerSocket.get()->setsockopt( ZMQ_SNDHWM, &hwm, sizeof( uint32_t ) );
+    peerSocket.get()->setsockopt( ZMQ_RCVHWM, &hwm, sizeof( uint32_t ) );
+    peerSocket.get()->connect( dsn.c_str() );
+    return peerSocket;
+}
+
 int main (int argc, char *argv []) 
 {
     po::options_description desc ("Command-line options");
     po::variables_map vm;
     std::string filename;
     std::string user;
-    int64_t inflight_size;
-    uint64_t ack_timeout, reaper_frequency, timeoutNode, timeoutReplication;
-    std::string receiver_dsn, sender_dsn, monitor_dsn, peer_uuid, nodes, currentNode_dsn;
-    int32_t replicas;
+    int64_t inflight_size, replica_page_cache, dedup_window;
+    uint64_t ack_timeout, ack_timeout_min, ack_timeout_max, reaper_frequency, metrics_interval, timeoutNode, timeoutReplication, replication_linger, anti_entropy_interval, bootstrap_rate, peer_buffer;
+    std::string receiver_dsn, sender_dsn, monitor_dsn, peer_uuid, nodes, currentNode_dsn, node_dsn;
+    int32_t replicas, replication_window, replication_batch, partitions, virtual_nodes, envelope, trace_sample;
+    double phi_threshold;
 
     desc.add_options ()
         ("help", "produce help message");
@@ -146,17 +162,58 @@ int main (int argc, char *argv [])
          "How long to wait for ACK before resending message (microseconds)")
     ;
 
+    desc.add_options()
+        ("ack-timeout-min",
+          po::value<uint64_t> (&ack_timeout_min)->default_value (100000),
+         "Shortest ACK timeout derived from the time consumers take to ACK (microseconds)")
+    ;
+
+    desc.add_options()
+        ("ack-timeout-max",
+          po::value<uint64_t> (&ack_timeout_max)->default_value (0),
+         "Longest ACK timeout derived from the time consumers take to ACK, 0 keeps --ack-timeout fixed (microseconds)")
+    ;
+
+    desc.add_options()
+        ("envelope",
+          po::value<int32_t> (&envelope)->default_value (pzq::envelope_text),
+         "Consumer message envelope, 1 for text sent time and timeout or 2 for a binary header")
+    ;
+
     desc.add_options()
         ("reaper-frequency",
           po::value<uint64_t> (&reaper_frequency)->default_value (2500000),
          "How often to clean up expired messages (microseconds)")
     ;
 
+    desc.add_options()
+        ("trace-sample",
+          po::value<int32_t> (&trace_sample)->default_value (0),
+         "Trace one in every N messages, 0 traces only messages with a TRACE part")
+    ;
+
+    desc.add_options()
+        ("metrics-interval",
+          po::value<uint64_t> (&metrics_interval)->default_value (1000000),
+         "How often the values returned by METRICS are refreshed (microseconds)")
+    ;
+
     desc.add_options()
         ("hard-sync",
          "If enabled the data is flushed to disk on every sync")
     ;
 
+    desc.add_options()
+        ("replica-hard-sync",
+         "If enabled the replica data is flushed to disk on every sync")
+    ;
+
+    desc.add_options()
+        ("replica-page-cache",
+          po::value<int64_t> (&replica_page_cache)->default_value (0),
+         "Page cache size in bytes for the replica database, 0 for the default")
+    ;
+
     desc.add_options()
         ("background",
          "Run in daemon mode")
@@ -167,6 +224,12 @@ int main (int argc, char *argv [])
           po::value<int64_t> (&inflight_size)->default_value (31457280),
          "Maximum size in bytes for the in-flight messages database. Full database causes LRU collection")
     ;
+
+    desc.add_options()
+        ("dedup-window",
+          po::value<int64_t> (&dedup_window)->default_value (0),
+         "Producer message ids remembered to answer retries without storing them again, 0 to disable. Producers are told apart by a PRODUCER:<id> part, or a fixed socket identity")
+    ;
     
     desc.add_options()
         ("user",
@@ -198,22 +261,46 @@ int main (int argc, char *argv [])
          "Number of replicas that should created before acknowledging message to producer")
     ;
    
+    desc.add_options()
+        ("partitions",
+         po::value<int32_t>(&partitions)->default_value(0),
+         "Number of partitions the cluster splits the writes into, 0 for every node taking every write")
+    ;
+
+    desc.add_options()
+        ("virtual-nodes",
+         po::value<int32_t>(&virtual_nodes)->default_value(64),
+         "Points every node gets on the partition ring")
+    ;
+   
     desc.add_options()
         ("nodes",
          po::value<std::string >(&nodes)->default_value(""),
-         "List of DSN for other cluster nodes separated by a ','")
+         "List of receive DSN of cluster nodes to join through separated by a ','")
     ;
    
     desc.add_options()
         ("timeout-nodes",
          po::value<uint64_t>(&timeoutNode)->default_value(10000000),
-         "How long to wait before considering a node down (microseconds)")
+         "Longest silence before a node is considered down, heartbeats go out every tenth of it (microseconds)")
+    ;
+
+    desc.add_options()
+        ("phi-threshold",
+         po::value<double>(&phi_threshold)->default_value(8.0),
+         "Suspicion level at which a node is considered down by the failure detector")
     ;
    
     desc.add_options()
         ("broadcast-dsn",
          po::value<std::string>(&currentNode_dsn)->default_value(""),
-         "DSN used by other cluster nodes to broadcast msessages. Broardcast port should be the same for all nodes")
+         "DSN used by other cluster nodes to broadcast msessages, also the name of this node in the cluster")
+    ;
+
+    desc.add_options()
+        ("node-dsn",
+         po::value<std::string>(&node_dsn)->default_value(""),
+         "DSN other cluster nodes reach the receive socket on, defaults to the broadcast host with the receive port")
     ;
    
     desc.add_options()
@@ -222,6 +309,42 @@ int main (int argc, char *argv [])
          "How long to wait for replication before acknowledging producer with a replication error message")
     ;
 
+    desc.add_options()
+        ("replication-window",
+         po::value<int32_t>(&replication_window)->default_value(1024),
+         "Maximum number of unacknowledged replicas per node")
+    ;
+
+    desc.add_options()
+        ("replication-batch",
+         po::value<int32_t>(&replication_batch)->default_value(64),
+         "Maximum number of replicas sent to a node in one batch")
+    ;
+
+    desc.add_options()
+        ("replication-linger",
+         po::value<uint64_t>(&replication_linger)->default_value(500),
+         "How long a batch waits for more replicas before it is sent, capped at half of timeout_replication (microseconds)")
+    ;
+
+    desc.add_options()
+        ("anti-entropy-interval",
+         po::value<uint64_t>(&anti_entropy_interval)->default_value(60000000),
+         "How often replica digests are compared with their owners to find orphaned replicas, 0 to disable (microseconds)")
+    ;
+
+    desc.add_options()
+        ("bootstrap-rate",
+         po::value<uint64_t>(&bootstrap_rate)->default_value(10485760),
+         "Bytes per second sent to a node catching up after joining or coming back, 0 for no limit")
+    ;
+
+    desc.add_options()
+        ("peer-buffer",
+         po::value<uint64_t>(&peer_buffer)->default_value(16777216),
+         "Bytes that can wait to be sent to a node before replicas skip it")
+    ;
+
     try {
         po::store (po::parse_command_line (argc, argv, desc), vm);
         po::notify (vm);
@@ -234,6 +357,26 @@ int main (int argc, char *argv [])
         std::cerr << desc << std::endl;
         return 1;
     }
+
+    if (envelope != pzq::envelope_text && envelope != pzq::envelope_binary) {
+        std::cerr << "Unknown envelope version " << envelope << std::endl;
+        return 1;
+    }
+
+    if (trace_sample < 0) {
+        std::cerr << "--trace-sample can not be negative" << std::endl;
+        return 1;
+    }
+
+    if (!metrics_interval) {
+        std::cerr << "--metrics-interval must be larger than 0" << std::endl;
+        return 1;
+    }
+
+    if (ack_timeout_max && ack_timeout_min > ack_timeout_max) {
+        std::cerr << "--ack-timeout-min is larger than --ack-timeout-max" << std::endl;
+        return 1;
+    }
     
     if (vm.count ("user") && user.length() != 0) {
         struct passwd *res_user;
@@ -255,6 +398,11 @@ int main (int argc, char *argv [])
     if( nodes != "" )
         split( nodeNames, nodes, boost::is_any_of(","), boost::algorithm::token_compress_on );
 
+    if( nodeNames.size() > pzq::max_peers ) {
+        std::cerr << "At most " << pzq::max_peers << " cluster nodes are supported" << std::endl;
+        exit(1);
+    }
+
 
     // Background
     if (vm.count ("background")) {
@@ -274,9 +422,22 @@ int main (int argc, char *argv [])
         int linger = 1000;
         uint64_t in_hwm = 10, out_hwm = 1;
 
+        // Owned by the manager thread, which samples it once per loop
+        boost::shared_ptr<pzq::clock_service_t> clock (new pzq::clock_service_t ());
+        boost::shared_ptr<pzq::timer_service_t> timers (new pzq::timer_service_t (clock));
+
+        // Every thread counts into a shard of its own
+        boost::shared_ptr<pzq::metrics_t> metrics (new pzq::metrics_t ());
+
         boost::shared_ptr<pzq::datastore_t> store (new pzq::datastore_t ());
+        store.get ()->set_clock (clock);
+        store.get ()->set_metrics (metrics);
+        store.get ()->set_hard_sync (vm.count ("hard-sync") > 0);
+        store.get ()->set_replica_hard_sync (vm.count ("replica-hard-sync") > 0);
+        store.get ()->set_replica_page_cache (replica_page_cache);
         store.get ()->open (filename, inflight_size);
         store.get ()->set_ack_timeout (ack_timeout);
+        store.get ()->set_ack_timeout_bounds (ack_timeout_min, ack_timeout_max);
 
         boost::shared_ptr<pzq::socket_t> in_socket (new pzq::socket_t (context, ZMQ_ROUTER));
         in_socket.get ()->setsockopt (ZMQ_LINGER, &linger, sizeof (int));
@@ -296,33 +457,53 @@ int main (int argc, char *argv [])
         monitor.get ()->setsockopt (ZMQ_RCVHWM, &out_hwm, sizeof (uint32_t));
         monitor.get ()->bind (monitor_dsn.c_str ());
 
-        boost::shared_ptr<pzq::socket_t> clusterSocket( new pzq::socket_t( context, ZMQ_DEALER ) );
-        clusterSocket.get()->setsockopt( ZMQ_LINGER, &linger, sizeof( int ) );
-        clusterSocket.get()->setsockopt( ZMQ_SNDHWM, &out_hwm, sizeof( uint32_t ) );
-        clusterSocket.get()->setsockopt( ZMQ_RCVHWM, &out_hwm, sizeof( uint32_t ) );
+        // Seed nodes, named once they answer. The rest of the cluster is
+        // learned from gossip
+        pzq::peerlist_t peers;
+        uint64_t window_hwm = replication_window;
         for( std::vector< std::string >::iterator it = nodeNames.begin(); it != nodeNames.end(); ++it )
-            clusterSocket.get()->connect( it->c_str() );
+            peers.push_back( pzq::peer_t( "", connectNode( &context, linger, window_hwm, *it ), *it ) );
 
+        // Connected to every node as it is learned
         boost::shared_ptr<pzq::socket_t> broadcastSocket( new pzq::socket_t( context, ZMQ_PUB ) );
         broadcastSocket.get()->setsockopt( ZMQ_LINGER, &linger, sizeof( int ) );
         broadcastSocket.get()->setsockopt( ZMQ_SNDHWM, &out_hwm, sizeof( uint32_t ) );
         broadcastSocket.get()->setsockopt( ZMQ_RCVHWM, &out_hwm, sizeof( uint32_t ) );
-        if( replicas )
-            for( std::vector< std::string >::iterator it = nodeNames.begin(); it != nodeNames.end(); ++it )
-                broadcastSocket.get()->connect( buildBroadcastDsn( *it, currentNode_dsn ).c_str() );
         
         boost::shared_ptr<pzq::socket_t> subscribeSocket( new pzq::socket_t( context, ZMQ_SUB ) );
         subscribeSocket.get()->setsockopt( ZMQ_LINGER, &linger, sizeof( int ) );
         subscribeSocket.get()->setsockopt( ZMQ_SNDHWM, &in_hwm, sizeof( uint32_t ) );
         subscribeSocket.get()->setsockopt( ZMQ_RCVHWM, &in_hwm, sizeof( uint32_t ) );
         subscribeSocket.get()->setsockopt( ZMQ_SUBSCRIBE, "CLUSTER", 7 );
-        if( replicas )
+        if( replicas || partitions > 0 )
             subscribeSocket.get()->bind( buildSubscribeDsn( currentNode_dsn ).c_str() );
         
-        boost::shared_ptr< pzq::cluster_t > cluster( new pzq::cluster_t( replicas, nodeNames, timeoutNode, 
-                                                                         clusterSocket, broadcastSocket, subscribeSocket, currentNode_dsn, store ) );
+        boost::shared_ptr< pzq::cluster_t > cluster( new pzq::cluster_t( context, replicas, peers, replication_window, timeoutNode,
+                                                                         broadcastSocket, subscribeSocket, currentNode_dsn, store, clock ) );
+        
+        cluster.get()->setBatching( replication_batch > 0 ? replication_batch : 1,
+                                    std::min( replication_linger, timeoutReplication / 2 ),
+                                    timeoutReplication );
+        cluster.get()->setAntiEntropy( anti_entropy_interval );
+        cluster.get()->setBootstrap( bootstrap_rate );
+        cluster.get()->setPeerBuffer( peer_buffer );
+        if( replicas || partitions > 0 )
+            cluster.get()->setMembership( node_dsn.empty() ? buildNodeDsn( currentNode_dsn, receiver_dsn ) : node_dsn,
+                                          boost::bind( &connectNode, &context, linger, window_hwm, _1 ),
+                                          phi_threshold );
+        if( partitions > 0 )
+            cluster.get()->setPartitions( partitions, virtual_nodes > 0 ? virtual_nodes : 1 );
         
-        boost::shared_ptr< pzq::ackcache_t > ackCache( new pzq::ackcache_t( timeoutReplication ) );
+        boost::shared_ptr< pzq::ackcache_t > ackCache( new pzq::ackcache_t( timeoutReplication, clock ) );
+
+        // Wakeup channel from the reaper to the manager, bound before the connect for inproc
+        boost::shared_ptr<pzq::socket_t> wakeup_in (new pzq::socket_t (context, ZMQ_PULL));
+        wakeup_in.get ()->setsockopt (ZMQ_LINGER, &linger, sizeof (int));
+        wakeup_in.get ()->bind ("inproc://pzq-wakeup");
+
+        boost::shared_ptr<pzq::socket_t> wakeup_out (new pzq::socket_t (context, ZMQ_PUSH));
+        wakeup_out.get ()->setsockopt (ZMQ_LINGER, &linger, sizeof (int));
+        wakeup_out.get ()->connect ("inproc://pzq-wakeup");
 
         try {
             // Start the store manager
@@ -331,14 +512,26 @@ int main (int argc, char *argv [])
             // Reaper for expired messages
             pzq::expiry_reaper_t reaper (store);
             reaper.set_frequency (reaper_frequency);
-            reaper.set_ack_timeout (ack_timeout);
+            reaper.set_wakeup_socket (wakeup_out);
             reaper.start ();
 
+            // Snapshots the metrics for METRICS off the manager thread
+            boost::shared_ptr<pzq::metrics_reader_t> metrics_reader (new pzq::metrics_reader_t (metrics));
+            metrics_reader->set_interval (metrics_interval);
+            metrics_reader->start ();
+
+            manager.set_clock (clock);
+            manager.set_timers (timers);
             manager.set_datastore (store);
             manager.set_ack_timeout (ack_timeout);
-            manager.set_sockets (in_socket, out_socket, monitor, cluster);
+            manager.set_envelope (envelope);
+            manager.set_dedup_window (dedup_window > 0 ? (size_t) dedup_window : 0);
+            manager.set_trace_sample ((uint32_t) trace_sample);
+            manager.set_wakeup_socket (wakeup_in);
+            manager.set_sockets (in_socket, out_socket, monitor);
             manager.set_cluster( cluster );
             manager.set_ack_cache( ackCache );
+            manager.set_metrics_reader (metrics_reader);
             manager.start ();
 
             while (keep_running)
@@ -349,6 +542,7 @@ int main (int argc, char *argv [])
             }
             manager.stop ();
             reaper.stop ();
+            metrics_reader->stop ();
 
         } catch (std::exception &e) {
             pzq::log ("Error running store manager: %s", e.what ());
@@ -25,53 +25,146 @@ void pzq::manager_t::handle_producer_in ()
     if (m_in.get ()->recv_many (parts) > 2)
     {
         pzq::message_t ack;
-        pzq::message_t replica = m_cluster->createReplica( parts );
         bool isAReplica = false;
-        pzq::message_t idReplica;
+        std::string replicaOwner;
+        uint64_t lease = 0;
+        bool traceRequested = false;
+        zmq::message_t id, nodeHeader, producer;
         std::string storedKey;
+        uint64_t ticket = 0;
         
         // peer id
-        ack.append (parts.pop_front ());
+        ack.append (parts.front ());
+        parts.pop_front ();
         
-        // message id
-        std::string msgId = std::string( ( char* )parts.front()->data(), parts.front()->size() );
-        ack.append (parts.pop_front ());
+        // message id, or the sequence number of a message from another node
+        std::string msgId = std::string( ( char* )parts.front().data(), parts.front().size() );
+        id.move (&parts.front ());
+        parts.pop_front ();
         
-        while (parts.size () > 0 && parts.front ().get ()->size () > 0)
+        while (parts.size () > 0 && parts.front ().size () > 0)
         {
-            pzq::message_part_t part = parts.front();
-            std::string header_msg = std::string( ( char* )part->data(), part->size() );
-            const std::string keyword = "REPLICA:";
-            if( header_msg.find( keyword ) == 0 )
+            zmq::message_t &part = parts.front();
+            if( part.size() >= 8 && !memcmp( part.data(), "REPLICA:", 8 ) )
             {
                 isAReplica = true;
-                idReplica.append( part );
+                replicaOwner.assign( ( char* )part.data() + 8, part.size() - 8 );
+            }
+            else if( part.size() > 6 && !memcmp( part.data(), "LEASE:", 6 ) )
+            {
+                // How long consumers get before the message goes out again
+                std::string value( ( char* )part.data() + 6, part.size() - 6 );
+                lease = strtoull( value.c_str(), NULL, 10 );
             }
+            else if( part.size() == 5 && !memcmp( part.data(), "TRACE", 5 ) )
+                traceRequested = true;
+            else if( part.size() > 9 && !memcmp( part.data(), "PRODUCER:", 9 ) )
+                producer.move( &part );
+            else if( m_cluster->isNodeMessage( part ) )
+                nodeHeader.move( &part );
             parts.pop_front ();
         }
         
+        if (parts.size () > 0 && nodeHeader.size ())
+        {
+            // Replication batch or anti-entropy exchange with another node
+            parts.pop_front ();
+            m_cluster->handleNodeMessage( id, nodeHeader, parts, ack );
+            if (ack.size () > 1)
+                m_in->send_many( ack );
+            dispatch_ready ();
+            return;
+        }
+        
+        ack.append (id);
+
+        // Retries are told apart by the producer id, or else by the socket
+        // identity, which changes on reconnect unless the producer fixes it
+        const char *identity = producer.size () ? static_cast<const char *> (producer.data ()) + 9
+                                                : static_cast<const char *> (ack [0].data ());
+        size_t identity_size = producer.size () ? producer.size () - 9 : ack [0].size ();
+        
         bool success;
         std::string status_message;
+        int replicas = 0;
+        uint64_t peers = 0;
+        int partition = isAReplica ? -1 : m_cluster->partition (msgId);
+        std::string owner;
         
         if (parts.size () == 0)
         {
             success = false;
             status_message = "Malformed message, no delimiter found or missing message parts";
         }
+        else if (!isAReplica && m_dedup &&
+                 (ticket = m_dedup->find (identity, identity_size, msgId.data (), msgId.size ())))
+        {
+            // A retry of a message already stored here gets its ACK again,
+            // once the replicas have answered
+            m_shard->add (pzq::metric_duplicates);
+
+            if (m_dedup->pending (ticket))
+            {
+                m_dedup->wait (ticket, static_cast<const char *> (ack [0].data ()), ack [0].size ());
+                return;
+            }
+
+            char status = m_dedup->status (ticket);
+            ack.append (&status, 1);
+            ack.append ();
+            if (m_dedup->message (ticket).size ())
+                ack.append (m_dedup->message (ticket));
+            m_in->send_many (ack);
+            return;
+        }
+        else if (m_cluster->redirect (partition, owner))
+        {
+            // Another node is the primary of this partition
+            success = false;
+            status_message = "REDIRECT " + owner;
+            m_shard->add (pzq::metric_redirects);
+        }
         else
         {
             parts.pop_front ();
             
-            if( isAReplica )
+            if( !isAReplica && m_cluster->replicas() > 0 )
             {
-                for( message_iterator_t it = parts.begin(); it != parts.end(); ++it )
-                    idReplica.append( *it );
-                parts = idReplica;
+                replicas = m_cluster->replicas();
+                int nodes = m_cluster->countActiveNodes();
+                
+                if( replicas > nodes )
+                {
+                    replicas = nodes;
+                    pzq::log ("CRITICAL: Could not create %d replicas, only %d nodes in cluster", m_cluster->replicas(), nodes );
+                }
+                
+                // placed up front so the record remembers where its replicas went
+                if( replicas > 0 )
+                    peers = m_cluster->placeReplicas( replicas, partition );
             }
             
             try {
-                m_store.get ()->save (parts, isAReplica ? msgId : "", storedKey );
+                if( isAReplica )
+                    m_store.get ()->save_replica( replicaOwner, parts, msgId, lease );
+                else
+                    m_store.get ()->save (parts, "", storedKey, peers, lease );
                 success = true;
+
+                if( !isAReplica )
+                {
+                    uint64_t now = pzq::monotonic_timestamp ();
+                    m_produce_latency.record (now > m_clock->now () ? now - m_clock->now () : 0);
+                }
+
+                // The ACK goes into the window once it is final
+                if( !isAReplica && m_dedup )
+                    ticket = m_dedup->insert( identity, identity_size, msgId.data(), msgId.size() );
+
+                if( !isAReplica && m_tracer->sample( traceRequested ) )
+                    m_tracer->start( storedKey, m_clock->now() );
+
+                dispatch_ready ();
             } catch (std::exception &e) {
                 success = false;
                 status_message = e.what ();
@@ -87,39 +180,22 @@ void pzq::manager_t::handle_producer_in ()
         if (!success && status_message.size ())
             ack.append (status_message);
         
-        if( success && m_cluster->replicas() > 0 && !isAReplica)
+        if( success && replicas > 0 )
         {
-            int replicas = m_cluster->replicas();
-            int nodes = m_cluster->countActiveNodes();
-            
-            if( replicas > nodes )
+            if( peers )
             {
-                replicas = nodes;
-                pzq::log ("CRITICAL: Could not create %d replicas, only %d nodes in cluster", m_cluster->replicas(), nodes );
-            }
-            
-            if( replicas > 0 )
-            {
-                pzq::message_t replicaWithId;
-                replicaWithId.append( storedKey );
-                message_iterator_t it = replica.begin();
-                ++it;
-                while( it != replica.end() )
-                {
-                    replicaWithId.append( *it );
-                    it++;
-                }
-                
-                for(int i = 0; i < replicas; i++)
-                    m_cluster->getOutSocket()->send_many( replicaWithId );
+                // parts still holds what was stored
+                m_cluster->sendReplicas( storedKey, parts, peers, lease );
+                m_waitingAcks->push( storedKey, ack, peers, ticket );
                 
-                m_waitingAcks->push( storedKey, ack, replicas );
+                if( m_tracer->active() )
+                    m_tracer->record( storedKey, pzq::trace_replicate );
             }
             else
-                m_in->send_many( ack );
+                handle_replication_timeout( ack, ticket );
         }
         else
-            m_in->send_many (ack);
+            send_producer_ack (ack, ticket);
     }
 }
 
@@ -129,34 +205,87 @@ void pzq::manager_t::handle_consumer_in ()
 
     if (m_out.get ()->recv_many (parts) >= 2)
     {
-        // The next part is the key
-        std::string key;
-        parts.front (key);
-        parts.pop_front ();
+        if (parts [0].size () == 5 && !memcmp (parts [0].data (), "TOUCH", 5))
+        {
+            handle_touch (parts);
+            return;
+        }
+
+        // The first part is the key, the next one indicates whether
+        // this was success or fail
+        const char *key = static_cast<const char *> (parts [0].data ());
+        size_t key_size = parts [0].size ();
+        bool success = (parts [1].size () == 1 && *static_cast<const char *> (parts [1].data ()) == '1');
 
-        // The last part indicates whether this was success or fail
-        std::string status;
-        parts.front (status);
+        if (m_tracer->active ())
+            m_tracer->record (key, key_size, success ? pzq::trace_ack : pzq::trace_nack);
 
         try {
-            if (!status.compare ("1"))
+            if (success)
              {
-                m_store.get ()->remove (key);
-                m_cluster->broadcastRemove( key );
+                m_store.get ()->remove (key, key_size, &m_ack_latency);
+                m_cluster->broadcastRemove( key, key_size );
+
+                if (m_tracer->active ())
+                    m_tracer->finish (key, key_size);
              }
             else
-                m_store.get ()->remove_inflight (key);
+            {
+                m_store.get ()->remove_inflight (key, key_size);
+                dispatch_ready ();
+            }
         } catch (std::exception &e) {
-            pzq::log ("Not removing record (%s): %s", e.what ());
+            pzq::log ("Not removing record (%.*s): %s", (int) key_size, key, e.what ());
+        }
+    }
+}
+
+void pzq::manager_t::handle_touch (pzq::message_t &parts)
+{
+    // [TOUCH][lease][key]..., an empty lease stands for --ack-timeout
+    std::string value;
+    parts.pop_front ();
+    parts.front (value);
+    parts.pop_front ();
+
+    uint64_t lease = strtoull (value.c_str (), NULL, 10);
+    if (!lease)
+        lease = m_store.get ()->get_ack_timeout ();
+
+    // A key that already went out again is not in flight any more
+    for (pzq::message_iterator_t it = parts.begin (); it != parts.end (); it++)
+    {
+        try {
+            if (m_store.get ()->touch (static_cast<const char *> (it->data ()), it->size (), lease))
+                m_shard->add (pzq::metric_touches);
+        } catch (std::exception &e) {
+            pzq::log ("Not touching record (%.*s): %s", (int) it->size (), static_cast<const char *> (it->data ()), e.what ());
         }
     }
 }
 
 void pzq::manager_t::handle_consumer_out ()
 {
+    uint64_t delivered = m_visitor.delivered ();
+
     try {
-        m_store.get ()->iterate (&m_visitor);
-    } catch (std::exception &e) { }
+        handle_takeovers ();
+
+        if (!m_store.get ()->iterate (&m_visitor))
+            return;
+    } catch (std::exception &e) {
+        return;
+    }
+
+    // The cursor wrapped. Two passes in a row without a delivery means
+    // the whole store has been seen and nothing is left to send
+    if (m_visitor.delivered () != delivered)
+        m_idle_passes = 0;
+    else if (++m_idle_passes >= 2)
+    {
+        m_dispatch_ready = false;
+        m_idle_passes = 0;
+    }
 }
 
 void pzq::manager_t::handle_monitor_in ()
@@ -164,8 +293,8 @@ void pzq::manager_t::handle_monitor_in ()
     pzq::message_t message;
     if (m_monitor.get ()->recv_many (message) > 0)
     {
-        std::string command (static_cast <char *>(message.back ().get ()->data ()),
-                             message.back ().get ()->size ());
+        std::string command;
+        message.back (command);
 
         if (!command.compare ("MONITOR"))
         {
@@ -173,15 +302,81 @@ void pzq::manager_t::handle_monitor_in ()
             datas << "messages: "           << m_store.get ()->messages ()             << std::endl;
             datas << "messages_inflight: "  << m_store.get ()->messages_inflight ()    << std::endl;
             datas << "db_size: "            << m_store.get ()->db_size ()              << std::endl;
+            datas << "replicas: "           << m_store.get ()->replicas ()             << std::endl;
+            datas << "replica_db_size: "    << m_store.get ()->replica_db_size ()      << std::endl;
             datas << "inflight_db_size: "   << m_store.get ()->inflight_db_size ()     << std::endl;
             datas << "syncs: "              << m_store.get ()->num_syncs ()            << std::endl;
             datas << "expired_messages: "   << m_store.get ()->get_messages_expired () << std::endl;
+            datas << "takeovers: "          << m_shard->get (pzq::metric_takeovers)    << std::endl;
+            datas << "takeover_latency: "   << m_takeover_latency                      << std::endl;
+            datas << "nodes_live: "         << m_cluster->countActiveNodes ()          << std::endl;
+            datas << "membership_changes: " << m_cluster->membershipChanges ()         << std::endl;
+            datas << "partitions_owned: "   << m_cluster->ownedPartitions ()           << std::endl;
+            datas << "redirects: "          << m_shard->get (pzq::metric_redirects)    << std::endl;
+            datas << "touches: "            << m_shard->get (pzq::metric_touches)      << std::endl;
+            datas << "ack_timeout: "        << m_store.get ()->get_ack_timeout ()      << std::endl;
+            datas << "ack_latency: "        << m_store.get ()->ack_latency ()          << std::endl;
+            datas << "duplicates: "         << m_shard->get (pzq::metric_duplicates)   << std::endl;
+            datas << "cluster_backlog: "    << m_cluster->backlog ()                   << std::endl;
+            datas << "cluster_dropped: "    << m_cluster->droppedSends ()              << std::endl;
+            datas << "remove_gaps: "        << m_cluster->removeGaps ()                << std::endl;
+            datas << "bootstraps: "         << m_cluster->activeBootstraps ()          << std::endl;
+            datas << "bootstrap_records: "  << m_cluster->bootstrapped ()              << std::endl;
+
+            pzq::message_t reply;
+            reply.append (message.front ());
+            reply.append ();
+            reply.append (datas.str ());
+
+            m_monitor.get ()->send_many (reply, 0);
+        }
+        else if (!command.compare ("METRICS") || !command.compare ("METRICS JSON"))
+        {
+            bool json = (command.size () > 7);
+            boost::shared_ptr<const std::string> rendered;
+
+            if (m_metrics_reader)
+                rendered = m_metrics_reader->latest (json);
+            else
+            {
+                // No reader thread, as in the benchmarks
+                uint64_t values [pzq::metric_count];
+                std::ostringstream datas;
+
+                publish_metrics ();
+                m_store->metrics ()->snapshot (values);
+                if (json)
+                    pzq::metrics_t::write_json (datas, values);
+                else
+                    pzq::metrics_t::write_prometheus (datas, values);
+                rendered.reset (new std::string (datas.str ()));
+            }
 
             pzq::message_t reply;
             reply.append (message.front ());
+            reply.append ();
+            reply.append (*rendered);
+
+            m_monitor.get ()->send_many (reply, 0);
+        }
+        else if (!command.compare ("MEMBERS") || !command.compare ("PARTITIONS") || !command.compare ("LATENCY") ||
+                 !command.compare ("TRACE") || !command.compare ("LOOP"))
+        {
+            std::stringstream datas;
+            if (!command.compare ("MEMBERS"))
+                m_cluster->describeMembers (datas);
+            else if (!command.compare ("PARTITIONS"))
+                m_cluster->describePartitions (datas);
+            else if (!command.compare ("TRACE"))
+                m_tracer->dump (datas);
+            else if (!command.compare ("LOOP"))
+                m_profile.print (datas, pzq::monotonic_timestamp ());
+            else
+                describe_latency (datas);
 
-            boost::shared_ptr<zmq::message_t> delimiter (new zmq::message_t);
-            reply.append (delimiter);
+            pzq::message_t reply;
+            reply.append (message.front ());
+            reply.append ();
             reply.append (datas.str ());
 
             m_monitor.get ()->send_many (reply, 0);
@@ -189,10 +384,162 @@ void pzq::manager_t::handle_monitor_in ()
     }
 }
 
+void pzq::manager_t::publish_metrics ()
+{
+    // Values owned by the store and the cluster, sampled here so the
+    // reader thread never touches them
+    m_shard->set (pzq::metric_messages, m_store->messages ());
+    m_shard->set (pzq::metric_messages_inflight, m_store->messages_inflight ());
+    m_shard->set (pzq::metric_db_size, m_store->db_size ());
+    m_shard->set (pzq::metric_replicas, m_store->replicas ());
+    m_shard->set (pzq::metric_replica_db_size, m_store->replica_db_size ());
+    m_shard->set (pzq::metric_inflight_db_size, m_store->inflight_db_size ());
+    m_shard->set (pzq::metric_delivered, m_visitor.delivered ());
+    m_shard->set (pzq::metric_ack_timeout, m_store->get_ack_timeout ());
+    m_shard->set (pzq::metric_ack_latency, m_store->ack_latency ());
+    m_shard->set (pzq::metric_nodes_live, m_cluster->countActiveNodes ());
+    m_shard->set (pzq::metric_membership_changes, m_cluster->membershipChanges ());
+    m_shard->set (pzq::metric_partitions_owned, m_cluster->ownedPartitions ());
+    m_shard->set (pzq::metric_cluster_backlog, m_cluster->backlog ());
+    m_shard->set (pzq::metric_cluster_dropped, m_cluster->droppedSends ());
+    m_shard->set (pzq::metric_remove_gaps, m_cluster->removeGaps ());
+    m_shard->set (pzq::metric_bootstraps, m_cluster->activeBootstraps ());
+    m_shard->set (pzq::metric_bootstrap_records, m_cluster->bootstrapped ());
+
+    if (m_metrics_reader)
+        m_timers->schedule_after (m_metrics_timer, m_metrics_reader->interval ());
+}
+
+void pzq::manager_t::describe_latency (std::ostream &out)
+{
+    pzq::histogram_t *histograms [] = { &m_produce_latency, &m_visitor.dispatch_latency (),
+                                        &m_ack_latency, &m_cluster->replicationLatency () };
+    const char *names [] = { "produce_durable", "durable_dispatch", "dispatch_ack", "replication" };
+
+    // Every read starts a new interval
+    for (size_t i = 0; i < sizeof (names) / sizeof (names [0]); i++)
+    {
+        out << names [i] << ": ";
+        histograms [i]->print (out);
+        out << std::endl;
+        histograms [i]->reset ();
+    }
+
+    uint64_t oldest = m_store.get ()->oldest_message_time ();
+    uint64_t now = m_clock->wall ();
+    out << "oldest_message_age: " << ((oldest && now > oldest) ? now - oldest : 0) << std::endl;
+}
+
+void pzq::manager_t::handle_replication_timeout (pzq::message_t &ack, uint64_t ticket)
+{
+
+    // send ack with a message to inform that replication failed, 
+    // producer should decide between considering the message as sent or not
+    ack.append ("REPLICATION_FAILED");
+    send_producer_ack (ack, ticket);
+}
+
+void pzq::manager_t::send_producer_ack (pzq::message_t &ack, uint64_t ticket)
+{
+    if (ticket && m_dedup && ack.size () >= 4)
+    {
+        // [peer id][message id][status][""][status message], the same
+        // answer goes to the retries that came in meanwhile
+        std::string message;
+        if (ack.size () > 4)
+            ack.back (message);
+
+        m_dedup->complete (ticket, *static_cast<char *> (ack [2].data ()), message, m_dedup_waiters);
+
+        for (size_t i = 0; i < m_dedup_waiters.size (); i++)
+        {
+            pzq::message_t retry;
+            retry.append (m_dedup_waiters [i]);
+            for (size_t j = 1; j < ack.size (); j++)
+                retry.append_copy (ack [j]);
+            m_in->send_many (retry);
+        }
+    }
+    m_in->send_many (ack);
+}
+
+void pzq::manager_t::handle_node_timeout (const std::string &node)
+{
+    // Nothing to take over unless we hold replicas of the node
+    if (!m_store->held_digests ().count (node))
+        return;
+
+    for (std::vector<takeover_t>::iterator it = m_takeovers.begin (); it != m_takeovers.end (); it++)
+        if (it->owner == node)
+            return;
+
+    takeover_t takeover;
+    takeover.owner = node;
+    takeover.started = m_clock->now ();
+    takeover.delivered = false;
+    m_takeovers.push_back (takeover);
+
+    pzq::log ("Taking over the replicas of %s", node.c_str ());
+    dispatch_ready ();
+}
+
+void pzq::manager_t::handle_takeovers ()
+{
+    for (size_t i = 0; i < m_takeovers.size (); )
+    {
+        takeover_t &takeover = m_takeovers [i];
+
+        // The owner is back, or every replica of it has been consumed
+        if (!m_cluster->shouldSendReplica (takeover.owner) ||
+            !m_store->held_digests ().count (takeover.owner))
+        {
+            m_takeovers.erase (m_takeovers.begin () + i);
+            continue;
+        }
+
+        uint64_t delivered = m_visitor.delivered ();
+        bool full = false;
+
+        try {
+            m_store->iterate_replicas (takeover.owner, &m_visitor);
+        } catch (std::exception &e) {
+            full = true;
+        }
+
+        if (!takeover.delivered && m_visitor.delivered () != delivered)
+        {
+            takeover.delivered = true;
+            m_shard->add (pzq::metric_takeovers);
+            m_takeover_latency = m_clock->now () - takeover.started;
+            pzq::log ("First replica of %s delivered %llu us after the takeover",
+                      takeover.owner.c_str (), (unsigned long long) m_takeover_latency);
+        }
+
+        if (full)
+            throw std::runtime_error ("Reached maximum messages in flight limit");
+        i++;
+    }
+}
+
+void pzq::manager_t::handle_wakeup ()
+{
+    zmq::message_t msg;
+
+    // Signals carry no data, one pass covers any number of them
+    while (m_wakeup->recv (&msg, ZMQ_NOBLOCK))
+        ;
+
+    // The reaper only wakes us up when deliveries expired
+    m_store->back_off_ack_timeout ();
+    m_store->resetIterator ();
+    dispatch_ready ();
+}
+
 void pzq::manager_t::run ()
 {
     int rc;
-    zmq::pollitem_t items [5];
+    zmq::pollitem_t items [6];
+
     items [0].socket  = *m_in;
     items [0].fd      = 0;
     items [0].events  = ZMQ_POLLIN;
@@ -208,95 +555,116 @@ void pzq::manager_t::run ()
     items [2].events  = ZMQ_POLLIN;
     items [2].revents = 0;
    
-    items [3].socket  = *m_cluster->getOutSocket();
+    items [3].socket  = *m_cluster->getSubSocket();
     items [3].fd      = 0;
     items [3].events  = ZMQ_POLLIN;
     items [3].revents = 0;
-   
-    items [4].socket  = *m_cluster->getSubSocket();
+
+    items [4].socket  = *m_wakeup;
     items [4].fd      = 0;
     items [4].events  = ZMQ_POLLIN;
     items [4].revents = 0;
 
+    // Replica ACKs and other answers of the peers, via the cluster I/O thread
+    items [5].socket  = *m_cluster->getEventSocket ();
+    items [5].fd      = 0;
+    items [5].events  = ZMQ_POLLIN;
+    items [5].revents = 0;
+
+    // Every deadline of the loop lives in the timer service
+    m_waitingAcks->setExpiryHandler (m_timers, boost::bind (&manager_t::handle_replication_timeout, this, _1, _2));
+    m_cluster->setAckHandler (boost::bind (&manager_t::send_producer_ack, this, _1, _2));
+    m_cluster->setTimers (m_timers, boost::bind (&manager_t::handle_node_timeout, this, _1));
+    m_tracer->set_timers (m_timers);
+
+    m_metrics_timer = m_timers->create (boost::bind (&manager_t::publish_metrics, this));
+    if (m_metrics_reader)
+        m_timers->schedule (m_metrics_timer, m_clock->now ());
+
+    m_profile.reset (pzq::monotonic_timestamp ());
+
     while (is_running ())
     {
-        items [1].events = ((m_store.get ()->messages_pending ()) ? (ZMQ_POLLIN | ZMQ_POLLOUT) : ZMQ_POLLIN);
+        // Only ask for POLLOUT when there is something to send, otherwise
+        // the loop would spin on a writable consumer socket
+        if (m_dispatch_ready && !m_store.get ()->messages_pending ())
+            m_dispatch_ready = false;
+
+        items [1].events = (m_dispatch_ready ? (ZMQ_POLLIN | ZMQ_POLLOUT) : ZMQ_POLLIN);
+
+        // Timer callbacks of the last round and the check above
+        m_profile.mark (pzq::loop_timers, pzq::monotonic_timestamp ());
 
         try {
-            int pollTimeout = 50000/1000;
-            int ackDelay = m_waitingAcks->getDelayUntilNextAck();
-            int nextBroadcast = m_cluster->getDelayUntilNextBroadcast();
-            int nextNodeTimeout = m_cluster->getDelayUntilNextNodeTimeout();
-            pollTimeout = ackDelay < pollTimeout ? ackDelay : pollTimeout;
-            pollTimeout = nextBroadcast <  pollTimeout ? nextBroadcast : pollTimeout;
-            pollTimeout = nextNodeTimeout < pollTimeout ? nextNodeTimeout : pollTimeout;
-            pollTimeout = pollTimeout < 0 ? 0 : pollTimeout;
-            
-            rc = zmq::poll (&items [0], 5, pollTimeout );
+            // Sleep until I/O arrives or the next timer is due
+            rc = zmq::poll (&items [0], 6, m_timers->poll_timeout ());
         } catch (zmq::error_t &e) {
             pzq::log ("Poll interrupted");
             break;
         }
+
+        // Everything below runs against the same sample of the clock
+        m_clock->update ();
+        m_profile.mark (pzq::loop_poll, m_clock->now ());
         
         if (rc < 0)
             throw new std::runtime_error ("zmq::poll failed");
 
+        // Only the handlers that ran read the clock again
         if (items [0].revents & ZMQ_POLLIN)
         {
             // Message coming in from the left side
             handle_producer_in ();
+            m_profile.mark (pzq::loop_producer_in, pzq::monotonic_timestamp ());
         }
 
         if (items [1].revents & ZMQ_POLLIN)
         {
             // ACK coming in from right side
             handle_consumer_in ();
+            m_profile.mark (pzq::loop_consumer_in, pzq::monotonic_timestamp ());
         }
 
         if (items [1].revents & ZMQ_POLLOUT)
         {
             // Sending messages to right side
             handle_consumer_out ();
+            m_profile.mark (pzq::loop_consumer_out, pzq::monotonic_timestamp ());
         }
 
         if (items [2].revents & ZMQ_POLLIN)
         {
             // Monitoring request
             handle_monitor_in ();
+            m_profile.mark (pzq::loop_monitor, pzq::monotonic_timestamp ());
         }
        
         if (items [3].revents & ZMQ_POLLIN)
-        {
-            // ACK coming from other nodes for replicas
-            m_cluster->handleAck( m_in, m_waitingAcks );
-        }
-       
-        if (items [4].revents & ZMQ_POLLIN)
         {
             // Received message from other nodes on subscribe socket
             m_cluster->handleNodesMessage();
+            m_profile.mark (pzq::loop_cluster_sub, pzq::monotonic_timestamp ());
         }
-       
-        while( m_waitingAcks->getDelayUntilNextAck() < 0 )
-        {
-            // send ack with a message to inform that replication failed, 
-            // producer should decide between considering the message as sent or not
-            pzq::message_t ack = m_waitingAcks->pop();
-            ack.append( "REPLICATION_FAILED" );
-            m_in->send_many( ack );
-        }
-        
-        if( m_cluster->getDelayUntilNextBroadcast() < 0 )
+
+        if (items [4].revents & ZMQ_POLLIN)
         {
-            // broadcast a keepalive message to all nodes of the cluster
-            m_cluster->broadcastKeepAlive();
+            // Reaper expired in-flight messages
+            handle_wakeup ();
+            m_profile.mark (pzq::loop_wakeup, pzq::monotonic_timestamp ());
         }
-        
-        if( m_cluster->getDelayUntilNextNodeTimeout() < 0 )
+
+        if (items [5].revents & ZMQ_POLLIN)
         {
-            // if a node expires, we move store cursor to the beginning
-            m_cluster->setTimeoutState();
-            m_store->resetIterator();
+            // ACK coming from other nodes for replicas
+            m_cluster->handleEvents (m_in, m_waitingAcks);
+            m_profile.mark (pzq::loop_cluster_ack, pzq::monotonic_timestamp ());
         }
+       
+        // Replication timeouts, gossip and node timeouts
+        m_timers->run_expired ();
     }
+
+    // Let the other nodes take over our replicas without waiting, this
+    // also stops the cluster I/O thread
+    m_cluster->leave ();
 }
@@ -23,6 +23,12 @@
 #include "visitor.hpp"
 #include "cluster.hpp"
 #include "ackcache.hpp"
+#include "timer.hpp"
+#include "dedup.hpp"
+#include "histogram.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "profile.hpp"
 
 using namespace kyotocabinet;
 
@@ -34,31 +40,99 @@ namespace pzq {
         boost::shared_ptr<pzq::socket_t> m_in;
         boost::shared_ptr<pzq::socket_t> m_out;
         boost::shared_ptr<pzq::socket_t> m_monitor;
+        boost::shared_ptr<pzq::socket_t> m_wakeup;
         boost::shared_ptr<pzq::datastore_t> m_store;
         boost::shared_ptr<pzq::cluster_t > m_cluster;
         boost::shared_ptr<pzq::ackcache_t > m_waitingAcks;
+        boost::shared_ptr<pzq::clock_service_t> m_clock;
+        boost::shared_ptr<pzq::timer_service_t> m_timers;
         pzq::visitor_t m_visitor;
         uint64_t m_ack_timeout;
+
+        // Set when something dispatchable may have appeared, cleared
+        // after the cursor has gone round the store without sending
+        bool m_dispatch_ready;
+        int m_idle_passes;
         boost::mutex m_mutex;
 
+        // Owners that went silent, their replicas are dispatched from the
+        // owner index ahead of the main cursor until they come back
+        struct takeover_t
+        {
+            std::string owner;
+            uint64_t started;
+            bool delivered;
+        };
+        std::vector<takeover_t> m_takeovers;
+        uint64_t m_takeover_latency;
+
+        // Producer message ids recently stored with their final ACK,
+        // retries get the same ACK without storing them again
+        boost::shared_ptr<pzq::dedup_window_t> m_dedup;
+        std::vector<std::string> m_dedup_waiters;
+
+        // Counters of this thread, gauges are refreshed on a timer for
+        // the reader thread that answers METRICS
+        pzq::metric_shard_t *m_shard;
+        boost::shared_ptr<pzq::metrics_reader_t> m_metrics_reader;
+        pzq::timer_id_t m_metrics_timer;
+
+        // Shared with the visitor and the cluster, dumped by TRACE
+        boost::shared_ptr<pzq::tracer_t> m_tracer;
+
+        // Time spent per handler and in poll, reported and reset by LOOP
+        pzq::loop_profile_t m_profile;
+
+        // From picking a message up to it being stored, and from a
+        // delivery to its ACK. Reported and reset by LATENCY
+        pzq::histogram_t m_produce_latency;
+        pzq::histogram_t m_ack_latency;
+
         void handle_producer_in ();
 
         void handle_consumer_in ();
 
+        void handle_touch (pzq::message_t &parts);
+
         void handle_consumer_out ();
 
         void handle_monitor_in ();
 
-        bool send_ack (boost::shared_ptr<zmq::message_t> peer_id, boost::shared_ptr<zmq::message_t> ticket, const std::string &status);
+        void publish_metrics ();
+
+        void describe_latency (std::ostream &out);
+
+        void handle_replication_timeout (pzq::message_t &ack, uint64_t ticket);
+
+        void send_producer_ack (pzq::message_t &ack, uint64_t ticket);
+
+        void handle_node_timeout (const std::string &node);
+
+        void handle_takeovers ();
+
+        void handle_wakeup ();
+
+        void dispatch_ready ()
+        {
+            m_dispatch_ready = true;
+            m_idle_passes = 0;
+        }
 
     public:
-        void set_sockets (boost::shared_ptr<pzq::socket_t> in, boost::shared_ptr<pzq::socket_t> out, boost::shared_ptr<pzq::socket_t> monitor, boost::shared_ptr<pzq::cluster_t> cluster)
+        manager_t () : m_ack_timeout (5000000), m_dispatch_ready (true), m_idle_passes (0),
+                       m_takeover_latency (0), m_shard (NULL), m_tracer (new pzq::tracer_t),
+                       m_profile (pzq::monotonic_timestamp ())
+        {
+            m_visitor.set_tracer (m_tracer);
+        }
+
+        void set_sockets (boost::shared_ptr<pzq::socket_t> in, boost::shared_ptr<pzq::socket_t> out, boost::shared_ptr<pzq::socket_t> monitor)
         {
             m_mutex.lock ();
             m_in = in;
             m_out = out;
             m_monitor = monitor;
-            m_visitor.set_socket (m_out, cluster);
+            m_visitor.set_socket (m_out);
             m_mutex.unlock ();
         }
 
@@ -67,15 +141,54 @@ namespace pzq {
             m_ack_timeout = ack_timeout;
         }
 
+        void set_envelope (int envelope)
+        {
+            m_visitor.set_envelope (envelope);
+        }
+
+        // Remember the last size message ids from all producers, 0 turns it off
+        void set_dedup_window (size_t size)
+        {
+            if (size)
+                m_dedup.reset (new pzq::dedup_window_t (size));
+            else
+                m_dedup.reset ();
+        }
+
+        // Other threads push an empty frame here when they free up messages
+        void set_wakeup_socket (boost::shared_ptr<pzq::socket_t> wakeup)
+        {
+            m_wakeup = wakeup;
+        }
+
+        void set_timers (boost::shared_ptr<pzq::timer_service_t> timers)
+        {
+            m_timers = timers;
+        }
+
         void set_datastore (boost::shared_ptr<pzq::datastore_t> store)
         {
             m_store = store;
             m_visitor.set_datastore (store);
+            m_shard = store->metrics ()->shard ();
         }
        
+        void set_clock (boost::shared_ptr<pzq::clock_service_t> clock)
+        {
+            m_clock = clock;
+            m_visitor.set_clock (clock);
+        }
+
         void set_cluster( boost::shared_ptr< pzq::cluster_t > cluster )
         {
             m_cluster = cluster;
+            m_cluster->setTracer( m_tracer );
+        }
+
+        // Trace one in every sample messages, 0 traces only those asking for it
+        void set_trace_sample (uint32_t sample)
+        {
+            m_tracer->set_sample (sample);
         }
        
         void set_ack_cache( boost::shared_ptr< pzq::ackcache_t > ackCache )
@@ -83,6 +196,12 @@ namespace pzq {
             m_waitingAcks = ackCache;
         }
 
+        // Answers METRICS, reading the registry of the datastore
+        void set_metrics_reader (boost::shared_ptr<pzq::metrics_reader_t> reader)
+        {
+            m_metrics_reader = reader;
+        }
+
         void run ();
     };
 }
@@ -0,0 +1,147 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "metrics.hpp"
+
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+    struct metric_info_t
+    {
+        const char *name;
+        const char *help;
+        bool counter;
+    };
+
+    // In the order of pzq::metric_t
+    const metric_info_t metric_info [] = {
+        { "messages",           "Messages in the store",                                   false },
+        { "messages_inflight",  "Messages delivered and waiting for an ACK",               false },
+        { "db_size",            "Size of the store in bytes",                              false },
+        { "replicas",           "Replicas of messages of other nodes",                     false },
+        { "replica_db_size",    "Size of the replica database in bytes",                   false },
+        { "inflight_db_size",   "Size of the in-flight database in bytes",                 false },
+        { "syncs",              "Synchronizations of the databases",                       true  },
+        { "expired_messages",   "Deliveries that passed their deadline without an ACK",    true  },
+        { "delivered",          "Messages handed to consumers",                            true  },
+        { "takeovers",          "Nodes whose replicas this node started to deliver",       true  },
+        { "redirects",          "Messages answered with the primary of their partition",   true  },
+        { "touches",            "Deliveries whose deadline a consumer pushed back",        true  },
+        { "duplicates",         "Producer retries answered without storing them again",    true  },
+        { "ack_timeout",        "ACK timeout of deliveries without a lease (microseconds)", false },
+        { "ack_latency",        "Smoothed time from a delivery to its ACK (microseconds)", false },
+        { "nodes_live",         "Live nodes in the cluster",                               false },
+        { "membership_changes", "Nodes that joined or left",                               true  },
+        { "partitions_owned",   "Partitions this node is the primary of",                  false },
+        { "cluster_backlog",    "Bytes waiting to be sent to other nodes",                 false },
+        { "cluster_dropped",    "Messages to other nodes dropped on a full buffer",        true  },
+        { "remove_gaps",        "Removal frames missed from other nodes",                  true  },
+        { "bootstraps",         "Nodes being sent a snapshot",                             false },
+        { "bootstrap_records",  "Records sent to nodes catching up",                       true  },
+    };
+
+    // A missing or extra entry in the table fails to compile
+    typedef char metric_table_check [sizeof (metric_info) / sizeof (metric_info [0]) == pzq::metric_count ? 1 : -1];
+}
+
+pzq::metric_shard_t *pzq::metrics_t::shard ()
+{
+    size_t index = __sync_fetch_and_add (&m_used, 1);
+    if (index >= max_shards)
+        throw std::runtime_error ("No metric shards left");
+
+    return &m_shards [index];
+}
+
+uint64_t pzq::metrics_t::value (metric_t metric) const
+{
+    size_t used = (m_used < max_shards) ? m_used : max_shards;
+    uint64_t value = 0;
+
+    for (size_t i = 0; i < used; i++)
+        value += m_shards [i].get (metric);
+    return value;
+}
+
+void pzq::metrics_t::snapshot (uint64_t *values) const
+{
+    for (int i = 0; i < metric_count; i++)
+        values [i] = value ((metric_t) i);
+}
+
+const char *pzq::metrics_t::name (metric_t metric)
+{
+    return metric_info [metric].name;
+}
+
+void pzq::metrics_t::write_prometheus (std::ostream &out, const uint64_t *values)
+{
+    for (int i = 0; i < metric_count; i++)
+    {
+        const metric_info_t &info = metric_info [i];
+        const char *suffix = info.counter ? "_total" : "";
+
+        out << "# HELP pzq_" << info.name << suffix << " " << info.help << "\n";
+        out << "# TYPE pzq_" << info.name << suffix << " " << (info.counter ? "counter" : "gauge") << "\n";
+        out << "pzq_" << info.name << suffix << " " << values [i] << "\n";
+    }
+}
+
+void pzq::metrics_t::write_json (std::ostream &out, const uint64_t *values)
+{
+    out << "{";
+    for (int i = 0; i < metric_count; i++)
+        out << (i ? "," : "") << "\"" << metric_info [i].name << "\":" << values [i];
+    out << "}\n";
+}
+
+void pzq::metrics_reader_t::refresh ()
+{
+    uint64_t values [metric_count];
+    m_metrics->snapshot (values);
+
+    std::ostringstream text, json;
+    pzq::metrics_t::write_prometheus (text, values);
+    pzq::metrics_t::write_json (json, values);
+
+    boost::shared_ptr<const std::string> rendered_text (new std::string (text.str ()));
+    boost::shared_ptr<const std::string> rendered_json (new std::string (json.str ()));
+
+    // Only the pointers change hands under the lock
+    m_lock.lock ();
+    m_text.swap (rendered_text);
+    m_json.swap (rendered_json);
+    m_lock.unlock ();
+}
+
+boost::shared_ptr<const std::string> pzq::metrics_reader_t::latest (bool json)
+{
+    m_lock.lock ();
+    boost::shared_ptr<const std::string> rendered = json ? m_json : m_text;
+    m_lock.unlock ();
+    return rendered;
+}
+
+void pzq::metrics_reader_t::run ()
+{
+    while (is_running ())
+    {
+        refresh ();
+        boost::this_thread::sleep (boost::posix_time::microseconds (m_interval));
+    }
+}
@@ -0,0 +1,172 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_METRICS_HPP
+# define PZQ_METRICS_HPP
+
+#include "pzq.hpp"
+#include "thread.hpp"
+
+#include <ostream>
+#include <string>
+#include <stdint.h>
+
+namespace pzq {
+
+    // Names and help texts live in metrics.cpp, in the same order
+    enum metric_t
+    {
+        metric_messages,
+        metric_messages_inflight,
+        metric_db_size,
+        metric_replicas,
+        metric_replica_db_size,
+        metric_inflight_db_size,
+        metric_syncs,
+        metric_expired_messages,
+        metric_delivered,
+        metric_takeovers,
+        metric_redirects,
+        metric_touches,
+        metric_duplicates,
+        metric_ack_timeout,
+        metric_ack_latency,
+        metric_nodes_live,
+        metric_membership_changes,
+        metric_partitions_owned,
+        metric_cluster_backlog,
+        metric_cluster_dropped,
+        metric_remove_gaps,
+        metric_bootstraps,
+        metric_bootstrap_records,
+        metric_count
+    };
+
+    /*
+      The values of every metric as written by one thread. Only that
+      thread writes them, so an update is a plain add or store, other
+      threads read without a lock. 64 bit values are read whole on 64 bit
+      platforms. A counter only grows, a gauge holds the last value set.
+    */
+    class metric_shard_t
+    {
+    private:
+        volatile uint64_t m_values [metric_count];
+
+        // Keeps the next shard off the last cache line
+        char m_pad [64];
+
+    public:
+        metric_shard_t ()
+        {
+            for (int i = 0; i < metric_count; i++)
+                m_values [i] = 0;
+        }
+
+        void add (metric_t metric, uint64_t n = 1)
+        {
+            m_values [metric] = m_values [metric] + n;
+        }
+
+        void set (metric_t metric, uint64_t value)
+        {
+            m_values [metric] = value;
+        }
+
+        uint64_t get (metric_t metric) const
+        {
+            return m_values [metric];
+        }
+    };
+
+    /*
+      Registry of the metrics of the process. Every thread that updates
+      metrics takes a shard of its own, a value is the sum over the
+      shards. Shards can be taken at any time, they are never given back.
+    */
+    class metrics_t
+    {
+    private:
+        enum { max_shards = 16 };
+
+        metric_shard_t m_shards [max_shards];
+        volatile size_t m_used;
+
+        metrics_t (const metrics_t &);
+        metrics_t &operator= (const metrics_t &);
+
+    public:
+        metrics_t () : m_used (0)
+        {}
+
+        // A shard for the calling thread to write to
+        metric_shard_t *shard ();
+
+        uint64_t value (metric_t metric) const;
+
+        // Fills values [metric_count]
+        void snapshot (uint64_t *values) const;
+
+        static const char *name (metric_t metric);
+
+        // Prometheus text exposition format, pzq_ prefixed
+        static void write_prometheus (std::ostream &out, const uint64_t *values);
+
+        // One object, keyed by the names used by MONITOR
+        static void write_json (std::ostream &out, const uint64_t *values);
+    };
+
+    /*
+      Takes a snapshot of the registry every interval and renders it in
+      both formats. The manager answers METRICS with the latest rendering,
+      so a scrape costs the manager loop a pointer copy and a send.
+    */
+    class metrics_reader_t : public thread_t
+    {
+    private:
+        boost::shared_ptr<pzq::metrics_t> m_metrics;
+        uint64_t m_interval;
+
+        boost::mutex m_lock;
+        boost::shared_ptr<const std::string> m_text;
+        boost::shared_ptr<const std::string> m_json;
+
+    public:
+        metrics_reader_t (boost::shared_ptr<pzq::metrics_t> metrics) : m_metrics (metrics), m_interval (1000000)
+        {
+            refresh ();
+        }
+
+        void set_interval (uint64_t interval)
+        {
+            m_interval = interval;
+        }
+
+        uint64_t interval () const
+        {
+            return m_interval;
+        }
+
+        void refresh ();
+
+        // The latest rendering, Prometheus text or JSON
+        boost::shared_ptr<const std::string> latest (bool json);
+
+        void run ();
+    };
+}
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_POOL_HPP
+# define PZQ_POOL_HPP
+
+#include <boost/thread/tss.hpp>
+#include <vector>
+#include <new>
+#include <stdint.h>
+
+namespace pzq {
+
+    /*
+      Per-thread slab allocator for the small, short-lived buffers of the
+      dispatch and ACK paths. Blocks come in power of two size classes
+      from 64 bytes to 4 kB and are carved out of 64 kB chunks. Freed
+      blocks go on the free list of the thread that frees them, chunks
+      are never handed back to the system.
+    */
+    class slab_pool_t
+    {
+    private:
+        enum {
+            min_shift   = 6,
+            classes     = 7,
+            chunk_size  = 65536
+        };
+
+        struct block_t
+        {
+            union {
+                block_t *next;
+                uint64_t size_class;
+            };
+        };
+
+        block_t *m_free [classes];
+        std::vector<char *> m_chunks;
+        char *m_cursor;
+        char *m_limit;
+
+        static int size_class (size_t size)
+        {
+            size_t block = size_t (1) << min_shift;
+            for (int c = 0; c < classes; c++, block <<= 1)
+                if (size + sizeof (block_t) <= block)
+                    return c;
+            return -1;
+        }
+
+        block_t *carve (int c)
+        {
+            size_t block = size_t (1) << (min_shift + c);
+
+            if (m_cursor + block > m_limit)
+            {
+                m_cursor = new char [chunk_size];
+                m_limit = m_cursor + chunk_size;
+                m_chunks.push_back (m_cursor);
+            }
+
+            block_t *b = reinterpret_cast<block_t *> (m_cursor);
+            m_cursor += block;
+            return b;
+        }
+
+        slab_pool_t () : m_cursor (0), m_limit (0)
+        {
+            for (int c = 0; c < classes; c++)
+                m_free [c] = 0;
+            m_chunks.reserve (64);
+        }
+
+        slab_pool_t (const slab_pool_t &);
+        slab_pool_t &operator= (const slab_pool_t &);
+
+        static void retain (slab_pool_t *pool)
+        {
+            // Blocks may still be sitting in other pools, keep the chunks
+        }
+
+    public:
+        static slab_pool_t &local ()
+        {
+            static boost::thread_specific_ptr<slab_pool_t> pools (&slab_pool_t::retain);
+
+            slab_pool_t *pool = pools.get ();
+            if (!pool)
+            {
+                pool = new slab_pool_t;
+                pools.reset (pool);
+            }
+            return *pool;
+        }
+
+        void *allocate (size_t size)
+        {
+            int c = size_class (size);
+            block_t *b;
+
+            if (c < 0)
+            {
+                b = static_cast<block_t *> (::operator new (size + sizeof (block_t)));
+                b->size_class = classes;
+            }
+            else
+            {
+                if (m_free [c])
+                {
+                    b = m_free [c];
+                    m_free [c] = b->next;
+                }
+                else
+                    b = carve (c);
+
+                b->size_class = c;
+            }
+            return b + 1;
+        }
+
+        void deallocate (void *p)
+        {
+            if (!p)
+                return;
+
+            block_t *b = static_cast<block_t *> (p) - 1;
+            int c = static_cast<int> (b->size_class);
+
+            if (c == classes)
+            {
+                ::operator delete (b);
+                return;
+            }
+            b->next = m_free [c];
+            m_free [c] = b;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "profile.hpp"
+
+#include <cstring>
+
+namespace
+{
+    const char *section_names [] = { "poll", "producer_in", "consumer_in", "consumer_out", "monitor",
+                                     "cluster_sub", "wakeup", "cluster_ack", "timers" };
+
+    // Hundredths of a percent of the interval
+    void share (std::ostream &out, uint64_t time, uint64_t interval)
+    {
+        uint64_t permyriad = interval ? time * 10000 / interval : 0;
+        out << permyriad / 100 << "." << (permyriad % 100 < 10 ? "0" : "") << permyriad % 100;
+    }
+}
+
+void pzq::loop_profile_t::reset (uint64_t now)
+{
+    memset (m_sections, 0, sizeof (m_sections));
+    m_iterations = 0;
+    m_started = now;
+    m_last = now;
+}
+
+void pzq::loop_profile_t::print (std::ostream &out, uint64_t now)
+{
+    uint64_t interval = (now > m_started) ? now - m_started : 0;
+    uint64_t busy = 0, stall = 0;
+    int stalled = loop_poll;
+
+    for (int i = loop_poll + 1; i < loop_sections; i++)
+    {
+        busy += m_sections [i].time;
+        if (m_sections [i].longest > stall)
+        {
+            stall = m_sections [i].longest;
+            stalled = i;
+        }
+    }
+
+    out << "interval: " << interval << "\n";
+    out << "iterations: " << m_iterations << "\n";
+    out << "iterations_per_second: " << (interval ? m_iterations * 1000000 / interval : 0) << "\n";
+    out << "busy: ";
+    share (out, busy, interval);
+    out << "\n";
+    out << "longest_stall: " << stall << " " << (stall ? section_names [stalled] : "none") << "\n";
+
+    for (int i = 0; i < loop_sections; i++)
+    {
+        const section_t &s = m_sections [i];
+
+        out << section_names [i] << ": calls=" << s.calls << " time=" << s.time << " share=";
+        share (out, s.time, interval);
+        out << " longest=" << s.longest << "\n";
+    }
+
+    reset (now);
+}
@@ -0,0 +1,94 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_PROFILE_HPP
+# define PZQ_PROFILE_HPP
+
+#include <ostream>
+#include <stdint.h>
+
+namespace pzq {
+
+    enum loop_section_t
+    {
+        loop_poll,
+        loop_producer_in,
+        loop_consumer_in,
+        loop_consumer_out,
+        loop_monitor,
+        loop_cluster_sub,
+        loop_wakeup,
+        loop_cluster_ack,
+        loop_timers,
+        loop_sections
+    };
+
+    /*
+      Where the time of an event loop goes. The loop marks the end of
+      every section it ran with the monotonic time, the time since the
+      previous mark is charged to that section, so a handler that did
+      not run costs nothing. Every print starts a new interval. Belongs
+      to the thread of the loop.
+    */
+    class loop_profile_t
+    {
+    private:
+        struct section_t
+        {
+            uint64_t time;
+            uint64_t calls;
+            uint64_t longest;
+        };
+
+        section_t m_sections [loop_sections];
+        uint64_t m_iterations;
+        uint64_t m_started;
+        uint64_t m_last;
+
+    public:
+        explicit loop_profile_t (uint64_t now)
+        {
+            reset (now);
+        }
+
+        void reset (uint64_t now);
+
+        void mark (loop_section_t section, uint64_t now)
+        {
+            section_t &s = m_sections [section];
+            uint64_t elapsed = (now > m_last) ? now - m_last : 0;
+
+            s.time += elapsed;
+            s.calls++;
+            if (elapsed > s.longest)
+                s.longest = elapsed;
+
+            if (section == loop_poll)
+                m_iterations++;
+            m_last = now;
+        }
+
+        uint64_t iterations () const
+        {
+            return m_iterations;
+        }
+
+        // Writes the interval up to now and starts the next one
+        void print (std::ostream &out, uint64_t now);
+    };
+}
+
+#endif
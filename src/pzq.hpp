@@ -28,89 +28,208 @@
 #include <uuid/uuid.h>
 #include <stdarg.h>
 
+#include "pool.hpp"
+
 namespace pzq 
 {
-    typedef boost::shared_ptr <zmq::message_t> message_part_t;
-
-    typedef std::list <pzq::message_part_t>::iterator message_iterator_t;
-    typedef std::list <pzq::message_part_t>::const_iterator message_const_iterator_t;
+    typedef zmq::message_t *message_iterator_t;
+    typedef const zmq::message_t *message_const_iterator_t;
 
+    /*
+      Multipart message. The parts live in a small inline array so that
+      the common envelope + body case never touches the heap. Frames are
+      handed over with zmq_msg_move rather than copied, and only messages
+      with more than inline_parts parts spill over into an array taken
+      from the thread's slab pool.
+    */
     class message_t 
     {
-    private:   
-        boost::shared_ptr <std::list <pzq::message_part_t> > m_message;
-
     public:
-        message_iterator_t begin () { return (*m_message).begin (); }
-        message_const_iterator_t end () { return (*m_message).end (); }
+        enum { inline_parts = 8 };
+
+    private:
+        zmq::message_t m_inline [inline_parts];
+        zmq::message_t *m_parts;
+        size_t m_capacity;
+        size_t m_head;
+        size_t m_size;
+
+        // Make room for one more part at the tail
+        void grow ()
+        {
+            if (m_head + m_size < m_capacity)
+                return;
+
+            if (m_head > 0)
+            {
+                // Slide the live parts down instead of reallocating
+                for (size_t i = 0; i < m_size; i++)
+                    m_parts [i].move (&m_parts [m_head + i]);
+                m_head = 0;
+                return;
+            }
+
+            size_t capacity = m_capacity * 2;
+            zmq::message_t *parts = static_cast<zmq::message_t *> (
+                    pzq::slab_pool_t::local ().allocate (capacity * sizeof (zmq::message_t)));
+
+            for (size_t i = 0; i < capacity; i++)
+                new (&parts [i]) zmq::message_t;
+
+            for (size_t i = 0; i < m_size; i++)
+                parts [i].move (&m_parts [i]);
+
+            release ();
+
+            m_parts = parts;
+            m_capacity = capacity;
+        }
+
+        void release ()
+        {
+            if (m_parts == m_inline)
+                return;
+
+            for (size_t i = 0; i < m_capacity; i++)
+                m_parts [i].~message_t ();
 
-        message_t () : m_message (new std::list <pzq::message_part_t>)
+            pzq::slab_pool_t::local ().deallocate (m_parts);
+        }
+
+        zmq::message_t &push ()
+        {
+            grow ();
+            return m_parts [m_head + m_size++];
+        }
+
+        void copy_from (const message_t &other)
+        {
+            for (size_t i = 0; i < other.m_size; i++)
+                push ().copy (const_cast <zmq::message_t *> (&other.m_parts [other.m_head + i]));
+        }
+
+    public:
+        message_t () : m_parts (m_inline), m_capacity (inline_parts), m_head (0), m_size (0)
         {}
 
-        void append (message_part_t part)
+        // Copies share the frame contents through zmq_msg_copy
+        message_t (const message_t &other) : m_parts (m_inline), m_capacity (inline_parts), m_head (0), m_size (0)
         {
-            (*m_message).push_back (part);
+            copy_from (other);
         }
 
-        void append (const void *data, size_t size)
+        message_t &operator= (const message_t &other)
         {
-            message_part_t part (new zmq::message_t (size));
-            memcpy (part.get ()->data (), data, size);
-            (*m_message).push_back (part);
+            if (this != &other)
+            {
+                clear ();
+                copy_from (other);
+            }
+            return *this;
         }
 
-        void append (const std::string &str)
+        ~message_t ()
+        {
+            release ();
+        }
+
+        message_iterator_t begin () { return m_parts + m_head; }
+        message_iterator_t end () { return m_parts + m_head + m_size; }
+
+        message_const_iterator_t begin () const { return m_parts + m_head; }
+        message_const_iterator_t end () const { return m_parts + m_head + m_size; }
+
+        zmq::message_t &operator[] (size_t i)
         {
-            message_part_t part (new zmq::message_t (str.size ()));
-            memcpy (part.get ()->data (), str.data (), str.size ());
-            (*m_message).push_back (part);
+            return m_parts [m_head + i];
         }
 
+        // Appends an empty part and returns it, recv can write into it directly
+        zmq::message_t &append ()
+        {
+            return push ();
+        }
+
+        // Takes over the contents of msg, leaving it empty
         void append (zmq::message_t &msg)
         {
-            message_part_t part (new zmq::message_t);
-            part.get ()->copy (&msg);
-            (*m_message).push_back (part);
+            push ().move (&msg);
+        }
+
+        void append_copy (zmq::message_t &msg)
+        {
+            push ().copy (&msg);
+        }
+
+        void append (const void *data, size_t size)
+        {
+            zmq::message_t &part = push ();
+            part.rebuild (size);
+            memcpy (part.data (), data, size);
+        }
+
+        void append (const std::string &str)
+        {
+            append (str.data (), str.size ());
         }
 
-        void append ()
+        // Replaces the contents with the parts of src, leaving src empty
+        void move (message_t &src)
         {
-            message_part_t part (new zmq::message_t);
-            (*m_message).push_back (part);
+            clear ();
+            for (message_iterator_t it = src.begin (); it != src.end (); it++)
+                append (*it);
+            src.clear ();
         }
 
-        message_part_t front ()
+        zmq::message_t &front ()
         {
-            return (*m_message).front ();
+            return m_parts [m_head];
         }
 
         void front (std::string &str)
         {
-            str.assign (static_cast <char *> ((*(*m_message).front ()).data ()),
-                        (*(*m_message).front ()).size ());
+            str.assign (static_cast <char *> (front ().data ()), front ().size ());
         }
 
-        message_part_t back ()
+        zmq::message_t &back ()
         {
-            return (*m_message).back ();
+            return m_parts [m_head + m_size - 1];
         }
 
         void back (std::string &str)
         {
-            str.assign (static_cast <char *> ((*(*m_message).back ()).data ()),
-                        (*(*m_message).back ()).size ());
+            str.assign (static_cast <char *> (back ().data ()), back ().size ());
         }
 
-        message_part_t pop_front ()
+        void pop_front ()
         {
-            message_part_t part = (*m_message).front ();
-            (*m_message).pop_front ();
-            return part;
+            m_parts [m_head].rebuild ();
+            m_head++;
+
+            if (--m_size == 0)
+                m_head = 0;
         }
 
-        size_t size ()
+        void pop_back ()
         {
-            return (*m_message).size ();
+            m_parts [m_head + m_size - 1].rebuild ();
+
+            if (--m_size == 0)
+                m_head = 0;
+        }
+
+        void clear ()
+        {
+            for (size_t i = 0; i < m_size; i++)
+                m_parts [m_head + i].rebuild ();
+            m_head = 0;
+            m_size = 0;
+        }
+
+        size_t size () const
+        {
+            return m_size;
         }
     };
 
@@ -134,6 +253,35 @@ namespace pzq
         
         std::cerr << "[" << date << "] - " << buffer << std::endl;
     }
+
+    const uint64_t hash64_seed = 14695981039346656037ULL;
+
+    /*
+      FNV-1a, carrying on from seed so that several buffers hash as one.
+      With mix the MurmurHash3 finalizer spreads the bits over the whole
+      word, for hashes cut into a bucket and a fingerprint or taken of
+      short, similar strings. Nodes and producers compare these values,
+      they must not change.
+    */
+    inline uint64_t hash64 (const char *data, size_t size, bool mix = false, uint64_t seed = hash64_seed)
+    {
+        uint64_t h = seed;
+        for (size_t i = 0; i < size; i++)
+        {
+            h ^= (unsigned char) data [i];
+            h *= 1099511628211ULL;
+        }
+
+        if (mix)
+        {
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+        }
+        return h;
+    }
 };
 
 #endif
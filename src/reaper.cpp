@@ -21,23 +21,34 @@ void pzq::expiry_reaper_t::run ()
 {
     while (is_running ())
     {
-        m_time = microsecond_timestamp ();
+        m_clock.update ();
+        m_expired = 0;
         m_store.get ()->iterate_inflight (this);
+
+        if (m_expired > 0 && m_wakeup)
+        {
+            // Tell the manager straight away instead of waiting for it to notice.
+            // A full pipe means a signal is already pending
+            zmq::message_t signal;
+            m_wakeup->send (signal, ZMQ_NOBLOCK);
+        }
         boost::this_thread::sleep (boost::posix_time::microseconds (m_frequency));
     }
 }
 
 const char *pzq::expiry_reaper_t::visit_full (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, size_t *sp)
 {
-    if (sizeof (uint64_t) != vsiz)
+    if (vsiz < sizeof (uint64_t))
         return Visitor::NOP;
 
     uint64_t value;
     memcpy (&value, vbuf, sizeof (uint64_t));
 
-    if (m_time - value > m_timeout)
+    // Entries start with their deadline
+    if (m_clock.now () > value)
     {
-        m_store.get ()->message_expired ();
+        m_shard->add (pzq::metric_expired_messages);
+        m_expired++;
         return Visitor::REMOVE;
     }
     return Visitor::NOP;
@@ -22,6 +22,7 @@
 #include "socket.hpp"
 #include "time.hpp"
 #include "thread.hpp"
+#include "metrics.hpp"
 
 using namespace kyotocabinet;
 
@@ -30,24 +31,29 @@ namespace pzq
     class expiry_reaper_t : public DB::Visitor, public thread_t
     {
     private:
-        uint64_t m_time;
-        uint64_t m_timeout;
+        pzq::clock_service_t m_clock;
         uint64_t m_frequency;
         boost::shared_ptr<pzq::datastore_t> m_store;
+        boost::shared_ptr<pzq::socket_t> m_wakeup;
         bool m_has_expires;
+        uint64_t m_expired;
+        pzq::metric_shard_t *m_shard;
 
     public:
-        expiry_reaper_t (boost::shared_ptr<pzq::datastore_t> store) : m_timeout (5000000), m_frequency (2500000), m_store (store), m_has_expires (false)
-        {}
+        expiry_reaper_t (boost::shared_ptr<pzq::datastore_t> store) : m_frequency (2500000), m_store (store), m_has_expires (false), m_expired (0)
+        {
+            m_shard = store->metrics ()->shard ();
+        }
 
         void set_frequency (uint64_t frequency)
         {
             m_frequency = frequency;
         }
 
-        void set_ack_timeout (uint64_t timeout)
+        // Signalled after a pass that expired messages, owned by this thread
+        void set_wakeup_socket (boost::shared_ptr<pzq::socket_t> wakeup)
         {
-            m_timeout = timeout;
+            m_wakeup = wakeup;
         }
 
         void run ();
@@ -0,0 +1,119 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_RING_HPP
+# define PZQ_RING_HPP
+
+#include "pzq.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <stdint.h>
+
+namespace pzq {
+
+    /*
+      Consistent hash ring over a fixed number of partitions. Every node
+      gets vnodes points on the ring by the hash of its name, partition p
+      sits at p / partitions of the way round and belongs to the nodes on
+      the first points at or after it, primary first. Adding or removing
+      a node only moves the partitions next to its points, and every node
+      with the same member list computes the same owners.
+    */
+    class ring_t
+    {
+    private:
+        typedef std::pair<uint64_t, int> point_t;
+
+        int m_partitions;
+        std::vector<std::vector<int> > m_owners;
+
+    public:
+        ring_t () : m_partitions (0)
+        {}
+
+        // FNV alone leaves the high bits of short, similar names close
+        // together, mixed they spread round the ring
+        static uint64_t hash (const char *data, size_t size)
+        {
+            return pzq::hash64 (data, size, true);
+        }
+
+        // Partition of a message id, producers can compute it themselves
+        static int partition (const char *id, size_t size, int partitions)
+        {
+            return (int) (hash (id, size) % partitions);
+        }
+
+        /*
+          nodes are the names of the live nodes, the owners of a partition
+          are indexes into it. Each partition gets copies distinct nodes or
+          as many as there are.
+        */
+        void build (const std::vector<std::string> &nodes, int partitions, int vnodes, int copies)
+        {
+            std::vector<point_t> points;
+            points.reserve (nodes.size () * vnodes);
+
+            for (size_t n = 0; n < nodes.size (); n++)
+            {
+                for (int v = 0; v < vnodes; v++)
+                {
+                    char suffix [16];
+                    int len = snprintf (suffix, sizeof (suffix), "#%d", v);
+                    std::string point = nodes [n] + std::string (suffix, len);
+                    points.push_back (point_t (hash (point.data (), point.size ()), (int) n));
+                }
+            }
+            std::sort (points.begin (), points.end ());
+
+            m_partitions = partitions;
+            m_owners.assign (partitions, std::vector<int> ());
+
+            size_t wanted = std::min ((size_t) copies, nodes.size ());
+            uint64_t step = partitions ? (~uint64_t (0) / partitions) : 0;
+
+            for (int p = 0; p < partitions && !points.empty (); p++)
+            {
+                std::vector<int> &owners = m_owners [p];
+                size_t i = std::lower_bound (points.begin (), points.end (),
+                                             point_t (step * p, -1)) - points.begin ();
+
+                for (size_t seen = 0; owners.size () < wanted && seen < points.size (); seen++, i++)
+                {
+                    int node = points [i % points.size ()].second;
+                    if (std::find (owners.begin (), owners.end (), node) == owners.end ())
+                        owners.push_back (node);
+                }
+            }
+        }
+
+        int partitions () const
+        {
+            return m_partitions;
+        }
+
+        // Empty until built with at least one node
+        const std::vector<int> &owners (int partition) const
+        {
+            return m_owners [partition];
+        }
+    };
+}
+
+#endif
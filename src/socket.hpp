@@ -26,6 +26,7 @@ namespace pzq
         socket_t (zmq::context_t& ctx, int io_threads) : zmq::socket_t (ctx, io_threads)
         {}
 
+        // Sends and consumes the parts, on success parts is left empty
         bool send_many (pzq::message_t &parts, int flags)
         {
             pzq::message_iterator_t it;
@@ -39,9 +40,10 @@ namespace pzq
                     snd_flags = flags | ZMQ_SNDMORE;
                 }
                 // TODO: what happens if send fails in the middle of multi-part
-                if (send ((*(*it)), snd_flags) == false)
+                if (send ((*it), snd_flags) == false)
                     return false;
             }
+            parts.clear ();
             return true;
         }
 
@@ -50,6 +52,7 @@ namespace pzq
             return send_many (parts, 0);
         }
 
+        // Frames are received straight into the slots of parts, no copies
         int recv_many (pzq::message_t &parts, int flags)
         {
             int more;
@@ -57,11 +60,12 @@ namespace pzq
 
             int i = 0;
             do {
-                zmq::message_t msg;
-                if (recv (&msg, flags) == false)
+                if (recv (&parts.append (), flags) == false)
+                {
+                    parts.pop_back ();
                     return 0;
+                }
 
-                parts.append (msg);
                 getsockopt (ZMQ_RCVMORE, &more, &moresz);
                 ++i;
             } while (more);
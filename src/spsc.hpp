@@ -0,0 +1,96 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_SPSC_HPP
+# define PZQ_SPSC_HPP
+
+#include <vector>
+#include <cstddef>
+
+namespace pzq {
+
+    /*
+      Bounded queue between exactly one producer and one consumer thread,
+      without locks. The slots are allocated up front and reused, the
+      producer fills the slot it gets from reserve () in place and
+      publishes it with commit (), the consumer works on front () and
+      hands the slot back with pop (). Each index is written by one side
+      only, the barriers order the slot contents against them.
+    */
+    template <typename T>
+    class spsc_queue_t
+    {
+    private:
+        std::vector<T> m_slots;
+        size_t m_mask;
+
+        // Apart so the two sides do not share a cache line
+        volatile size_t m_head;
+        char m_pad [64];
+        volatile size_t m_tail;
+
+        spsc_queue_t (const spsc_queue_t &);
+        spsc_queue_t &operator= (const spsc_queue_t &);
+
+    public:
+        // capacity is rounded up to a power of two
+        explicit spsc_queue_t (size_t capacity) : m_head (0), m_tail (0)
+        {
+            size_t size = 1;
+            while (size < capacity)
+                size <<= 1;
+
+            m_slots.resize (size);
+            m_mask = size - 1;
+        }
+
+        // Producer: the next free slot, NULL when the queue is full
+        T *reserve ()
+        {
+            size_t tail = m_tail;
+            __sync_synchronize ();
+
+            if (tail - m_head > m_mask)
+                return NULL;
+            return &m_slots [tail & m_mask];
+        }
+
+        void commit ()
+        {
+            __sync_synchronize ();
+            m_tail = m_tail + 1;
+        }
+
+        // Consumer: the oldest slot, NULL when the queue is empty
+        T *front ()
+        {
+            size_t head = m_head;
+            if (head == m_tail)
+                return NULL;
+
+            __sync_synchronize ();
+            return &m_slots [head & m_mask];
+        }
+
+        void pop ()
+        {
+            __sync_synchronize ();
+            m_head = m_head + 1;
+        }
+    };
+}
+
+#endif
@@ -22,6 +22,200 @@
 #include <exception>
 #include <boost/scoped_array.hpp>
 
+namespace
+{
+    // Adds every record to the digests when the store is opened
+    class digest_loader_t : public DB::Visitor
+    {
+    private:
+        pzq::datastore_t &m_store;
+
+    public:
+        digest_loader_t (pzq::datastore_t &store) : m_store (store)
+        {}
+
+        const char *visit_full (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, size_t *sp)
+        {
+            m_store.track (kbuf, ksiz, vbuf, vsiz, true);
+            return NOP;
+        }
+    };
+
+    // Moves replicas saved before they had a database of their own. Those
+    // carry the owner in a "REPLICA:<owner>" first part
+    class replica_migrator_t : public DB::Visitor
+    {
+    private:
+        TreeDB &m_replicas;
+        size_t m_moved;
+
+    public:
+        replica_migrator_t (TreeDB &replicas) : m_replicas (replicas), m_moved (0)
+        {}
+
+        const char *visit_full (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, size_t *sp)
+        {
+            uint64_t size;
+
+            if (vsiz < sizeof (uint64_t))
+                return NOP;
+
+            memcpy (&size, vbuf, sizeof (uint64_t));
+            if ((size & pzq::record_header_flag) || size < 8 || sizeof (uint64_t) + size > vsiz ||
+                memcmp (vbuf + sizeof (uint64_t), "REPLICA:", 8))
+                return NOP;
+
+            uint64_t header [2] = { pzq::record_header_flag | pzq::record_header_replica | pzq::record_header_version, size - 8 };
+
+            std::string record ((const char *) header, sizeof (header));
+            record.append (vbuf + sizeof (uint64_t) + 8, size - 8);
+            record.append (vbuf + sizeof (uint64_t) + size, vsiz - sizeof (uint64_t) - size);
+
+            if (!m_replicas.set (kbuf, ksiz, record.data (), record.size ()))
+                throw pzq::datastore_exception (m_replicas);
+
+            m_moved++;
+            return REMOVE;
+        }
+
+        size_t moved () const
+        {
+            return m_moved;
+        }
+    };
+
+    // Adds a node to the placement mask of a local record
+    class placer_t : public DB::Visitor
+    {
+    private:
+        pzq::datastore_t &m_store;
+        uint64_t m_peer;
+        std::string m_record;
+        bool m_placed;
+
+    public:
+        placer_t (pzq::datastore_t &store, int peer)
+            : m_store (store), m_peer (uint64_t (1) << peer), m_placed (false)
+        {}
+
+        const char *visit_full (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, size_t *sp)
+        {
+            uint64_t peers;
+            size_t pos = pzq::record_offset (vbuf, vsiz, &peers);
+            uint64_t lease = pzq::record_lease (vbuf, vsiz);
+
+            uint64_t header [3] = { pzq::record_header_flag | pzq::record_header_version |
+                                    (lease ? pzq::record_header_lease : 0), peers | m_peer, lease };
+            m_record.assign ((const char *) header, (lease ? 3 : 2) * sizeof (uint64_t));
+            m_record.append (vbuf + pos, vsiz - pos);
+
+            m_store.track (kbuf, ksiz, vbuf, vsiz, false);
+            m_store.track (kbuf, ksiz, m_record.data (), m_record.size (), true);
+            m_placed = true;
+
+            *sp = m_record.size ();
+            return m_record.data ();
+        }
+
+        bool placed () const
+        {
+            return m_placed;
+        }
+    };
+
+    // Moves the deadline of an in-flight entry that is still there
+    class toucher_t : public DB::Visitor
+    {
+    private:
+        uint64_t m_value;
+        bool m_touched;
+
+    public:
+        toucher_t (uint64_t deadline) : m_value (deadline), m_touched (false)
+        {}
+
+        const char *visit_full (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, size_t *sp)
+        {
+            if (vsiz != sizeof (m_value))
+                return NOP;
+
+            m_touched = true;
+            *sp = sizeof (m_value);
+            return (const char *) &m_value;
+        }
+
+        bool touched () const
+        {
+            return m_touched;
+        }
+    };
+
+    // Removes a record, taking it out of the digests on the way. With
+    // owner set only replicas of that owner are removed
+    class remover_t : public DB::Visitor
+    {
+    private:
+        pzq::datastore_t &m_store;
+        const std::string *m_owner;
+        bool m_removed;
+
+    public:
+        remover_t (pzq::datastore_t &store, const std::string *owner = NULL)
+            : m_store (store), m_owner (owner), m_removed (false)
+        {}
+
+        const char *visit_full (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, size_t *sp)
+        {
+            std::string owner;
+            if (m_owner && (!pzq::record_owner (vbuf, vsiz, owner) || owner != *m_owner))
+                return NOP;
+
+            m_store.track (kbuf, ksiz, vbuf, vsiz, false);
+            m_removed = true;
+            return REMOVE;
+        }
+
+        bool removed ()
+        {
+            bool removed = m_removed;
+            m_removed = false;
+            return removed;
+        }
+    };
+
+    // Hands the record to a visitor in place, in the cursor's own
+    // buffers. An exception must not unwind through Kyoto Cabinet, it
+    // is kept here and thrown again once the cursor has returned
+    class in_place_t : public DB::Visitor
+    {
+    private:
+        DB::Visitor *m_visitor;
+        bool m_failed;
+        std::string m_error;
+
+    public:
+        in_place_t (DB::Visitor *visitor) : m_visitor (visitor), m_failed (false)
+        {}
+
+        const char *visit_full (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, size_t *sp)
+        {
+            try {
+                m_visitor->visit_full (kbuf, ksiz, vbuf, vsiz, sp);
+            } catch (std::exception &e) {
+                m_failed = true;
+                m_error = e.what ();
+            }
+            return NOP;
+        }
+
+        void rethrow () const
+        {
+            if (m_failed)
+                throw std::runtime_error (m_error);
+        }
+    };
+}
+
 void pzq::datastore_t::open (const std::string &path, int64_t inflight_size)
 {
     std::string p = path;
@@ -30,57 +224,97 @@ void pzq::datastore_t::open (const std::string &path, int64_t inflight_size)
     if (m_db.open (p, TreeDB::OWRITER | TreeDB::OCREATE) == false)
         throw pzq::datastore_exception (m_db);
     
-    pzq::log ("Loaded %lld messages from store", m_db.count ());
+    if (m_replica_page_cache > 0)
+        m_replica_db.tune_page_cache (m_replica_page_cache);
+
+    if (m_replica_db.open (p + ".replicas", TreeDB::OWRITER | TreeDB::OCREATE) == false)
+        throw pzq::datastore_exception (m_replica_db);
+
+    replica_migrator_t migrator (m_replica_db);
+    if (!m_db.iterate (&migrator, true))
+        throw pzq::datastore_exception (m_db);
+
+    if (migrator.moved ())
+        pzq::log ("Moved %lu replicas to %s.replicas", (unsigned long) migrator.moved (), p.c_str ());
+
+    pzq::log ("Loaded %lld messages and %lld replicas from store", m_db.count (), m_replica_db.count ());
+
+    if (!m_owner_index.open ("-", GrassDB::OWRITER | GrassDB::OCREATE))
+        throw pzq::datastore_exception (m_owner_index);
+
+    digest_loader_t loader (*this);
+    if (!m_db.iterate (&loader, false) || !m_replica_db.iterate (&loader, false))
+        throw pzq::datastore_exception (m_db);
     
     m_inflight_db.cap_size (inflight_size);
     
     p.append (".inflight");
     if (m_inflight_db.open (p, CacheDB::OWRITER | CacheDB::OCREATE) == false)
         throw pzq::datastore_exception (m_db);
+
+    m_attempts_db.cap_size (inflight_size);
+    if (m_attempts_db.open ("*", CacheDB::OWRITER | CacheDB::OCREATE) == false)
+        throw pzq::datastore_exception (m_attempts_db);
     
     // initialise cursor
     m_cursor.reset (m_db.cursor ());
     (*m_cursor).jump ();
 }
 
-bool pzq::datastore_t::save (pzq::message_t &parts, std::string extKey, std::string& storedKey)
+bool pzq::datastore_t::save (pzq::message_t &parts, std::string extKey, std::string& storedKey, uint64_t peers, uint64_t lease)
 {
     if (!parts.size ())
         throw std::runtime_error ("Trying to save empty message");
 
-    pzq::uuid_string_t uuid_str;
-    uuid_t uu;
+    // timestamp|uuid, 20 digits + separator + 36 chars of uuid
+    char kbuf [64];
+    const char *key = kbuf;
+    size_t ksiz;
 
-    uuid_generate (uu);
-    uuid_unparse (uu, uuid_str);
-
-    std::stringstream kval;
     if( extKey == "" )
     {
-        kval << pzq::microsecond_timestamp ();
-        kval << "|" << uuid_str;
+        pzq::uuid_string_t uuid_str;
+        uuid_t uu;
+
+        uuid_generate (uu);
+        uuid_unparse (uu, uuid_str);
+
+        // Keys are persisted so they carry wall time. The clock is sampled
+        // once per loop iteration, keep the keys strictly increasing
+        uint64_t key_time = (*m_clock).wall ();
+        if (key_time <= m_last_key_time)
+            key_time = m_last_key_time + 1;
+        m_last_key_time = key_time;
+
+        ksiz = snprintf (kbuf, sizeof (kbuf), "%llu|%s",
+                         (unsigned long long) key_time, uuid_str);
     }
     else
     {
-        kval << extKey;
-        printf("storing recplica: %s\n", kval.str().c_str());
+        key = extKey.c_str ();
+        ksiz = extKey.size ();
     }
 
     bool success = true;
 
     m_db.begin_transaction (m_hard_sync);
 
-    for (pzq::message_iterator_t it = parts.begin (); it != parts.end (); it++)
+    if (peers || lease)
+    {
+        uint64_t header [3] = { record_header_flag | record_header_version | (lease ? record_header_lease : 0),
+                                peers, lease };
+        success = m_db.append (key, ksiz, (const char *) header, (lease ? 3 : 2) * sizeof (uint64_t));
+    }
+
+    for (pzq::message_iterator_t it = parts.begin (); success && it != parts.end (); it++)
     {
-        uint64_t size = (*it).get ()->size ();
-        success = m_db.append (kval.str ().c_str (), kval.str ().size (),
-                               (const char *) &size, sizeof (uint64_t));
+        uint64_t size = (*it).size ();
+        success = m_db.append (key, ksiz, (const char *) &size, sizeof (uint64_t));
 
         if (!success)
             break;
 
-        success = m_db.append (kval.str ().c_str (), kval.str ().size (),
-                               (const char *) (*it).get ()->data (), (*it).get ()->size ());
+        success = m_db.append (key, ksiz, (const char *) (*it).data (), (*it).size ());
         if (!success)
             break;
     }
@@ -91,97 +325,231 @@ bool pzq::datastore_t::save (pzq::message_t &parts, std::string extKey, std::str
     if (!success)
         throw pzq::datastore_exception ("Failed to store the record");
    
-    storedKey = kval.str();
+    storedKey.assign (key, ksiz);
+
+    // Same bookkeeping as track () without reading the record back
+    for (int peer = 0; peers; peer++, peers >>= 1)
+        if (peers & 1)
+            m_placed [peer].add (key, ksiz);
 
     return true;
 }
 
+void pzq::datastore_t::save_replica (const std::string &owner, pzq::message_t &parts, const std::string &key,
+                                     uint64_t lease)
+{
+    if (!parts.size ())
+        throw std::runtime_error ("Trying to save empty message");
+
+    // Replicas arriving twice must not be appended to the first copy
+    if (m_replica_db.check (key.data (), key.size ()) >= 0)
+        return;
+
+    if (!m_in_batch)
+        m_replica_db.begin_transaction (m_replica_hard_sync);
+
+    uint64_t header [2] = { record_header_flag | record_header_replica | record_header_version |
+                            (lease ? record_header_lease : 0), owner.size () };
+    bool success = m_replica_db.append (key.data (), key.size (), (const char *) header, sizeof (header)) &&
+                   m_replica_db.append (key.data (), key.size (), owner.data (), owner.size ());
+
+    if (success && lease)
+        success = m_replica_db.append (key.data (), key.size (), (const char *) &lease, sizeof (uint64_t));
+
+    for (pzq::message_iterator_t it = parts.begin (); success && it != parts.end (); it++)
+    {
+        uint64_t size = (*it).size ();
+        success = m_replica_db.append (key.data (), key.size (), (const char *) &size, sizeof (uint64_t)) &&
+                  m_replica_db.append (key.data (), key.size (), (const char *) (*it).data (), (*it).size ());
+    }
+
+    if (!m_in_batch && !m_replica_db.end_transaction (success))
+        throw pzq::datastore_exception (m_replica_db);
+
+    if (!success)
+        throw pzq::datastore_exception ("Failed to store the replica");
+
+    if (m_in_batch)
+    {
+        m_batch_saved.push_back (std::make_pair (owner, key));
+        return;
+    }
+
+    m_held [owner].add (key.data (), key.size ());
+    index_replica (owner, key.data (), key.size (), true);
+}
+
+void pzq::datastore_t::begin_batch ()
+{
+    if (!m_replica_db.begin_transaction (m_replica_hard_sync))
+        throw pzq::datastore_exception (m_replica_db);
+
+    m_in_batch = true;
+    m_batch_saved.clear ();
+}
+
+void pzq::datastore_t::end_batch (bool commit)
+{
+    std::vector<std::pair<std::string, std::string> > saved;
+    saved.swap (m_batch_saved);
+    m_in_batch = false;
+
+    if (!m_replica_db.end_transaction (commit))
+        throw pzq::datastore_exception (m_replica_db);
+
+    if (!commit)
+        return;
+
+    for (std::vector<std::pair<std::string, std::string> >::const_iterator it = saved.begin (); it != saved.end (); it++)
+    {
+        m_held [it->first].add (it->second.data (), it->second.size ());
+        index_replica (it->first, it->second.data (), it->second.size (), true);
+    }
+}
+
 void pzq::datastore_t::sync ()
 {
     if (!m_db.synchronize (m_hard_sync))
         throw pzq::datastore_exception (m_db);
 
+    if (!m_replica_db.synchronize (m_replica_hard_sync))
+        throw pzq::datastore_exception (m_replica_db);
+
     if (!m_inflight_db.synchronize (m_hard_sync))
         throw pzq::datastore_exception (m_inflight_db);
 
-    m_syncs++;
+    m_shard->add (pzq::metric_syncs);
 }
 
 void pzq::datastore_t::remove (const std::string &k)
 {
-    if (!m_inflight_db.remove (k.c_str (), k.size ()))
+    remove (k.c_str (), k.size ());
+}
+
+void pzq::datastore_t::remove (const char *kbuf, size_t ksiz, pzq::histogram_t *latency)
+{
+    // [attempts][first sent]. An ACK after a redelivery is timed from
+    // the first delivery, longer than the consumer took if it is for a
+    // later one, so it can only push the timeout up. ACKs that come in
+    // after the deadline count too, a timeout that is too short grows.
+    uint64_t record [2];
+    if (m_attempts_db.get (kbuf, ksiz, (char *) record, sizeof (record)) == (int32_t) sizeof (record))
+    {
+        uint64_t now = (*m_clock).now ();
+        uint64_t elapsed = (now > record [1]) ? now - record [1] : 0;
+
+        m_ack_estimator.sample (elapsed);
+        if (latency && record [0] == 1)
+            latency->record (elapsed);
+    }
+
+    if (!m_inflight_db.remove (kbuf, ksiz))
         throw pzq::datastore_exception (m_inflight_db);
+
+    m_attempts_db.remove (kbuf, ksiz);
     
-    if (!m_db.remove (k))
+    // Replicas are delivered too while their owner is down
+    remover_t remover (*this);
+    if (!m_db.accept (kbuf, ksiz, &remover, true))
         throw pzq::datastore_exception (m_db);
+
+    if (!remover.removed () &&
+        (!m_replica_db.accept (kbuf, ksiz, &remover, true) || !remover.removed ()))
+        throw pzq::datastore_exception ("No such record");
 }
 
 void pzq::datastore_t::removeReplica( const std::string& k )
 {
-    if( !m_db.remove(k) )
-        throw pzq::datastore_exception( m_db );
+    remover_t remover (*this);
+    if( !m_replica_db.accept( k.data(), k.size(), &remover, true ) || !remover.removed() )
+        throw pzq::datastore_exception( m_replica_db );
 }
 
 bool pzq::datastore_t::check( const std::string& k )
 {
-    return m_db.check( k );
+    return m_db.check( k ) >= 0;
 }
 
 void pzq::datastore_t::remove_inflight (const std::string &k)
 {
-    if (!m_inflight_db.remove (k.c_str (), k.size ()))
+    remove_inflight (k.c_str (), k.size ());
+}
+
+void pzq::datastore_t::remove_inflight (const char *kbuf, size_t ksiz)
+{
+    if (!m_inflight_db.remove (kbuf, ksiz))
         throw pzq::datastore_exception (m_inflight_db);
 }
 
-bool pzq::datastore_t::is_in_flight (const std::string &k)
+bool pzq::datastore_t::is_in_flight (const char *kbuf, size_t ksiz)
 {
     uint64_t value;
-    if (m_inflight_db.get (k.c_str (), k.size (), (char *) &value, sizeof (uint64_t)) == -1)
+    if (m_inflight_db.get (kbuf, ksiz, (char *) &value, sizeof (uint64_t)) == -1)
     {
         return false;
     }
 
-    if (pzq::microsecond_timestamp () - value > m_ack_timeout)
+    if ((*m_clock).now () > value)
     {
-        m_inflight_db.remove (k.c_str (), k.size ());
+        m_inflight_db.remove (kbuf, ksiz);
         message_expired ();
+        back_off_ack_timeout ();
         return false;
     }
     return true;
 }
 
-void pzq::datastore_t::mark_in_flight (const std::string &k)
+void pzq::datastore_t::mark_in_flight (const char *kbuf, size_t ksiz, uint64_t lease, uint32_t attempt)
+{
+    uint64_t now = (*m_clock).now ();
+    uint64_t deadline = now + lease;
+    m_inflight_db.add (kbuf, ksiz, (const char *) &deadline, sizeof (deadline));
+
+    // The first delivery keeps its time
+    uint64_t record [2] = { attempt, now }, previous [2];
+    if (attempt > 1 && m_attempts_db.get (kbuf, ksiz, (char *) previous, sizeof (previous)) == (int32_t) sizeof (previous))
+        record [1] = previous [1];
+    m_attempts_db.set (kbuf, ksiz, (const char *) record, sizeof (record));
+}
+
+bool pzq::datastore_t::touch (const char *kbuf, size_t ksiz, uint64_t lease)
+{
+    // In one visit, the reaper may be expiring the entry at the same time
+    toucher_t toucher ((*m_clock).now () + lease);
+    if (!m_inflight_db.accept (kbuf, ksiz, &toucher, true))
+        throw pzq::datastore_exception (m_inflight_db);
+
+    return toucher.touched ();
+}
+
+uint32_t pzq::datastore_t::attempts (const char *kbuf, size_t ksiz)
 {
-    uint64_t value = pzq::microsecond_timestamp ();
-    m_inflight_db.add (k.c_str (), k.size (), (const char *) &value, sizeof (uint64_t));
+    // A count lost to the cap starts over, the consumer sees a first delivery
+    uint64_t record [2];
+    if (m_attempts_db.get (kbuf, ksiz, (char *) record, sizeof (record)) != (int32_t) sizeof (record))
+        return 0;
+    return (uint32_t) record [0];
 }
 
-void pzq::datastore_t::iterate (DB::Visitor *visitor)
+bool pzq::datastore_t::iterate (DB::Visitor *visitor)
 {
-    int expired = get_messages_expired ();
+    uint64_t expired = get_messages_expired ();
 
     while (true)
     {
-        size_t key_size, value_size;
-        const char *value;
+        // get () would copy the record into a buffer of its own
+        in_place_t in_place (visitor);
 
-        char *key = (*m_cursor).get (&key_size, &value, &value_size, true);
-
-        if (!key)
+        if (!(*m_cursor).accept (&in_place, false, true))
         {
+            // End of the store, start over on the next call
             (*m_cursor).jump ();
-            throw std::runtime_error ("Failed to fetch record from store");
-        }
-        try {
-            visitor->visit_full (key, key_size, value, value_size, NULL);
-            delete [] key;
-        } catch (std::exception &e) {
-            delete [] key;
-            throw e;
+            return true;
         }
+        in_place.rethrow ();
 
         // if messages expire we move the cursor to beginning
-        int current_expired = get_messages_expired ();
+        uint64_t current_expired = get_messages_expired ();
         if (expired != current_expired)
         {
             (*m_cursor).jump ();
@@ -193,6 +561,7 @@ void pzq::datastore_t::iterate (DB::Visitor *visitor)
     if (!m_db.iterate (visitor, false))
         throw pzq::datastore_exception (m_db);
 #endif
+    return false;
 }
 
 void pzq::datastore_t::iterate_inflight (DB::Visitor *visitor)
@@ -205,24 +574,229 @@ void pzq::datastore_t::iterate_inflight (DB::Visitor *visitor)
 
 bool pzq::datastore_t::messages_pending ()
 {
-    if (m_db.count () == 0) {
+    // Replicas count while their owner may be down
+    int64_t records = m_db.count () + m_replica_db.count ();
+
+    if (records == 0) {
         return false;
     }
 
-    if (m_inflight_db.count () == m_db.count ())
+    if (m_inflight_db.count () == records)
         return false;
 
     return true;
 }
 
+uint64_t pzq::datastore_t::oldest_message_time ()
+{
+    // Keys start with their creation time, the first one is the oldest
+    boost::scoped_ptr<TreeDB::Cursor> cursor (m_db.cursor ());
+    std::string key;
+
+    if (!cursor->jump () || !cursor->get_key (&key, false))
+        return 0;
+
+    return pzq::key_time (key.data (), key.size ());
+}
+
 pzq::datastore_t::~datastore_t ()
 {
-    pzq::log ("Closing down datastore, messages=[%lld] messages_inflight=[%lld]", m_db.count (), m_inflight_db.count ());
+    pzq::log ("Closing down datastore, messages=[%lld] replicas=[%lld] messages_inflight=[%lld]",
+              m_db.count (), m_replica_db.count (), m_inflight_db.count ());
+    m_owner_cursor.reset ();
+    m_owner_index.close ();
+    m_replica_db.close ();
     m_db.close ();
     m_inflight_db.close ();
+    m_attempts_db.close ();
 }
 
 void pzq::datastore_t::resetIterator()
 {
    m_cursor->jump();
 }
+
+void pzq::datastore_t::track (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, bool add)
+{
+    std::string owner;
+    uint64_t peers;
+
+    record_offset (vbuf, vsiz, &peers);
+
+    if (record_owner (vbuf, vsiz, owner))
+    {
+        if (add)
+            m_held [owner].add (kbuf, ksiz);
+        else
+        {
+            m_held [owner].remove (kbuf, ksiz);
+            if (m_held [owner].empty ())
+                m_held.erase (owner);
+        }
+        index_replica (owner, kbuf, ksiz, add);
+    }
+
+    for (int peer = 0; peers; peer++, peers >>= 1)
+    {
+        if (!(peers & 1))
+            continue;
+
+        if (add)
+            m_placed [peer].add (kbuf, ksiz);
+        else
+            m_placed [peer].remove (kbuf, ksiz);
+    }
+}
+
+void pzq::datastore_t::index_replica (const std::string &owner, const char *kbuf, size_t ksiz, bool add)
+{
+    std::string entry (owner);
+    entry.push_back ('\0');
+    entry.append (kbuf, ksiz);
+
+    if (add)
+        m_owner_index.set (entry.data (), entry.size (), "", 0);
+    else
+        m_owner_index.remove (entry.data (), entry.size ());
+}
+
+bool pzq::datastore_t::iterate_replicas (const std::string &owner, DB::Visitor *visitor)
+{
+    std::string prefix (owner);
+    prefix.push_back ('\0');
+
+    if (!m_owner_cursor)
+        m_owner_cursor.reset (m_owner_index.cursor ());
+
+    // Carry on where the last pass for the same owner stopped
+    if (prefix != m_owner_prefix)
+    {
+        m_owner_prefix = prefix;
+        (*m_owner_cursor).jump (prefix);
+    }
+
+    std::string entry;
+    while (true)
+    {
+        if (!(*m_owner_cursor).get_key (&entry, true) || entry.compare (0, prefix.size (), prefix))
+        {
+            // End of the owner's replicas, start over on the next call
+            (*m_owner_cursor).jump (prefix);
+            return true;
+        }
+
+        const char *kbuf = entry.data () + prefix.size ();
+        size_t ksiz = entry.size () - prefix.size (), vsiz;
+
+        char *value = m_replica_db.get (kbuf, ksiz, &vsiz);
+        if (!value)
+        {
+            // Never left by a batch, which indexes on commit only,
+            // but an index entry without its replica is dropped anyway
+            m_owner_index.remove (entry.data (), entry.size ());
+            continue;
+        }
+
+        try {
+            visitor->visit_full (kbuf, ksiz, value, vsiz, NULL);
+            delete [] value;
+        } catch (std::exception &e) {
+            delete [] value;
+            throw e;
+        }
+    }
+    return false;
+}
+
+void pzq::datastore_t::replica_keys (const std::string &owner, uint64_t bucket, std::vector<std::string> &keys)
+{
+    char start [24];
+    snprintf (start, sizeof (start), "%llu", (unsigned long long) (bucket * pzq::digest_set_t::bucket_width));
+
+    std::string prefix (owner);
+    prefix.push_back ('\0');
+
+    boost::scoped_ptr<GrassDB::Cursor> cursor (m_owner_index.cursor ());
+    if (!cursor->jump (prefix + start))
+        return;
+
+    // Keys start with the timestamp so the bucket is one contiguous range
+    std::string entry;
+    while (cursor->get_key (&entry, true) && !entry.compare (0, prefix.size (), prefix))
+    {
+        const char *kbuf = entry.data () + prefix.size ();
+        size_t ksiz = entry.size () - prefix.size ();
+
+        uint64_t b = pzq::digest_set_t::bucket (kbuf, ksiz);
+        if (b > bucket)
+            break;
+
+        if (b == bucket)
+            keys.push_back (std::string (kbuf, ksiz));
+    }
+}
+
+bool pzq::datastore_t::next_record (std::string &key, pzq::message_t &parts, uint64_t &peers, uint64_t &lease)
+{
+    boost::scoped_ptr<TreeDB::Cursor> cursor (m_db.cursor ());
+    std::string next, value;
+
+    if (!(key.empty () ? cursor->jump () : cursor->jump (key)) || !cursor->get (&next, &value, true))
+        return false;
+
+    // The cursor lands on the record returned last time if it is still there
+    if (next == key && !cursor->get (&next, &value, true))
+        return false;
+
+    key = next;
+
+    size_t pos = record_offset (value.data (), value.size (), &peers);
+    lease = record_lease (value.data (), value.size ());
+
+    while (pos + sizeof (uint64_t) <= value.size ())
+    {
+        uint64_t size;
+        memcpy (&size, value.data () + pos, sizeof (uint64_t));
+        pos += sizeof (uint64_t);
+
+        parts.append (value.data () + pos, size);
+        pos += size;
+    }
+    return true;
+}
+
+bool pzq::datastore_t::place (const std::string &key, int peer)
+{
+    placer_t placer (*this, peer);
+    if (!m_db.accept (key.data (), key.size (), &placer, true))
+        throw pzq::datastore_exception (m_db);
+
+    return placer.placed ();
+}
+
+size_t pzq::datastore_t::remove_replicas (const std::string &owner, const std::vector<std::string> &keys)
+{
+    return remove_replicas (keys, &owner);
+}
+
+size_t pzq::datastore_t::remove_replicas (const std::vector<std::string> &keys)
+{
+    return remove_replicas (keys, NULL);
+}
+
+size_t pzq::datastore_t::remove_replicas (const std::vector<std::string> &keys, const std::string *owner)
+{
+    size_t removed = 0;
+    remover_t remover (*this, owner);
+
+    begin_batch ();
+    for (std::vector<std::string>::const_iterator it = keys.begin (); it != keys.end (); it++)
+    {
+        m_replica_db.accept (it->data (), it->size (), &remover, true);
+        if (remover.removed ())
+            removed++;
+    }
+    end_batch (true);
+
+    return removed;
+}
@@ -18,6 +18,11 @@
 # define PZQ_STORE_HPP
 
 #include "pzq.hpp"
+#include "time.hpp"
+#include "digest.hpp"
+#include "estimator.hpp"
+#include "histogram.hpp"
+#include "metrics.hpp"
 
 using namespace kyotocabinet;
 
@@ -25,28 +30,194 @@ namespace pzq {
 
     typedef char uuid_string_t [37];
 
+    /*
+      A record is a run of [u64 size][bytes] parts. A record can start
+      with a header instead: a size field with the top bit set and the
+      header version in the low bits, followed by one more u64.
+
+        local record with replicas   [flag | version][mask of the nodes
+                                     the replicas were placed on]
+        replica of another node      [flag | replica | version]
+                                     [owner size][owner]
+
+      With the lease bit set either is followed by one more u64, the
+      lease the producer asked for in microseconds.
+    */
+    const uint64_t record_header_flag = 0x8000000000000000ULL;
+    const uint64_t record_header_replica = 0x4000000000000000ULL;
+    const uint64_t record_header_lease = 0x2000000000000000ULL;
+    const uint64_t record_header_version = 1;
+
+    // Offset of the lease field or of the first part, 0 without a header
+    inline size_t record_header_end (const char *vbuf, size_t vsiz, uint64_t &size, uint64_t &field)
+    {
+        if (vsiz < 2 * sizeof (uint64_t))
+            return 0;
+
+        memcpy (&size, vbuf, sizeof (uint64_t));
+        if (!(size & record_header_flag))
+            return 0;
+
+        memcpy (&field, vbuf + sizeof (uint64_t), sizeof (uint64_t));
+        return 2 * sizeof (uint64_t) + ((size & record_header_replica) ? field : 0);
+    }
+
+    // Offset of the first part, peers receives the placement mask
+    inline size_t record_offset (const char *vbuf, size_t vsiz, uint64_t *peers)
+    {
+        uint64_t size, field;
+        size_t pos = record_header_end (vbuf, vsiz, size, field);
+
+        *peers = 0;
+        if (!pos)
+            return 0;
+
+        if (!(size & record_header_replica))
+            *peers = field;
+
+        return pos + ((size & record_header_lease) ? sizeof (uint64_t) : 0);
+    }
+
+    // Lease of the record, 0 when the producer left it to --ack-timeout
+    inline uint64_t record_lease (const char *vbuf, size_t vsiz)
+    {
+        uint64_t size, field, lease;
+        size_t pos = record_header_end (vbuf, vsiz, size, field);
+
+        if (!pos || !(size & record_header_lease) || pos + sizeof (uint64_t) > vsiz)
+            return 0;
+
+        memcpy (&lease, vbuf + pos, sizeof (uint64_t));
+        return lease;
+    }
+
+    // Fills owner and returns true if the record is a replica of another node
+    inline bool record_owner (const char *vbuf, size_t vsiz, std::string &owner)
+    {
+        uint64_t size, owner_size;
+
+        if (vsiz < 2 * sizeof (uint64_t))
+            return false;
+
+        memcpy (&size, vbuf, sizeof (uint64_t));
+        if ((size & (record_header_flag | record_header_replica)) != (record_header_flag | record_header_replica))
+            return false;
+
+        memcpy (&owner_size, vbuf + sizeof (uint64_t), sizeof (uint64_t));
+        if (2 * sizeof (uint64_t) + owner_size > vsiz)
+            return false;
+
+        owner.assign (vbuf + 2 * sizeof (uint64_t), owner_size);
+        return true;
+    }
+
+    // Wall clock time a key made by save was created at, 0 for other keys
+    inline uint64_t key_time (const char *kbuf, size_t ksiz)
+    {
+        uint64_t time = 0;
+
+        for (size_t i = 0; i < ksiz; i++)
+        {
+            if (kbuf [i] == '|')
+                return time;
+
+            if (kbuf [i] < '0' || kbuf [i] > '9')
+                return 0;
+
+            time = time * 10 + (kbuf [i] - '0');
+        }
+        return 0;
+    }
+
     class datastore_t
     {
     protected:
         TreeDB m_db;
+        TreeDB m_replica_db;
         CacheDB m_inflight_db;
+
+        // Deliveries per key and the time of the first one until the
+        // consumer ACKs it, whatever the envelope, in memory and capped
+        // like the in-flight database
+        CacheDB m_attempts_db;
         boost::scoped_ptr<TreeDB::Cursor> m_cursor;
-        uint64_t m_ack_timeout;
+        pzq::ack_estimator_t m_ack_estimator;
         bool m_hard_sync;
-        uint64_t m_syncs;
-        int m_expired;
-        boost::mutex m_mutex;
+        bool m_replica_hard_sync;
+        int64_t m_replica_page_cache;
+        boost::shared_ptr<pzq::metrics_t> m_metrics;
+        pzq::metric_shard_t *m_shard;
+        boost::shared_ptr<pzq::clock_service_t> m_clock;
+        uint64_t m_last_key_time;
+        bool m_in_batch;
+
+        // Digests of the replicas held per owner and of the records
+        // placed per peer, kept in step with every save and remove
+        std::map<std::string, pzq::digest_set_t> m_held;
+        std::map<int, pzq::digest_set_t> m_placed;
+
+        // Owner and key of the replicas saved in the open batch, they go
+        // into m_held and the owner index once the batch commits
+        std::vector<std::pair<std::string, std::string> > m_batch_saved;
+
+        // In memory index of the replicas by owner, "owner\0key" with
+        // no value. Rebuilt when the store is opened
+        GrassDB m_owner_index;
+        boost::scoped_ptr<GrassDB::Cursor> m_owner_cursor;
+        std::string m_owner_prefix;
+
+        void index_replica (const std::string &owner, const char *kbuf, size_t ksiz, bool add);
+        size_t remove_replicas (const std::vector<std::string> &keys, const std::string *owner);
 
     public:
-        datastore_t () : m_ack_timeout (5000000ULL), m_hard_sync (false), m_syncs (0),
-                         m_expired (0)
-        {}
+        datastore_t () : m_hard_sync (false), m_replica_hard_sync (false),
+                         m_replica_page_cache (0), m_metrics (new pzq::metrics_t),
+                         m_clock (new pzq::clock_service_t), m_last_key_time (0),
+                         m_in_batch (false)
+        {
+            m_shard = m_metrics->shard ();
+        }
+
+        // The store counts into a shard of its own, written from the manager thread
+        void set_metrics (boost::shared_ptr<pzq::metrics_t> metrics)
+        {
+            m_metrics = metrics;
+            m_shard = m_metrics->shard ();
+        }
+
+        boost::shared_ptr<pzq::metrics_t> metrics ()
+        {
+            return m_metrics;
+        }
+
+        void set_clock (boost::shared_ptr<pzq::clock_service_t> clock)
+        {
+            m_clock = clock;
+        }
 
         void open (const std::string &path, int64_t inflight_size);
 
-        bool save (pzq::message_t &message_parts, std::string key, std::string& storedKey );
+        // peers is the mask of the nodes the replicas of the record go to,
+        // lease overrides the ACK timeout of its deliveries unless 0
+        bool save (pzq::message_t &message_parts, std::string key, std::string& storedKey,
+                   uint64_t peers = 0, uint64_t lease = 0);
+
+        // Replicas of other nodes go to a database of their own, which the
+        // dispatch cursor never visits. A key already stored is left alone
+        void save_replica (const std::string &owner, pzq::message_t &message_parts, const std::string &key,
+                           uint64_t lease = 0);
+
+        // Replica saves between begin_batch and end_batch share one
+        // transaction, a rollback leaves the digests as they were
+        void begin_batch ();
+
+        void end_batch (bool commit);
 
         void remove (const std::string &key);
+
+        // latency records the time from the delivery to now, if it was
+        // the first one
+        void remove (const char *kbuf, size_t ksiz, pzq::histogram_t *latency = NULL);
        
         void removeReplica (const std::string &key);
        
@@ -54,6 +225,8 @@ namespace pzq {
 
         void remove_inflight (const std::string &k);
 
+        void remove_inflight (const char *kbuf, size_t ksiz);
+
         void sync ();
 
         int64_t messages ()
@@ -66,6 +239,16 @@ namespace pzq {
             return m_db.size ();
         }
 
+        int64_t replicas ()
+        {
+            return m_replica_db.count ();
+        }
+
+        int64_t replica_db_size ()
+        {
+            return m_replica_db.size ();
+        }
+
         int64_t messages_inflight ()
         {
             return m_inflight_db.count ();
@@ -78,23 +261,63 @@ namespace pzq {
 
         uint64_t num_syncs ()
         {
-            return m_syncs;
+            return m_shard->get (pzq::metric_syncs);
         }
 
         bool messages_pending ();
 
-        bool is_in_flight (const std::string &k);
+        // Creation time of the oldest local message, 0 if there is none
+        uint64_t oldest_message_time ();
+
+        bool is_in_flight (const std::string &k)
+        {
+            return is_in_flight (k.c_str (), k.size ());
+        }
+
+        bool is_in_flight (const char *kbuf, size_t ksiz);
+
+        /*
+          The in-flight database holds the monotonic deadline of every
+          delivery, the message goes out again once it has passed. The
+          attempts database keeps the number of deliveries and the time
+          of the first one until the ACK, the ACK timeout is derived from
+          it. Called once the delivery has been sent, it counts as
+          attempt
+        */
+        void mark_in_flight (const std::string &k, uint64_t lease, uint32_t attempt = 1)
+        {
+            mark_in_flight (k.c_str (), k.size (), lease, attempt);
+        }
+
+        void mark_in_flight (const char *kbuf, size_t ksiz, uint64_t lease, uint32_t attempt = 1);
 
-        void mark_in_flight (const std::string &k);
+        // Moves the deadline of a delivery to lease from now, false if it is not in flight
+        bool touch (const char *kbuf, size_t ksiz, uint64_t lease);
+
+        // Deliveries of a key that went out so far, 0 before the first
+        uint32_t attempts (const char *kbuf, size_t ksiz);
 
         void set_ack_timeout (uint64_t ack_timeout)
         {
-            m_ack_timeout = ack_timeout;
+            m_ack_estimator.set_fixed (ack_timeout);
         }
 
+        // Derive the ACK timeout from the ACK latency within min and max, max 0 to disable
+        void set_ack_timeout_bounds (uint64_t min, uint64_t max)
+        {
+            m_ack_estimator.set_bounds (min, max);
+        }
+
+        // Timeout of deliveries without a lease of their own
         uint64_t get_ack_timeout () const
         {
-            return m_ack_timeout;
+            return m_ack_estimator.timeout ();
+        }
+
+        // Smoothed time from delivery to ACK
+        uint64_t ack_latency () const
+        {
+            return m_ack_estimator.latency ();
         }
 
         void set_hard_sync (bool sync)
@@ -102,27 +325,77 @@ namespace pzq {
             m_hard_sync = sync;
         }
 
-        int get_messages_expired ()
+        void set_replica_hard_sync (bool sync)
         {
-            m_mutex.lock ();
-            int expired = m_expired;
-            m_mutex.unlock ();
-            return expired;
+            m_replica_hard_sync = sync;
+        }
+
+        // Page cache of the replica database in bytes, before open
+        void set_replica_page_cache (int64_t size)
+        {
+            m_replica_page_cache = size;
+        }
+
+        // Expired by the manager and by the reaper, which counts its own
+        uint64_t get_messages_expired ()
+        {
+            return m_metrics->value (pzq::metric_expired_messages);
         }
 
         void message_expired ()
         {
-            m_mutex.lock ();
-            m_expired++;
-            m_mutex.unlock ();
+            m_shard->add (pzq::metric_expired_messages);
         }
 
-        void iterate (DB::Visitor *visitor);
+        // A delivery passed its deadline, here or in the reaper
+        void back_off_ack_timeout ()
+        {
+            m_ack_estimator.backoff ((*m_clock).now ());
+        }
+
+        // Feeds records to the visitor until it throws, returns true
+        // when the cursor runs off the end of the store
+        bool iterate (DB::Visitor *visitor);
 
         void iterate_inflight (DB::Visitor *visitor);
        
         void resetIterator();
 
+        // Like iterate but over the replicas held for owner, in key order
+        bool iterate_replicas (const std::string &owner, DB::Visitor *visitor);
+
+        // Adds a record to the digests or takes it out
+        void track (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, bool add);
+
+        const std::map<std::string, pzq::digest_set_t> &held_digests () const
+        {
+            return m_held;
+        }
+
+        const pzq::digest_set_t *placed_digests (int peer) const
+        {
+            std::map<int, pzq::digest_set_t>::const_iterator it = m_placed.find (peer);
+            return (it == m_placed.end ()) ? NULL : &it->second;
+        }
+
+        // Keys of the replicas held for owner in one digest bucket
+        void replica_keys (const std::string &owner, uint64_t bucket, std::vector<std::string> &keys);
+
+        /*
+          Reads the local record after key, from the first one when key
+          is empty, and moves key to it. Returns false at the end.
+        */
+        bool next_record (std::string &key, pzq::message_t &parts, uint64_t &peers, uint64_t &lease);
+
+        // Adds peer to the placement mask of a local record, false if it is gone
+        bool place (const std::string &key, int peer);
+
+        // Removes replicas of owner in one transaction, returns how many went
+        size_t remove_replicas (const std::string &owner, const std::vector<std::string> &keys);
+
+        // Same for replicas of any owner
+        size_t remove_replicas (const std::vector<std::string> &keys);
+
         ~datastore_t ();
     };
 
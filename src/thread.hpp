@@ -30,6 +30,9 @@ namespace pzq {
         boost::thread *m_thread;
 
     public:
+        thread_t () : m_running (false), m_thread (NULL)
+        {}
+
         bool is_running ()
         {
             m_mutex.lock ();
@@ -18,9 +18,13 @@
 # define PZQ_TIME_HPP
 
 #include <sys/time.h>
+#include <time.h>
+#include <stdexcept>
+#include <stdint.h>
 
 namespace pzq {
 
+    // Wall clock time, only for values that are persisted or sent out
     inline
     uint64_t microsecond_timestamp ()
     {
@@ -31,6 +35,59 @@ namespace pzq {
         }
         return static_cast<uint64_t> (tv.tv_sec) * 1000000ULL + static_cast<uint64_t> (tv.tv_usec);
     }
+
+    // Time that never steps backwards, for timeouts and deadlines
+    inline
+    uint64_t monotonic_timestamp ()
+    {
+#ifdef CLOCK_MONOTONIC
+        timespec ts;
+
+        if (::clock_gettime (CLOCK_MONOTONIC, &ts)) {
+            throw new std::runtime_error ("clock_gettime failed");
+        }
+        return static_cast<uint64_t> (ts.tv_sec) * 1000000ULL + static_cast<uint64_t> (ts.tv_nsec) / 1000ULL;
+#else
+        return microsecond_timestamp ();
+#endif
+    }
+
+    /*
+      Both clocks sampled once per event loop iteration. Everything that
+      runs inside one iteration sees the same time, so a loop pays for a
+      single pair of clock reads no matter how many messages it handles.
+      An instance belongs to one thread.
+    */
+    class clock_service_t
+    {
+    private:
+        uint64_t m_now;
+        uint64_t m_wall;
+
+    public:
+        clock_service_t ()
+        {
+            update ();
+        }
+
+        void update ()
+        {
+            m_now = monotonic_timestamp ();
+            m_wall = microsecond_timestamp ();
+        }
+
+        // Monotonic microseconds
+        uint64_t now () const
+        {
+            return m_now;
+        }
+
+        // Wall clock microseconds
+        uint64_t wall () const
+        {
+            return m_wall;
+        }
+    };
 }
 
 #endif
@@ -0,0 +1,140 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *  
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *  
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *  
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.                 
+ */
+
+#include "timer.hpp"
+
+void pzq::timer_service_t::swap (size_t a, size_t b)
+{
+    std::swap (m_heap [a], m_heap [b]);
+    m_timers [m_heap [a]].position = a;
+    m_timers [m_heap [b]].position = b;
+}
+
+void pzq::timer_service_t::sift_up (size_t i)
+{
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (!earlier (i, parent))
+            break;
+
+        swap (i, parent);
+        i = parent;
+    }
+}
+
+void pzq::timer_service_t::sift_down (size_t i)
+{
+    size_t size = m_heap.size ();
+
+    while (true)
+    {
+        size_t left = 2 * i + 1, right = left + 1, smallest = i;
+
+        if (left < size && earlier (left, smallest))
+            smallest = left;
+
+        if (right < size && earlier (right, smallest))
+            smallest = right;
+
+        if (smallest == i)
+            break;
+
+        swap (i, smallest);
+        i = smallest;
+    }
+}
+
+void pzq::timer_service_t::remove_at (size_t i)
+{
+    size_t last = m_heap.size () - 1;
+
+    m_timers [m_heap [i]].position = not_scheduled;
+
+    if (i != last)
+    {
+        m_heap [i] = m_heap [last];
+        m_timers [m_heap [i]].position = i;
+    }
+    m_heap.pop_back ();
+
+    if (i < m_heap.size ())
+    {
+        sift_down (i);
+        sift_up (i);
+    }
+}
+
+pzq::timer_id_t pzq::timer_service_t::create (callback_t callback)
+{
+    entry_t timer;
+    timer.deadline = 0;
+    timer.position = not_scheduled;
+    timer.callback = callback;
+
+    m_timers.push_back (timer);
+    return m_timers.size () - 1;
+}
+
+void pzq::timer_service_t::schedule (timer_id_t id, uint64_t deadline)
+{
+    entry_t &timer = m_timers [id];
+    timer.deadline = deadline;
+
+    if (timer.position == not_scheduled)
+    {
+        m_heap.push_back (id);
+        timer.position = m_heap.size () - 1;
+    }
+    sift_down (timer.position);
+    sift_up (timer.position);
+}
+
+void pzq::timer_service_t::cancel (timer_id_t id)
+{
+    if (m_timers [id].position != not_scheduled)
+        remove_at (m_timers [id].position);
+}
+
+long pzq::timer_service_t::poll_timeout () const
+{
+    if (m_heap.empty ())
+        return -1;
+
+    uint64_t deadline = m_timers [m_heap [0]].deadline;
+    uint64_t now = (*m_clock).now ();
+
+    if (deadline <= now)
+        return 0;
+
+    // Round up so that we never wake up just before the deadline
+    return static_cast<long> ((deadline - now + 999) / 1000);
+}
+
+void pzq::timer_service_t::run_expired ()
+{
+    uint64_t now = (*m_clock).now ();
+
+    while (!m_heap.empty () && m_timers [m_heap [0]].deadline <= now)
+    {
+        timer_id_t id = m_heap [0];
+        remove_at (0);
+
+        // The callback may schedule timers and grow m_timers
+        callback_t callback = m_timers [id].callback;
+        callback ();
+    }
+}
@@ -0,0 +1,104 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *  
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *  
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *  
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.                 
+ */
+
+#ifndef PZQ_TIMER_HPP
+# define PZQ_TIMER_HPP
+
+#include "pzq.hpp"
+#include "time.hpp"
+
+#include <boost/function.hpp>
+#include <vector>
+
+namespace pzq {
+
+    typedef size_t timer_id_t;
+
+    /*
+      Deadlines of the manager loop kept in one indexed binary heap.
+      Subsystems create a timer once and then schedule, reschedule or
+      cancel it in O(log n), the loop sleeps until the earliest deadline.
+      Deadlines are monotonic microseconds from the shared clock service.
+    */
+    class timer_service_t
+    {
+    public:
+        typedef boost::function<void ()> callback_t;
+
+    private:
+        struct entry_t
+        {
+            uint64_t deadline;
+            size_t position;
+            callback_t callback;
+        };
+
+        static const size_t not_scheduled = static_cast<size_t> (-1);
+
+        boost::shared_ptr<pzq::clock_service_t> m_clock;
+        std::vector<entry_t> m_timers;
+        std::vector<timer_id_t> m_heap;
+
+        bool earlier (size_t a, size_t b) const
+        {
+            return m_timers [m_heap [a]].deadline < m_timers [m_heap [b]].deadline;
+        }
+
+        void swap (size_t a, size_t b);
+
+        void sift_up (size_t i);
+
+        void sift_down (size_t i);
+
+        void remove_at (size_t i);
+
+    public:
+        timer_service_t (boost::shared_ptr<pzq::clock_service_t> clock) : m_clock (clock)
+        {}
+
+        // Creates an unscheduled timer that runs callback when it fires
+        timer_id_t create (callback_t callback);
+
+        // Sets the absolute deadline, whether or not the timer is scheduled
+        void schedule (timer_id_t id, uint64_t deadline);
+
+        void schedule_after (timer_id_t id, uint64_t delay)
+        {
+            schedule (id, (*m_clock).now () + delay);
+        }
+
+        void cancel (timer_id_t id);
+
+        bool is_scheduled (timer_id_t id) const
+        {
+            return m_timers [id].position != not_scheduled;
+        }
+
+        uint64_t deadline (timer_id_t id) const
+        {
+            return m_timers [id].deadline;
+        }
+
+        // Milliseconds until the next deadline for zmq::poll, -1 if none
+        long poll_timeout () const;
+
+        // Fires every timer whose deadline has passed. Timers are one-shot,
+        // a callback reschedules its own timer if it wants to run again
+        void run_expired ();
+    };
+}
+
+#endif
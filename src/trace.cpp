@@ -0,0 +1,136 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "trace.hpp"
+#include "time.hpp"
+
+#include <cstring>
+#include <boost/bind.hpp>
+
+namespace
+{
+    const char *stage_names [] = { "receive", "store", "replicate", "replica_ack", "dispatch", "ack", "nack", "remove", "expire" };
+}
+
+pzq::tracer_t::tracer_t (size_t events, uint64_t max_age)
+    : m_events (events ? events : 1), m_next (0), m_recorded (0), m_sample (0), m_countdown (0), m_skipped (0),
+      m_max_age (max_age), m_expired (0), m_timer (0)
+{
+    m_lookup.reserve (key_size);
+}
+
+void pzq::tracer_t::set_timers (boost::shared_ptr<pzq::timer_service_t> timers)
+{
+    m_timers = timers;
+    m_timer = m_timers->create (boost::bind (&tracer_t::handle_timer, this));
+}
+
+uint64_t pzq::tracer_t::age_out (uint64_t now)
+{
+    uint64_t oldest = 0;
+    std::map<std::string, uint64_t>::iterator it = m_traced.begin ();
+
+    while (it != m_traced.end ())
+    {
+        if (it->second + m_max_age <= now)
+        {
+            append (it->first.data (), it->first.size (), trace_expire, now);
+            m_traced.erase (it++);
+            m_expired++;
+            continue;
+        }
+        if (!oldest || it->second < oldest)
+            oldest = it->second;
+        ++it;
+    }
+    return oldest;
+}
+
+void pzq::tracer_t::handle_timer ()
+{
+    // One sweep per max_age at most, the set holds max_traced keys
+    uint64_t oldest = age_out (pzq::monotonic_timestamp ());
+    if (oldest)
+        m_timers->schedule (m_timer, oldest + m_max_age);
+}
+
+void pzq::tracer_t::append (const char *key, size_t size, trace_stage_t stage, uint64_t time)
+{
+    event_t &event = m_events [m_next];
+    m_next = (m_next + 1) % m_events.size ();
+    m_recorded++;
+
+    event.time = time;
+    event.stage = (uint8_t) stage;
+    event.size = (uint8_t) ((size < key_size) ? size : key_size);
+    memcpy (event.key, key, event.size);
+}
+
+void pzq::tracer_t::start (const std::string &key, uint64_t received)
+{
+    // Keys of messages that are never removed would pile up, make room
+    // from the ones past max_age before giving up
+    if (m_traced.size () >= max_traced)
+        age_out (pzq::monotonic_timestamp ());
+
+    if (m_traced.size () >= max_traced)
+    {
+        m_skipped++;
+        return;
+    }
+
+    m_traced.insert (std::make_pair (key, received));
+    if (m_timers && !m_timers->is_scheduled (m_timer))
+        m_timers->schedule (m_timer, received + m_max_age);
+    append (key.data (), key.size (), trace_receive, received);
+    append (key.data (), key.size (), trace_store, pzq::monotonic_timestamp ());
+}
+
+void pzq::tracer_t::record (const char *key, size_t size, trace_stage_t stage)
+{
+    // Reuses its buffer, keys are no longer than the reserve
+    m_lookup.assign (key, size);
+    if (m_traced.find (m_lookup) != m_traced.end ())
+        append (key, size, stage, pzq::monotonic_timestamp ());
+}
+
+void pzq::tracer_t::finish (const char *key, size_t size)
+{
+    m_lookup.assign (key, size);
+    if (m_traced.erase (m_lookup))
+        append (key, size, trace_remove, pzq::monotonic_timestamp ());
+}
+
+void pzq::tracer_t::dump (std::ostream &out) const
+{
+    std::map<std::string, uint64_t> first;
+    size_t count = (m_recorded < m_events.size ()) ? (size_t) m_recorded : m_events.size ();
+    size_t start = (m_recorded < m_events.size ()) ? 0 : m_next;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const event_t &event = m_events [(start + i) % m_events.size ()];
+        std::string key (event.key, event.size);
+
+        // The receive of a key may have been overwritten already
+        std::map<std::string, uint64_t>::iterator it = first.find (key);
+        if (it == first.end ())
+            it = first.insert (std::make_pair (key, event.time)).first;
+
+        out << event.time << " +" << (event.time - it->second) << " "
+            << stage_names [event.stage] << " " << key << "\n";
+    }
+}
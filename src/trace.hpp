@@ -0,0 +1,160 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_TRACE_HPP
+# define PZQ_TRACE_HPP
+
+#include "timer.hpp"
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+
+namespace pzq {
+
+    enum trace_stage_t
+    {
+        trace_receive,
+        trace_store,
+        trace_replicate,
+        trace_replica_ack,
+        trace_dispatch,
+        trace_ack,
+        trace_nack,
+        trace_remove,
+        trace_expire
+    };
+
+    /*
+      Lifecycle tracing of sampled messages. A message is traced when the
+      producer asks for it with a TRACE part, or as one in every N when
+      sampling is on. From being stored to being removed its key is in
+      the traced set, every stage it passes is recorded with the
+      monotonic time into a ring of fixed size events that overwrites
+      the oldest. Nothing is allocated per event, keys are cut at 64
+      bytes in the ring. With nothing traced every stage costs a test of
+      active (). Used from the manager thread only.
+
+      Only a consumer ACK finishes a trace. Messages that leave some
+      other way, removed by a peer after a takeover or never consumed,
+      are given up after max_age with an expire event, so they neither
+      fill the set nor keep active () true.
+    */
+    class tracer_t
+    {
+    private:
+        enum { key_size = 64, max_traced = 1024 };
+
+        struct event_t
+        {
+            uint64_t time;
+            uint8_t stage;
+            uint8_t size;
+            char key [key_size];
+        };
+
+        std::vector<event_t> m_events;
+        size_t m_next;
+        uint64_t m_recorded;
+
+        uint32_t m_sample;
+        uint32_t m_countdown;
+
+        // Key to the time its message was received
+        std::map<std::string, uint64_t> m_traced;
+        std::string m_lookup;
+        uint64_t m_skipped;
+
+        uint64_t m_max_age;
+        uint64_t m_expired;
+        boost::shared_ptr<pzq::timer_service_t> m_timers;
+        pzq::timer_id_t m_timer;
+
+        void append (const char *key, size_t size, trace_stage_t stage, uint64_t time);
+
+        // Gives up the traces older than max_age, returns the oldest
+        // receive time left or 0 when none is
+        uint64_t age_out (uint64_t now);
+
+        void handle_timer ();
+
+    public:
+        explicit tracer_t (size_t events = 8192, uint64_t max_age = 600000000ULL);
+
+        // Ages traces out on a timer, otherwise only when the set is full
+        void set_timers (boost::shared_ptr<pzq::timer_service_t> timers);
+
+        // Trace one in every sample produced messages, 0 for none
+        void set_sample (uint32_t sample)
+        {
+            m_sample = sample;
+            m_countdown = sample;
+        }
+
+        // Whether a produced message is to be traced
+        bool sample (bool requested)
+        {
+            if (requested)
+                return true;
+
+            if (!m_sample || --m_countdown)
+                return false;
+
+            m_countdown = m_sample;
+            return true;
+        }
+
+        // True while any message is being traced
+        bool active () const
+        {
+            return !m_traced.empty ();
+        }
+
+        // Starts tracing a stored message that was received at received
+        void start (const std::string &key, uint64_t received);
+
+        // Records the stage if the key is traced
+        void record (const char *key, size_t size, trace_stage_t stage);
+
+        void record (const std::string &key, trace_stage_t stage)
+        {
+            record (key.data (), key.size (), stage);
+        }
+
+        // Records the removal and stops tracing the key
+        void finish (const char *key, size_t size);
+
+        // Messages not traced because max_traced were already
+        uint64_t skipped () const
+        {
+            return m_skipped;
+        }
+
+        // Traces given up before their message was removed
+        uint64_t expired () const
+        {
+            return m_expired;
+        }
+
+        // One line per event, oldest first: time +since_first stage key
+        void dump (std::ostream &out) const;
+    };
+}
+
+#endif
@@ -31,40 +31,97 @@ bool pzq::visitor_t::can_write ()
 
 const char *pzq::visitor_t::visit_full (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, size_t *sp) 
 {
-    size_t msg_size, pos = 0;
-    std::string key (kbuf, ksiz);
-
     if (!can_write ())
         throw std::runtime_error ("Reached maximum messages in flight limit");
 
-    if ((*m_store).is_in_flight (key))
+    if ((*m_store).is_in_flight (kbuf, ksiz))
         return NOP;
 
+    // Counted with either envelope, only the binary header tells the
+    // consumer. It counts once the send has gone through, a full socket
+    // is no delivery
+    uint32_t attempt = (*m_store).attempts (kbuf, ksiz) + 1;
+
+    uint64_t lease = pzq::record_lease (vbuf, vsiz);
+    if (!lease)
+        lease = (*m_store).get_ack_timeout ();
+
     pzq::message_t parts;
-    parts.append (key);
+    build_message (kbuf, ksiz, vbuf, vsiz, (*m_clock).wall (), lease, attempt, parts);
    
-    // Check if it is a replica and if it should be sent
-    memcpy( &msg_size, vbuf, sizeof( uint64_t ) );
-    if( msg_size > 8 && strncmp( vbuf+sizeof(uint64_t), "REPLICA:", 8 ) == 0 )
+    if ((*m_socket).send_many (parts, ZMQ_NOBLOCK))
     {
-        std::string replicaSource = std::string( vbuf+sizeof(uint64_t) + 8, msg_size - 8 );
-        
-        if( !m_cluster->shouldSendReplica( replicaSource ) )
-            return NOP;
-        
-        m_cluster->checkReplica( key, replicaSource );
+        (*m_store).mark_in_flight (kbuf, ksiz, lease, attempt);
+        m_delivered++;
+
+        // A redelivery would count the time the message waited for the
+        // first ACK, which grows with every attempt
+        uint64_t stored = pzq::key_time (kbuf, ksiz);
+        if (attempt == 1 && stored)
+            m_dispatch_latency.record ((*m_clock).wall () > stored ? (*m_clock).wall () - stored : 0);
+
+        if (m_tracer && m_tracer->active ())
+            m_tracer->record (kbuf, ksiz, pzq::trace_dispatch);
     }
+    else
+        throw std::runtime_error ("Reached maximum messages in flight limit");
+   
+    return NOP;
+}
 
-    // Time when the message goes out
-    std::stringstream mt;
-    mt << pzq::microsecond_timestamp ();
+namespace
+{
+    void put_be (char *p, uint64_t value, int bytes)
+    {
+        for (int i = bytes - 1; i >= 0; i--)
+        {
+            p [i] = (char) (value & 0xff);
+            value >>= 8;
+        }
+    }
+}
 
-    parts.append (mt.str ());
+void pzq::visitor_t::build_message (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz,
+                                    uint64_t sent, uint64_t ack_timeout, uint32_t attempt, pzq::message_t &parts)
+{
+    uint64_t peers;
+    size_t msg_size, pos = pzq::record_offset (vbuf, vsiz, &peers);
 
-    std::stringstream expiry;
-    expiry << (*m_store).get_ack_timeout ();
+    parts.append (kbuf, ksiz);
+
+    if (m_envelope == envelope_binary)
+    {
+        uint8_t flags = 0;
+        if (attempt > 1)
+            flags |= delivery_redelivered;
+
+        // Replicas are only delivered while their owner is down
+        uint64_t size;
+        if (vsiz >= sizeof (uint64_t))
+        {
+            memcpy (&size, vbuf, sizeof (uint64_t));
+            if ((size & pzq::record_header_flag) && (size & pzq::record_header_replica))
+                flags |= delivery_takeover;
+        }
+
+        m_header [0] = (char) envelope_binary;
+        m_header [1] = (char) flags;
+        put_be (m_header + 2, delivery_header_size, 2);
+        put_be (m_header + 4, attempt, 4);
+        put_be (m_header + 8, sent, 8);
+        put_be (m_header + 16, sent + ack_timeout, 8);
+        parts.append (m_header, delivery_header_size);
+    }
+    else
+    {
+        // Time when the message goes out
+        int len = snprintf (m_sent, sizeof (m_sent), "%llu", (unsigned long long) sent);
+        parts.append (m_sent, len);
+
+        len = snprintf (m_timeout, sizeof (m_timeout), "%llu", (unsigned long long) ack_timeout);
+        parts.append (m_timeout, len);
+    }
 
-    parts.append (expiry.str ());
     parts.append ();
     while (true)
     {
@@ -77,11 +134,4 @@ const char *pzq::visitor_t::visit_full (const char *kbuf, size_t ksiz, const cha
         if (pos >= vsiz)
             break;
     }
-   
-    if ((*m_socket).send_many (parts, ZMQ_NOBLOCK))
-        (*m_store).mark_in_flight (key);
-    else
-        throw std::runtime_error ("Reached maximum messages in flight limit");
-   
-    return NOP;
 }
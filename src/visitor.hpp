@@ -22,31 +22,63 @@
 #include "socket.hpp"
 #include "time.hpp"
 #include "thread.hpp"
-#include "cluster.hpp"
+#include "histogram.hpp"
+#include "trace.hpp"
 
 using namespace kyotocabinet;
 
 namespace pzq
 {
+    /*
+      Consumer envelopes. Version 1 sends the sent time and the ACK
+      timeout as decimal text frames after the key. Version 2 replaces
+      them with one binary frame, all fields big endian:
+
+        0   u8   version (2)
+        1   u8   flags
+        2   u16  header size, newer fields go after the ones below
+        4   u32  delivery attempt, 1 for the first
+        8   u64  sent time (microseconds since the epoch)
+        16  u64  ACK deadline (microseconds since the epoch)
+    */
+    enum { envelope_text = 1, envelope_binary = 2 };
+
+    const size_t delivery_header_size = 24;
+
+    // Set in the flags of a version 2 header
+    const uint8_t delivery_redelivered = 0x01;
+    const uint8_t delivery_takeover = 0x02;
+
     class visitor_t : public DB::Visitor
     {
     private:
         boost::shared_ptr<pzq::socket_t> m_socket;
         boost::shared_ptr<pzq::datastore_t> m_store;
         uuid_t m_uuid;
-        boost::shared_ptr< pzq::cluster_t > m_cluster;
+        boost::shared_ptr<pzq::clock_service_t> m_clock;
+        int m_envelope;
+
+        // Formatting buffers reused for every delivery
+        char m_sent [32];
+        char m_timeout [32];
+        char m_header [delivery_header_size];
+
+        uint64_t m_delivered;
+
+        // Time from storing to the first delivery
+        pzq::histogram_t m_dispatch_latency;
+
+        boost::shared_ptr<pzq::tracer_t> m_tracer;
 
     public:
-        visitor_t ()
+        visitor_t () : m_clock (new pzq::clock_service_t), m_envelope (envelope_text), m_delivered (0)
         {
             uuid_generate (m_uuid);
         }
 
-        void set_socket (boost::shared_ptr<pzq::socket_t> socket,
-                         boost::shared_ptr<pzq::cluster_t> cluster)
+        void set_socket (boost::shared_ptr<pzq::socket_t> socket)
         {
             m_socket = socket;
-            m_cluster = cluster;
         }
 
         void set_datastore (boost::shared_ptr<pzq::datastore_t> store)
@@ -54,8 +86,39 @@ namespace pzq
             m_store = store;
         }
 
+        void set_clock (boost::shared_ptr<pzq::clock_service_t> clock)
+        {
+            m_clock = clock;
+        }
+
+        void set_tracer (boost::shared_ptr<pzq::tracer_t> tracer)
+        {
+            m_tracer = tracer;
+        }
+
+        // envelope_text or envelope_binary, the same for all consumers
+        void set_envelope (int envelope)
+        {
+            m_envelope = envelope;
+        }
+
         bool can_write ();
 
+        // Number of messages handed to consumers so far
+        uint64_t delivered () const
+        {
+            return m_delivered;
+        }
+
+        pzq::histogram_t &dispatch_latency ()
+        {
+            return m_dispatch_latency;
+        }
+
+        // Builds the consumer envelope for a stored record into parts
+        void build_message (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz,
+                            uint64_t sent, uint64_t ack_timeout, uint32_t attempt, pzq::message_t &parts);
+
     private:
         const char *visit_full (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, size_t *sp);
 
@@ -0,0 +1,176 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+  Pending replication ACKs. Fills the cache with the given number of
+  outstanding writes replicated to two peers, acknowledges every write
+  from both, then fills it again and lets everything expire. The same
+  runs go through the multi_index container pzq used before.
+*/
+
+#include "pzq.hpp"
+#include "ackcache.hpp"
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/member.hpp>
+
+#include <vector>
+#include <cstdio>
+
+namespace
+{
+    // The container pzq used before, kept here as the baseline
+    class legacy_ackcache_t
+    {
+    public:
+        struct ack_t
+        {
+            ack_t (const std::string &id, const pzq::message_t &ack, uint64_t ts, uint64_t peers)
+                : m_ack (ack), m_idmsg (id), m_ts (ts), m_peers (new uint64_t (peers))
+            {}
+
+            pzq::message_t m_ack;
+            std::string m_idmsg;
+            uint64_t m_ts;
+            boost::shared_ptr<uint64_t> m_peers;
+        };
+
+        typedef boost::multi_index::multi_index_container<
+            ack_t,
+            boost::multi_index::indexed_by<
+                boost::multi_index::hashed_unique<
+                    boost::multi_index::member<ack_t, std::string, &ack_t::m_idmsg> >,
+                boost::multi_index::ordered_non_unique<
+                    boost::multi_index::member<ack_t, uint64_t, &ack_t::m_ts> > > > cache_t;
+
+    private:
+        cache_t m_cache;
+        uint64_t m_timeout;
+        boost::shared_ptr<pzq::clock_service_t> m_clock;
+
+    public:
+        legacy_ackcache_t (uint64_t timeout, boost::shared_ptr<pzq::clock_service_t> clock)
+            : m_timeout (timeout), m_clock (clock)
+        {}
+
+        void push (const std::string &id, const pzq::message_t &ack, uint64_t peers)
+        {
+            m_cache.insert (ack_t (id, ack, m_clock->now () + m_timeout, peers));
+        }
+
+        bool acknowledge (const std::string &id, int peer, bool success, pzq::message_t &ack)
+        {
+            uint64_t bit = uint64_t (1) << peer;
+
+            cache_t::nth_index<0>::type &index = m_cache.get<0> ();
+            cache_t::nth_index<0>::type::iterator it = index.find (id);
+            if (it == index.end () || !(*it->m_peers & bit))
+                return false;
+
+            *it->m_peers &= ~bit;
+            if (success && *it->m_peers)
+                return true;
+
+            ack = it->m_ack;
+            index.erase (it);
+            return true;
+        }
+
+        pzq::message_t pop ()
+        {
+            cache_t::nth_index<1>::type &index = m_cache.get<1> ();
+            pzq::message_t msg = index.begin ()->m_ack;
+            index.erase (index.begin ());
+            return msg;
+        }
+
+        size_t size () const
+        {
+            return m_cache.size ();
+        }
+    };
+
+    void report (const char *name, const char *what, uint64_t elapsed, int count)
+    {
+        printf ("%-10s %-12s %8.1f ns/op\n", name, what, elapsed * 1000.0 / count);
+    }
+
+    template <typename cache_t>
+    void run (const char *name, cache_t &cache, const std::vector<std::string> &keys)
+    {
+        int count = keys.size ();
+        const char routing_id [] = { 0, 'p', 'r', 'o', 'd' };
+
+        pzq::message_t ack;
+        ack.append (routing_id, sizeof (routing_id));
+        ack.append (&count, sizeof (int));
+        ack.append ("1", 1);
+        ack.append ();
+
+        uint64_t start = pzq::microsecond_timestamp ();
+        for (int i = 0; i < count; i++)
+            cache.push (keys [i], ack, 3);
+        report (name, "push", pzq::microsecond_timestamp () - start, count);
+
+        pzq::message_t out;
+        start = pzq::microsecond_timestamp ();
+        for (int peer = 0; peer < 2; peer++)
+            for (int i = 0; i < count; i++)
+                cache.acknowledge (keys [i], peer, true, out);
+        report (name, "acknowledge", pzq::microsecond_timestamp () - start, 2 * count);
+
+        if (cache.size ())
+            printf ("%s: %lu entries left after acknowledging\n", name, (unsigned long) cache.size ());
+
+        for (int i = 0; i < count; i++)
+            cache.push (keys [i], ack, 3);
+
+        start = pzq::microsecond_timestamp ();
+        while (cache.size ())
+            out = cache.pop ();
+        report (name, "expire", pzq::microsecond_timestamp () - start, count);
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    int count = (argc > 1) ? atoi (argv [1]) : 1000000;
+
+    boost::shared_ptr<pzq::clock_service_t> clock (new pzq::clock_service_t);
+
+    // Same shape as the keys of the store
+    std::vector<std::string> keys;
+    keys.reserve (count);
+    for (int i = 0; i < count; i++)
+    {
+        char key [64];
+        snprintf (key, sizeof (key), "%llu|0f8fad5b-d9cb-469f-a165-%012d",
+                  (unsigned long long) pzq::microsecond_timestamp () + i, i);
+        keys.push_back (key);
+    }
+
+    {
+        legacy_ackcache_t cache (1000000, clock);
+        run ("legacy", cache, keys);
+    }
+    {
+        pzq::ackcache_t cache (1000000, clock);
+        run ("ackcache", cache, keys);
+    }
+    return 0;
+}
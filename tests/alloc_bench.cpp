@@ -0,0 +1,228 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+  Counts heap allocations per message on the produce -> store -> dispatch
+  path. Every malloc in the process is counted, including the ones made
+  by libzmq and Kyoto Cabinet, so the figures are totals per message.
+
+  The first section pushes the same traffic through one socket hop with
+  the old shared_ptr/std::list container and with pzq::message_t so the
+  difference is visible in isolation.
+*/
+
+#include "pzq.hpp"
+#include "socket.hpp"
+#include "store.hpp"
+#include "visitor.hpp"
+
+#include <list>
+#include <iostream>
+#include <cstdio>
+
+extern "C" void *__libc_malloc (size_t size);
+extern "C" void *__libc_calloc (size_t nmemb, size_t size);
+extern "C" void *__libc_realloc (void *ptr, size_t size);
+
+static volatile uint64_t allocations = 0;
+
+extern "C" void *malloc (size_t size)
+{
+    allocations++;
+    return __libc_malloc (size);
+}
+
+extern "C" void *calloc (size_t nmemb, size_t size)
+{
+    allocations++;
+    return __libc_calloc (nmemb, size);
+}
+
+extern "C" void *realloc (void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc (ptr, size);
+}
+
+namespace
+{
+    // The container pzq used before, kept here as the baseline
+    class legacy_message_t
+    {
+    private:
+        boost::shared_ptr <std::list <boost::shared_ptr <zmq::message_t> > > m_message;
+
+    public:
+        legacy_message_t () : m_message (new std::list <boost::shared_ptr <zmq::message_t> >)
+        {}
+
+        void append (zmq::message_t &msg)
+        {
+            boost::shared_ptr <zmq::message_t> part (new zmq::message_t);
+            part.get ()->copy (&msg);
+            (*m_message).push_back (part);
+        }
+
+        bool send (zmq::socket_t &socket)
+        {
+            size_t i = 0, elements = (*m_message).size ();
+            std::list <boost::shared_ptr <zmq::message_t> >::iterator it;
+
+            for (it = (*m_message).begin (); it != (*m_message).end (); it++, i++)
+                if (!socket.send (*(*it), (i < elements - 1) ? ZMQ_SNDMORE : 0))
+                    return false;
+            return true;
+        }
+
+        int recv (zmq::socket_t &socket)
+        {
+            int more, i = 0;
+            size_t moresz = sizeof (int);
+
+            do {
+                zmq::message_t msg;
+                if (socket.recv (&msg, 0) == false)
+                    return 0;
+
+                append (msg);
+                socket.getsockopt (ZMQ_RCVMORE, &more, &moresz);
+                ++i;
+            } while (more);
+            return i;
+        }
+    };
+
+    void send_test_message (zmq::socket_t &socket, size_t parts, size_t size)
+    {
+        for (size_t i = 0; i < parts; i++)
+        {
+            zmq::message_t part (size);
+            memset (part.data (), 'x', size);
+            socket.send (part, (i < parts - 1) ? ZMQ_SNDMORE : 0);
+        }
+    }
+
+    void report (const char *name, uint64_t count, int messages)
+    {
+        printf ("%-28s %8.2f allocations/message\n", name, (double) count / messages);
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    int messages = (argc > 1) ? atoi (argv [1]) : 10000;
+    size_t parts = 4, size = 256;
+
+    zmq::context_t context (1);
+    uint64_t start;
+
+    // One socket hop: recv_many + send_many
+    {
+        pzq::socket_t source (context, ZMQ_PAIR), hop_in (context, ZMQ_PAIR);
+        pzq::socket_t hop_out (context, ZMQ_PAIR), sink (context, ZMQ_PAIR);
+
+        source.bind ("inproc://alloc-hop-in");
+        hop_in.connect ("inproc://alloc-hop-in");
+        hop_out.bind ("inproc://alloc-hop-out");
+        sink.connect ("inproc://alloc-hop-out");
+
+        start = allocations;
+        for (int i = 0; i < messages; i++)
+        {
+            send_test_message (source, parts, size);
+
+            legacy_message_t message;
+            message.recv (hop_in);
+            message.send (hop_out);
+
+            pzq::message_t drain;
+            sink.recv_many (drain);
+        }
+        uint64_t legacy = allocations - start;
+
+        start = allocations;
+        for (int i = 0; i < messages; i++)
+        {
+            send_test_message (source, parts, size);
+
+            pzq::message_t message;
+            hop_in.recv_many (message);
+            hop_out.send_many (message);
+
+            pzq::message_t drain;
+            sink.recv_many (drain);
+        }
+        uint64_t current = allocations - start;
+
+        report ("hop (legacy container)", legacy, messages);
+        report ("hop (pzq::message_t)", current, messages);
+    }
+
+    // produce -> store -> dispatch
+    {
+        boost::shared_ptr<pzq::datastore_t> store (new pzq::datastore_t ());
+        store.get ()->open ("/tmp/pzq-alloc-bench.kct", 31457280);
+
+        boost::shared_ptr<pzq::socket_t> producer (new pzq::socket_t (context, ZMQ_DEALER));
+        boost::shared_ptr<pzq::socket_t> in (new pzq::socket_t (context, ZMQ_ROUTER));
+        boost::shared_ptr<pzq::socket_t> out (new pzq::socket_t (context, ZMQ_DEALER));
+        boost::shared_ptr<pzq::socket_t> consumer (new pzq::socket_t (context, ZMQ_ROUTER));
+
+        in.get ()->bind ("inproc://alloc-in");
+        producer.get ()->connect ("inproc://alloc-in");
+        out.get ()->bind ("inproc://alloc-out");
+        consumer.get ()->connect ("inproc://alloc-out");
+
+        pzq::visitor_t visitor;
+        visitor.set_socket (out);
+        visitor.set_datastore (store);
+
+        start = allocations;
+        for (int i = 0; i < messages; i++)
+        {
+            zmq::message_t id (sizeof (int)), delimiter;
+            memcpy (id.data (), &i, sizeof (int));
+            producer.get ()->send (id, ZMQ_SNDMORE);
+            producer.get ()->send (delimiter, ZMQ_SNDMORE);
+            send_test_message (*producer, parts, size);
+
+            pzq::message_t message;
+            in.get ()->recv_many (message);
+
+            // peer, id and delimiter
+            message.pop_front ();
+            message.pop_front ();
+            message.pop_front ();
+
+            std::string key;
+            store.get ()->save (message, "", key);
+
+            try {
+                store.get ()->iterate (&visitor);
+            } catch (std::exception &e) {}
+
+            pzq::message_t delivered;
+            consumer.get ()->recv_many (delivered);
+
+            std::string delivered_key;
+            delivered.pop_front ();
+            delivered.front (delivered_key);
+            store.get ()->remove (delivered_key);
+        }
+        report ("produce->store->dispatch", allocations - start, messages);
+    }
+    return 0;
+}
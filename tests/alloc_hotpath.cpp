@@ -0,0 +1,316 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+  Checks that the buffers pzq builds itself on the dispatch and ACK
+  paths need no heap allocations once warmed up: the consumer envelope
+  from visitor_t::build_message, the parts array of pzq::message_t and
+  the removal set that broadcastRemove fills. Only operator new is
+  counted, payload frames are allocated by libzmq with malloc and are
+  not ours to pool.
+
+  The last section drives a real store through iterate -> visit_full
+  -> remove. Kyoto Cabinet allocates on its own there, its tree
+  database for instance copies keys longer than its stack buffers and
+  the cache databases create their records. The same Kyoto Cabinet
+  calls and the send of the delivery, made directly, are counted as
+  the baseline, and pzq must not allocate on top of them. pzq-alloc-bench counts the whole produce ->
+  store -> dispatch path, Kyoto Cabinet and libzmq included.
+*/
+
+#include "pzq.hpp"
+#include "visitor.hpp"
+#include "keyset.hpp"
+#include "store.hpp"
+#include "socket.hpp"
+#include "histogram.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <unistd.h>
+
+static uint64_t allocations = 0;
+
+void *operator new (size_t size)
+{
+    allocations++;
+    void *p = malloc (size ? size : 1);
+    if (!p)
+        throw std::bad_alloc ();
+    return p;
+}
+
+void *operator new [] (size_t size)
+{
+    return operator new (size);
+}
+
+void operator delete (void *p)
+{
+    free (p);
+}
+
+void operator delete [] (void *p)
+{
+    free (p);
+}
+
+namespace
+{
+    // Serialises parts the same way datastore_t::save does
+    std::string make_record (int parts, size_t size)
+    {
+        std::string record;
+        for (int i = 0; i < parts; i++)
+        {
+            uint64_t s = size;
+            record.append ((const char *) &s, sizeof (uint64_t));
+            record.append (size, 'x');
+        }
+        return record;
+    }
+
+    bool check (const char *name, uint64_t count)
+    {
+        printf ("%-28s %llu allocations\n", name, (unsigned long long) count);
+        return count == 0;
+    }
+
+    bool check (const char *name, uint64_t count, uint64_t baseline)
+    {
+        printf ("%-28s %llu allocations, %llu by the libraries alone\n", name,
+                (unsigned long long) count, (unsigned long long) baseline);
+        return count <= baseline;
+    }
+
+    class nop_t : public DB::Visitor
+    {
+    };
+
+    class remove_t : public DB::Visitor
+    {
+    public:
+        const char *visit_full (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, size_t *sp)
+        {
+            return REMOVE;
+        }
+    };
+
+    // Keys as datastore_t::save makes them, timestamp|uuid
+    std::string make_key (int i)
+    {
+        char key [64];
+        int len = snprintf (key, sizeof (key), "%llu|%08d-f86e-11da-bd1a-00112444be1e",
+                            1317227600000000ULL + i, i);
+        return std::string (key, len);
+    }
+
+    /*
+      The library calls of one dispatch and its ACK as the store and the
+      visitor make them: the cursor visit, the in-flight and attempts
+      lookups, the send, the in-flight and attempts writes, the end of
+      the store and the removals
+    */
+    uint64_t libraries_alone (const std::string &path, int rounds, const std::string &record,
+                              pzq::visitor_t &visitor, pzq::socket_t &out, pzq::socket_t &consumer)
+    {
+        TreeDB db;
+        CacheDB inflight, attempts;
+        nop_t nop;
+        remove_t remover;
+        uint64_t counted = 0;
+
+        db.tune_defrag (8);
+        db.open (path, TreeDB::OWRITER | TreeDB::OCREATE);
+        inflight.cap_size (1048576);
+        inflight.open ("*", CacheDB::OWRITER | CacheDB::OCREATE);
+        attempts.cap_size (1048576);
+        attempts.open ("*", CacheDB::OWRITER | CacheDB::OCREATE);
+        DB::Cursor *cursor = db.cursor ();
+
+        for (int i = -1; i < rounds; i++)
+        {
+            std::string key = make_key (i + 1);
+            uint64_t value [2] = { 1, 0 };
+
+            db.set (key.data (), key.size (), record.data (), record.size ());
+            (*cursor).jump ();
+
+            pzq::message_t parts;
+            visitor.build_message (key.data (), key.size (), record.data (), record.size (),
+                                   pzq::microsecond_timestamp (), 5000000, 1, parts);
+
+            uint64_t start = allocations;
+            (*cursor).accept (&nop, false, true);
+            inflight.get (key.data (), key.size (), (char *) value, sizeof (uint64_t));
+            attempts.get (key.data (), key.size (), (char *) value, sizeof (value));
+            out.send_many (parts, ZMQ_NOBLOCK);
+            inflight.add (key.data (), key.size (), (const char *) value, sizeof (uint64_t));
+            attempts.set (key.data (), key.size (), (const char *) value, sizeof (value));
+            (*cursor).accept (&nop, false, true);
+            (*cursor).jump ();
+            uint64_t dispatch = allocations - start;
+
+            pzq::message_t delivered;
+            consumer.recv_many (delivered);
+
+            start = allocations;
+            attempts.get (key.data (), key.size (), (char *) value, sizeof (value));
+            inflight.remove (key.data (), key.size ());
+            attempts.remove (key.data (), key.size ());
+            db.accept (key.data (), key.size (), &remover, true);
+
+            if (i >= 0)
+                counted += dispatch + allocations - start;
+        }
+
+        delete cursor;
+        db.close ();
+        return counted;
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    const int rounds = 10000;
+    const char key [] = "1317227600000000|a8098c1a-f86e-11da-bd1a-00112444be1e";
+    bool ok = true;
+
+    pzq::visitor_t visitor;
+    std::string small_record = make_record (2, 100);
+    std::string large_record = make_record (12, 100);
+    pzq::message_t parts;
+
+    // Warm up the slab pool and the formatting buffers
+    visitor.build_message (key, sizeof (key) - 1, large_record.data (), large_record.size (), 1, 1, 1, parts);
+    parts.clear ();
+
+    uint64_t start = allocations;
+    for (int i = 0; i < rounds; i++)
+    {
+        pzq::message_t delivery;
+        visitor.build_message (key, sizeof (key) - 1, small_record.data (), small_record.size (),
+                               1317227600000000ULL + i, 5000000, 1, delivery);
+    }
+    ok &= check ("envelope", allocations - start);
+
+    start = allocations;
+    for (int i = 0; i < rounds; i++)
+    {
+        pzq::message_t delivery;
+        visitor.build_message (key, sizeof (key) - 1, large_record.data (), large_record.size (),
+                               1317227600000000ULL + i, 5000000, 1, delivery);
+    }
+    ok &= check ("envelope (12 parts)", allocations - start);
+
+    visitor.set_envelope (pzq::envelope_binary);
+    start = allocations;
+    for (int i = 0; i < rounds; i++)
+    {
+        pzq::message_t delivery;
+        visitor.build_message (key, sizeof (key) - 1, small_record.data (), small_record.size (),
+                               1317227600000000ULL + i, 5000000, 2, delivery);
+    }
+    ok &= check ("envelope (binary header)", allocations - start);
+
+    // The removal set grows to the size of a frame once and keeps it
+    pzq::key_set_t removes;
+    std::string frame;
+    for (int i = 0; i < rounds; i++)
+        removes.add (key, sizeof (key) - 1);
+    removes.encode (frame);
+
+    // ACK as received from the consumer, parsed the way handle_consumer_in
+    // does and its key queued for the next removal frame
+    start = allocations;
+    for (int i = 0; i < rounds; i++)
+    {
+        pzq::message_t ack;
+        ack.append (key, sizeof (key) - 1);
+        ack.append ("1", 1);
+
+        const char *k = static_cast<const char *> (ack [0].data ());
+        size_t ksiz = ack [0].size ();
+        if (ack [1].size () != 1 || *static_cast<const char *> (ack [1].data ()) != '1')
+            ok = false;
+
+        removes.add (k, ksiz);
+    }
+    removes.encode (frame);
+    ok &= check ("ack parse and removal set", allocations - start);
+
+    // One record at a time through a real store, the first round warms up
+    std::ostringstream path;
+    path << "/tmp/pzq-alloc-hotpath-" << getpid () << ".kct";
+    uint64_t counted = 0, baseline;
+    {
+        zmq::context_t context (1);
+        boost::shared_ptr<pzq::socket_t> out (new pzq::socket_t (context, ZMQ_DEALER));
+        boost::shared_ptr<pzq::socket_t> consumer (new pzq::socket_t (context, ZMQ_DEALER));
+        out->bind ("inproc://alloc-hotpath");
+        consumer->connect ("inproc://alloc-hotpath");
+
+        boost::shared_ptr<pzq::datastore_t> store (new pzq::datastore_t);
+        store->open (path.str (), 1048576);
+
+        pzq::visitor_t dispatcher;
+        dispatcher.set_socket (out);
+        dispatcher.set_datastore (store);
+
+        pzq::histogram_t ack_latency;
+        // The parts of small_record, which the baseline sends
+        std::string payload (100, 'x');
+        for (int i = -1; i < rounds; i++)
+        {
+            std::string stored;
+            pzq::message_t message;
+            message.append (payload);
+            message.append (payload);
+            store->save (message, "", stored);
+            store->resetIterator ();
+
+            uint64_t dispatch = allocations;
+            store->iterate (&dispatcher);
+            dispatch = allocations - dispatch;
+
+            pzq::message_t delivered;
+            consumer->recv_many (delivered);
+
+            uint64_t ack = allocations;
+            store->remove (stored.data (), stored.size (), &ack_latency);
+            ack = allocations - ack;
+
+            if (i >= 0)
+                counted += dispatch + ack;
+        }
+        if (dispatcher.delivered () != (uint64_t) rounds + 1)
+        {
+            printf ("store dispatch delivered %llu of %d\n", (unsigned long long) dispatcher.delivered (), rounds + 1);
+            ok = false;
+        }
+
+        baseline = libraries_alone (path.str () + ".baseline", rounds, small_record, dispatcher, *out, *consumer);
+    }
+    ok &= check ("store dispatch and ack", counted, baseline);
+
+    const char *suffixes [] = { "", ".replicas", ".inflight", ".baseline" };
+    for (size_t i = 0; i < sizeof (suffixes) / sizeof (suffixes [0]); i++)
+        unlink ((path.str () + suffixes [i]).c_str ());
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,521 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+/*
+  End to end load generator. Runs a cluster of 1 + --replicas nodes
+  inside one process over inproc sockets, the way
+  pzq-replication-bench does, and drives the first node with producer
+  and consumer threads. Every producer keeps a window of messages
+  outstanding, every consumer ACKs what it gets and fails a share of
+  the ACKs so that the messages go out again.
+
+  The first part of every message carries the monotonic time it was
+  sent at. Producers time the ACK of every message, consumers the time
+  from the send to the delivery they ACK. The result is one line of
+  key=value pairs, or one JSON object with --json, to compare builds
+  and configurations.
+*/
+
+#include "pzq.hpp"
+#include "socket.hpp"
+#include "store.hpp"
+#include "manager.hpp"
+#include "cluster.hpp"
+#include "ackcache.hpp"
+#include "histogram.hpp"
+
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+namespace po = boost::program_options;
+
+namespace
+{
+    int linger = 0;
+
+    struct config_t
+    {
+        int32_t producers;
+        int32_t consumers;
+        int32_t messages;
+        int32_t window;
+        int32_t size;
+        int32_t parts;
+        int32_t replicas;
+        int32_t envelope;
+        double ack_failure;
+        bool json;
+    };
+
+    // Filled by its thread, read by main after the join
+    struct producer_result_t
+    {
+        pzq::histogram_t ack_latency;
+        int32_t accepted;
+        int32_t rejected;
+        int32_t replication_failed;
+        int32_t lost;
+        uint64_t finished;
+    };
+
+    // consumed is read by main while the thread runs, one writer
+    struct consumer_result_t
+    {
+        pzq::histogram_t latency;
+        volatile int32_t consumed;
+        int32_t deliveries;
+        int32_t nacked;
+    };
+
+    std::string dsn (const char *what, int node)
+    {
+        std::ostringstream ss;
+        ss << "inproc://pzq-bench-" << what << "-" << node;
+        return ss.str ();
+    }
+
+    std::string node_name (int node)
+    {
+        std::ostringstream ss;
+        ss << "node-" << node;
+        return ss.str ();
+    }
+
+    boost::shared_ptr<pzq::socket_t> make_socket (zmq::context_t &context, int type)
+    {
+        boost::shared_ptr<pzq::socket_t> socket (new pzq::socket_t (context, type));
+        socket.get ()->setsockopt (ZMQ_LINGER, &linger, sizeof (int));
+        return socket;
+    }
+
+    struct node_t
+    {
+        boost::shared_ptr<pzq::clock_service_t> clock;
+        boost::shared_ptr<pzq::timer_service_t> timers;
+        boost::shared_ptr<pzq::datastore_t> store;
+        boost::shared_ptr<pzq::socket_t> in, out, monitor, wakeup, pub, sub;
+        boost::shared_ptr<pzq::cluster_t> cluster;
+        boost::shared_ptr<pzq::ackcache_t> acks;
+        pzq::manager_t manager;
+    };
+
+    std::vector<boost::shared_ptr<node_t> > start_nodes (zmq::context_t &context, const config_t &config)
+    {
+        std::vector<boost::shared_ptr<node_t> > nodes;
+        int count = config.replicas + 1;
+
+        // inproc wants every bind in place before the connects
+        for (int i = 0; i < count; i++)
+        {
+            boost::shared_ptr<node_t> node (new node_t);
+
+            node->clock.reset (new pzq::clock_service_t);
+            node->timers.reset (new pzq::timer_service_t (node->clock));
+
+            std::ostringstream path;
+            path << "/tmp/pzq-bench-" << i << ".kct";
+            remove (path.str ().c_str ());
+            remove ((path.str () + ".inflight").c_str ());
+            remove ((path.str () + ".replicas").c_str ());
+
+            node->store.reset (new pzq::datastore_t);
+            node->store->set_clock (node->clock);
+            node->store->open (path.str (), 31457280);
+
+            node->in = make_socket (context, ZMQ_ROUTER);
+            node->in->bind (dsn ("in", i).c_str ());
+            node->out = make_socket (context, ZMQ_DEALER);
+            node->out->bind (dsn ("out", i).c_str ());
+            node->monitor = make_socket (context, ZMQ_ROUTER);
+            node->monitor->bind (dsn ("monitor", i).c_str ());
+            node->wakeup = make_socket (context, ZMQ_PULL);
+            node->wakeup->bind (dsn ("wakeup", i).c_str ());
+            node->sub = make_socket (context, ZMQ_SUB);
+            node->sub->setsockopt (ZMQ_SUBSCRIBE, "CLUSTER", 7);
+            node->sub->bind (dsn ("bus", i).c_str ());
+
+            nodes.push_back (node);
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            boost::shared_ptr<node_t> node = nodes [i];
+            pzq::peerlist_t peers;
+
+            node->pub = make_socket (context, ZMQ_PUB);
+
+            for (int j = 0; j < count; j++)
+            {
+                if (i == j)
+                    continue;
+
+                boost::shared_ptr<pzq::socket_t> peer = make_socket (context, ZMQ_DEALER);
+                peer->connect (dsn ("in", j).c_str ());
+                peers.push_back (pzq::peer_t (node_name (j), peer));
+
+                node->pub->connect (dsn ("bus", j).c_str ());
+            }
+
+            node->cluster.reset (new pzq::cluster_t (context, config.replicas, peers, 1024, 1000000,
+                                                     node->pub, node->sub, node_name (i),
+                                                     node->store, node->clock));
+            node->cluster->setBatching (64, 500, 1000000);
+            node->acks.reset (new pzq::ackcache_t (1000000, node->clock));
+
+            node->manager.set_clock (node->clock);
+            node->manager.set_timers (node->timers);
+            node->manager.set_datastore (node->store);
+            node->manager.set_sockets (node->in, node->out, node->monitor);
+            node->manager.set_wakeup_socket (node->wakeup);
+            node->manager.set_cluster (node->cluster);
+            node->manager.set_ack_cache (node->acks);
+            node->manager.set_envelope (config.envelope);
+            node->manager.start ();
+        }
+        return nodes;
+    }
+
+    void run_producer (zmq::context_t *context, const config_t *config, producer_result_t *result)
+    {
+        pzq::socket_t socket (*context, ZMQ_DEALER);
+        socket.setsockopt (ZMQ_LINGER, &linger, sizeof (int));
+        socket.connect (dsn ("in", 0).c_str ());
+
+        std::vector<uint64_t> sent_at (config->messages, 0);
+        std::string payload (config->size, 'x');
+
+        result->accepted = result->rejected = result->replication_failed = result->lost = 0;
+        int32_t sent = 0, done = 0;
+
+        while (done < config->messages)
+        {
+            while (sent < config->messages && sent - done < config->window)
+            {
+                uint64_t now = pzq::monotonic_timestamp ();
+                sent_at [sent] = now;
+
+                // [id][""][send time, padding][parts...]
+                pzq::message_t message;
+                message.append (&sent, sizeof (int32_t));
+                message.append ();
+                memcpy (&payload [0], &now, sizeof (uint64_t));
+                for (int32_t i = 0; i < config->parts; i++)
+                    message.append (payload.data (), payload.size ());
+
+                socket.send_many (message);
+                sent++;
+            }
+
+            // A broker that stopped answering ends the run
+            zmq::pollitem_t item = { socket, 0, ZMQ_POLLIN, 0 };
+            if (zmq::poll (&item, 1, 10000) <= 0)
+            {
+                result->lost = sent - done;
+                break;
+            }
+
+            // [id][status][""][status message]
+            pzq::message_t ack;
+            socket.recv_many (ack);
+            done++;
+
+            int32_t id = -1;
+            if (ack.size () >= 2 && ack [0].size () == sizeof (int32_t))
+                memcpy (&id, ack [0].data (), sizeof (int32_t));
+
+            if (id >= 0 && id < config->messages)
+                result->ack_latency.record (pzq::monotonic_timestamp () - sent_at [id]);
+
+            if (ack.size () < 2 || *static_cast<char *> (ack [1].data ()) != '1')
+                result->rejected++;
+            else
+            {
+                result->accepted++;
+                if (ack.size () > 3)
+                    result->replication_failed++;
+            }
+        }
+        result->finished = pzq::monotonic_timestamp ();
+    }
+
+    void run_consumer (zmq::context_t *context, const config_t *config, int index,
+                       volatile bool *running, consumer_result_t *result)
+    {
+        pzq::socket_t socket (*context, ZMQ_ROUTER);
+        socket.setsockopt (ZMQ_LINGER, &linger, sizeof (int));
+        socket.connect (dsn ("out", 0).c_str ());
+
+        // Which ACKs fail, xorshift seeded apart per consumer
+        uint32_t random = 2463534242U + index * 7919U;
+        uint32_t threshold = (uint32_t) (config->ack_failure * 4294967295.0);
+
+        result->consumed = 0;
+        result->deliveries = result->nacked = 0;
+
+        while (*running)
+        {
+            zmq::pollitem_t item = { socket, 0, ZMQ_POLLIN, 0 };
+            if (zmq::poll (&item, 1, 100) <= 0)
+                continue;
+
+            // [peer id][message id][envelope...][""][parts...]
+            pzq::message_t message;
+            if (socket.recv_many (message, ZMQ_NOBLOCK) < 4)
+                continue;
+
+            uint64_t now = pzq::monotonic_timestamp ();
+            result->deliveries++;
+
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            bool success = !threshold || random > threshold;
+
+            pzq::message_t reply;
+            reply.append (message [0]);
+            reply.append (message [1]);
+            reply.append (success ? "1" : "0", 1);
+            socket.send_many (reply);
+
+            if (!success)
+            {
+                result->nacked++;
+                continue;
+            }
+
+            size_t body = 2;
+            while (body < message.size () && message [body].size () > 0)
+                body++;
+            body++;
+
+            if (body < message.size () && message [body].size () >= sizeof (uint64_t))
+            {
+                uint64_t sent;
+                memcpy (&sent, message [body].data (), sizeof (uint64_t));
+                result->latency.record (now > sent ? now - sent : 0);
+            }
+            result->consumed = result->consumed + 1;
+        }
+    }
+
+    typedef std::vector<std::pair<std::string, std::string> > fields_t;
+
+    template <typename T>
+    void add (fields_t &fields, const char *name, T value)
+    {
+        std::ostringstream ss;
+        ss << value;
+        fields.push_back (std::make_pair (std::string (name), ss.str ()));
+    }
+
+    void add_histogram (fields_t &fields, const std::string &name, const pzq::histogram_t &histogram)
+    {
+        add (fields, (name + "_mean").c_str (), histogram.mean ());
+        add (fields, (name + "_p50").c_str (), histogram.percentile (50.0));
+        add (fields, (name + "_p90").c_str (), histogram.percentile (90.0));
+        add (fields, (name + "_p99").c_str (), histogram.percentile (99.0));
+        add (fields, (name + "_p999").c_str (), histogram.percentile (99.9));
+        add (fields, (name + "_max").c_str (), histogram.max ());
+    }
+
+    // Every value is a number, JSON needs no escaping
+    void print (const fields_t &fields, bool json)
+    {
+        std::ostringstream out;
+
+        if (json)
+            out << "{";
+
+        for (size_t i = 0; i < fields.size (); i++)
+        {
+            if (json)
+                out << (i ? "," : "") << "\"" << fields [i].first << "\":" << fields [i].second;
+            else
+                out << (i ? " " : "") << fields [i].first << "=" << fields [i].second;
+        }
+
+        if (json)
+            out << "}";
+
+        printf ("%s\n", out.str ().c_str ());
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    po::options_description desc ("Command-line options");
+    po::variables_map vm;
+    config_t config;
+
+    desc.add_options ()
+        ("help", "produce help message")
+        ("producers", po::value<int32_t> (&config.producers)->default_value (1),
+         "Number of producer threads")
+        ("consumers", po::value<int32_t> (&config.consumers)->default_value (1),
+         "Number of consumer threads")
+        ("messages", po::value<int32_t> (&config.messages)->default_value (100000),
+         "Messages sent by every producer")
+        ("window", po::value<int32_t> (&config.window)->default_value (1000),
+         "Messages a producer keeps outstanding")
+        ("size", po::value<int32_t> (&config.size)->default_value (256),
+         "Size of every message part in bytes, at least 8")
+        ("parts", po::value<int32_t> (&config.parts)->default_value (1),
+         "Message parts per message")
+        ("ack-failure", po::value<double> (&config.ack_failure)->default_value (0.0),
+         "Share of consumer ACKs that fail, between 0 and 1")
+        ("replicas", po::value<int32_t> (&config.replicas)->default_value (0),
+         "Replicas of every message, the cluster has one node more")
+        ("envelope", po::value<int32_t> (&config.envelope)->default_value (pzq::envelope_text),
+         "Consumer message envelope, 1 for text or 2 for a binary header")
+        ("json", "Print the result as a JSON object")
+    ;
+
+    try {
+        po::store (po::parse_command_line (argc, argv, desc), vm);
+        po::notify (vm);
+    } catch (po::error &e) {
+        std::cerr << "Error parsing command-line options: " << e.what () << std::endl;
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+    if (vm.count ("help")) {
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+    config.json = vm.count ("json") > 0;
+
+    if (config.producers < 1 || config.consumers < 1 || config.messages < 1 || config.window < 1 || config.parts < 1) {
+        std::cerr << "--producers, --consumers, --messages, --window and --parts must be at least 1" << std::endl;
+        return 1;
+    }
+
+    if (config.size < (int32_t) sizeof (uint64_t)) {
+        std::cerr << "--size must be at least " << sizeof (uint64_t) << std::endl;
+        return 1;
+    }
+
+    if (config.ack_failure < 0.0 || config.ack_failure >= 1.0) {
+        std::cerr << "--ack-failure must be at least 0 and below 1" << std::endl;
+        return 1;
+    }
+
+    if (config.replicas < 0) {
+        std::cerr << "--replicas can not be negative" << std::endl;
+        return 1;
+    }
+
+    if (config.envelope != pzq::envelope_text && config.envelope != pzq::envelope_binary) {
+        std::cerr << "Unknown envelope version " << config.envelope << std::endl;
+        return 1;
+    }
+
+    zmq::context_t context (1);
+    std::vector<boost::shared_ptr<node_t> > nodes = start_nodes (context, config);
+
+    std::vector<producer_result_t> producers (config.producers);
+    std::vector<consumer_result_t> consumers (config.consumers);
+    volatile bool running = true;
+
+    boost::thread_group consumer_threads, producer_threads;
+    for (int i = 0; i < config.consumers; i++)
+        consumer_threads.create_thread (boost::bind (&run_consumer, &context, &config, i, &running, &consumers [i]));
+
+    uint64_t start = pzq::monotonic_timestamp ();
+    for (int i = 0; i < config.producers; i++)
+        producer_threads.create_thread (boost::bind (&run_producer, &context, &config, &producers [i]));
+    producer_threads.join_all ();
+
+    pzq::histogram_t ack_latency, latency;
+    int32_t accepted = 0, rejected = 0, replication_failed = 0, lost = 0;
+    uint64_t produced = start;
+
+    for (size_t i = 0; i < producers.size (); i++)
+    {
+        ack_latency.merge (producers [i].ack_latency);
+        accepted += producers [i].accepted;
+        rejected += producers [i].rejected;
+        replication_failed += producers [i].replication_failed;
+        lost += producers [i].lost;
+        produced = std::max (produced, producers [i].finished);
+    }
+
+    // Every accepted message has to come out, give up after 10s without progress
+    int32_t consumed = 0, last = 0;
+    uint64_t progress = pzq::monotonic_timestamp ();
+
+    while (consumed < accepted && pzq::monotonic_timestamp () - progress < 10000000)
+    {
+        usleep (1000);
+
+        consumed = 0;
+        for (size_t i = 0; i < consumers.size (); i++)
+            consumed += consumers [i].consumed;
+
+        if (consumed != last)
+        {
+            last = consumed;
+            progress = pzq::monotonic_timestamp ();
+        }
+    }
+    uint64_t finished = pzq::monotonic_timestamp ();
+
+    running = false;
+    consumer_threads.join_all ();
+
+    int32_t deliveries = 0, nacked = 0;
+    for (size_t i = 0; i < consumers.size (); i++)
+    {
+        latency.merge (consumers [i].latency);
+        deliveries += consumers [i].deliveries;
+        nacked += consumers [i].nacked;
+    }
+
+    for (size_t i = 0; i < nodes.size (); i++)
+        nodes [i]->manager.stop ();
+
+    uint64_t produce_time = produced - start, total_time = finished - start;
+
+    fields_t fields;
+    add (fields, "producers", config.producers);
+    add (fields, "consumers", config.consumers);
+    add (fields, "messages", config.producers * config.messages);
+    add (fields, "window", config.window);
+    add (fields, "size", config.size);
+    add (fields, "parts", config.parts);
+    add (fields, "replicas", config.replicas);
+    add (fields, "envelope", config.envelope);
+    add (fields, "ack_failure", config.ack_failure);
+    add (fields, "elapsed", total_time);
+    add (fields, "produce_throughput", (uint64_t) (accepted * 1000000.0 / (produce_time ? produce_time : 1)));
+    add (fields, "consume_throughput", (uint64_t) (consumed * 1000000.0 / (total_time ? total_time : 1)));
+    add (fields, "accepted", accepted);
+    add (fields, "rejected", rejected);
+    add (fields, "replication_failed", replication_failed);
+    add (fields, "lost", lost);
+    add (fields, "consumed", consumed);
+    add (fields, "deliveries", deliveries);
+    add (fields, "nacked", nacked);
+    add_histogram (fields, "produce_ack", ack_latency);
+    add_histogram (fields, "end_to_end", latency);
+    print (fields, config.json);
+
+    return (consumed < accepted || rejected || lost) ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "dedup.hpp"
+#include "expect.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+    bool seen (const pzq::dedup_window_t &window, const char *identity, int n)
+    {
+        char id [32];
+        int len = snprintf (id, sizeof (id), "msg-%d", n);
+        return window.seen (identity, strlen (identity), id, len);
+    }
+
+    void insert (pzq::dedup_window_t &window, const char *identity, int n)
+    {
+        char id [32];
+        int len = snprintf (id, sizeof (id), "msg-%d", n);
+        window.insert (identity, strlen (identity), id, len);
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    const int size = 10000;
+    pzq::dedup_window_t window (size);
+
+    for (int i = 0; i < size; i++)
+        insert (window, "producer-a", i);
+
+    bool all = true, none = true;
+    for (int i = 0; i < size; i++)
+    {
+        all &= seen (window, "producer-a", i);
+        none &= !seen (window, "producer-b", i);
+    }
+    expect (all, "every id in the window is found");
+    expect (none, "the same id from another producer is not");
+    expect (!seen (window, "producer-a", size), "an id never sent is not");
+    expect (window.size () == size, "size");
+
+    // Wrap round twice, only the last size ids are remembered
+    for (int i = size; i < 3 * size; i++)
+        insert (window, "producer-a", i);
+
+    all = true;
+    none = true;
+    for (int i = 0; i < 2 * size; i++)
+        none &= !seen (window, "producer-a", i);
+    for (int i = 2 * size; i < 3 * size; i++)
+        all &= seen (window, "producer-a", i);
+
+    expect (none, "ids that left the window are forgotten");
+    expect (all, "the newest ids are found");
+    expect (window.size () == size, "size stays at the window");
+    expect (window.lost () == 0, "the filter has room for the window");
+
+    // An identity that is a prefix of another one with the id shifted
+    pzq::dedup_window_t small (4);
+    small.insert ("ab", 2, "c", 1);
+    expect (small.seen ("ab", 2, "c", 1), "exact match");
+    expect (!small.seen ("a", 1, "bc", 2), "identity and id stay apart");
+
+    // The ACK is replayed once final, retries before that wait for it
+    pzq::dedup_window_t acks (2);
+    std::vector<std::string> waiters;
+
+    uint64_t ticket = acks.insert ("p", 1, "m1", 2);
+    expect (acks.find ("p", 1, "m1", 2) == ticket && acks.pending (ticket), "pending until final");
+
+    acks.wait (ticket, "retry", 5);
+    acks.complete (ticket, '1', "REPLICATION_FAILED", waiters);
+    expect (!acks.pending (ticket) && acks.status (ticket) == '1', "final status");
+    expect (acks.message (ticket) == "REPLICATION_FAILED", "final message");
+    expect (waiters.size () == 1 && waiters [0] == "retry", "waiting retries are handed back");
+
+    acks.complete (ticket, '1', "", waiters);
+    expect (waiters.empty (), "waiters are answered once");
+
+    // The window wraps, the old ticket is gone and completing it is harmless
+    acks.insert ("p", 1, "m2", 2);
+    uint64_t reused = acks.insert ("p", 1, "m3", 2);
+    acks.complete (ticket, '0', "", waiters);
+    expect (!acks.seen ("p", 1, "m1", 2) && acks.pending (reused), "stale ticket");
+
+    return expect_status ();
+}
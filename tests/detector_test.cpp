@@ -0,0 +1,71 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "detector.hpp"
+#include "expect.hpp"
+
+int main (int argc, char *argv [])
+{
+    // A node that beats every second, the window is past the expected value
+    pzq::phi_detector_t regular (3000000, 0);
+    uint64_t now = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        now += 1000000;
+        regular.heartbeat (now);
+    }
+    expect (regular.last () == now, "last heartbeat");
+
+    // Phi only grows with silence
+    bool rising = true;
+    double previous = regular.phi (now);
+    for (uint64_t silence = 10000; silence <= 5000000; silence += 10000)
+    {
+        double phi = regular.phi (now + silence);
+        rising &= (phi >= previous);
+        previous = phi;
+    }
+    expect (rising, "phi rises monotonically with silence");
+    expect (regular.phi (now) < 0.01, "phi right after a heartbeat");
+    expect (regular.phi (now + 1000000) > 0.29 && regular.phi (now + 1000000) < 0.31, "half a chance at the mean");
+
+    // The deviation is floored at a quarter of the mean, so the default
+    // threshold of 8 is crossed a little over 5.3 deviations late
+    expect (regular.phi (now + 2300000) < 8.0, "below the threshold at 2.3 intervals");
+    expect (regular.phi (now + 2350000) >= 8.0, "above the threshold at 2.35 intervals");
+
+    // A heartbeat brings it back down
+    regular.heartbeat (now + 2350000);
+    expect (regular.phi (now + 2350000) < 0.01, "reset by a heartbeat");
+
+    // Until real intervals come in the expected one is used
+    pzq::phi_detector_t fresh (1000000, 0);
+    expect (fresh.phi (2300000) < 8.0, "expected interval, below");
+    expect (fresh.phi (2350000) >= 8.0, "expected interval, above");
+
+    // A jittery node is given more time
+    pzq::phi_detector_t jittery (1000000, 0);
+    now = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        now += (i % 2) ? 500000 : 1500000;
+        jittery.heartbeat (now);
+    }
+    expect (jittery.phi (now + 2350000) < 8.0, "jitter raises the deviation");
+    expect (jittery.phi (now + 5000000) >= 8.0, "but not forever");
+
+    return expect_status ();
+}
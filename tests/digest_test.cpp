@@ -0,0 +1,91 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "digest.hpp"
+#include "expect.hpp"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace
+{
+    // Keys of three minutes, a second apart
+    std::vector<std::string> make_keys ()
+    {
+        std::vector<std::string> keys;
+        for (int i = 0; i < 180; i++)
+        {
+            char key [64];
+            int len = snprintf (key, sizeof (key), "%llu|%08d-f86e-11da-bd1a-00112444be1e",
+                                1317227580000000ULL + i * 1000000ULL, i);
+            keys.push_back (std::string (key, len));
+        }
+        return keys;
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    std::vector<std::string> keys = make_keys ();
+
+    expect (pzq::digest_set_t::bucket ("120000000|x", 11) == 2, "bucket of the timestamp");
+    expect (pzq::digest_set_t::bucket ("x", 1) == 0, "keys without a timestamp go to bucket 0");
+
+    // The same keys in another order give the same digests
+    pzq::digest_set_t a, b;
+    for (size_t i = 0; i < keys.size (); i++)
+        a.add (keys [i].data (), keys [i].size ());
+    for (size_t i = keys.size (); i > 0; i--)
+        b.add (keys [i - 1].data (), keys [i - 1].size ());
+
+    expect (a.buckets ().size () == 3, "a bucket per minute");
+    expect (a.buckets () == b.buckets (), "order does not matter");
+    expect (a.get (21953793).count == 60, "keys per bucket");
+
+    // A missing key shows up in its bucket and nowhere else
+    const std::string &missing = keys [100];
+    uint64_t differs = pzq::digest_set_t::bucket (missing.data (), missing.size ());
+    b.remove (missing.data (), missing.size ());
+
+    pzq::digest_set_t::buckets_t::const_iterator it;
+    for (it = a.buckets ().begin (); it != a.buckets ().end (); ++it)
+    {
+        if (it->first == differs)
+            expect (it->second != b.get (it->first), "bucket with the missing key differs");
+        else
+            expect (it->second == b.get (it->first), "other buckets are equal");
+    }
+
+    // Same count, another key: only the hash tells them apart
+    b.add ("1317227680000000|other", 22);
+    expect (a.get (differs).count == b.get (differs).count, "same count");
+    expect (a.get (differs) != b.get (differs), "different keys");
+
+    b.remove ("1317227680000000|other", 22);
+    b.add (missing.data (), missing.size ());
+    expect (a.get (differs) == b.get (differs), "equal again once the key is back");
+
+    // Removing every key leaves no bucket behind
+    for (size_t i = 0; i < keys.size (); i++)
+        a.remove (keys [i].data (), keys [i].size ());
+    expect (a.empty (), "empty");
+    expect (a.get (differs) == pzq::digest_t (), "missing bucket is the empty digest");
+    a.remove ("x", 1);
+    expect (a.empty (), "removing an unknown key");
+
+    return expect_status ();
+}
@@ -0,0 +1,86 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "estimator.hpp"
+#include "expect.hpp"
+
+int main (int argc, char *argv [])
+{
+    pzq::ack_estimator_t fixed;
+    fixed.set_fixed (5000000);
+    fixed.sample (1000);
+    expect (fixed.timeout () == 5000000, "no upper bound keeps the fixed timeout");
+    expect (fixed.latency () == 1000, "latency is tracked anyway");
+
+    pzq::ack_estimator_t estimator;
+    estimator.set_fixed (5000000);
+    estimator.set_bounds (100000, 10000000);
+    expect (estimator.timeout () == 5000000, "fixed timeout until the first sample");
+
+    // The first sample counts as latency with half of it as deviation
+    estimator.sample (200000);
+    expect (estimator.timeout () == 600000, "first sample");
+
+    // A steady latency pulls the deviation down to the lower bound
+    for (int i = 0; i < 100; i++)
+        estimator.sample (20000);
+    expect (estimator.latency () < 21000, "latency follows the samples");
+    expect (estimator.timeout () == 100000, "lower bound");
+
+    // Slow consumers push it up to the upper bound
+    for (int i = 0; i < 100; i++)
+        estimator.sample (30000000);
+    expect (estimator.timeout () == 10000000, "upper bound");
+
+    // Jitter keeps the timeout above the latency
+    pzq::ack_estimator_t jitter;
+    jitter.set_bounds (1, 100000000);
+    for (int i = 0; i < 1000; i++)
+        jitter.sample ((i % 2) ? 150000 : 50000);
+    expect (jitter.latency () > 90000 && jitter.latency () < 110000, "latency is the average");
+    expect (jitter.timeout () > 150000, "timeout covers the slow half");
+
+    // Expiries double the timeout once per timeout, up to the upper bound
+    pzq::ack_estimator_t slow;
+    slow.set_bounds (100000, 1000000);
+    slow.sample (50000);
+    expect (slow.timeout () == 150000, "before the expiry");
+
+    slow.backoff (1000000);
+    expect (slow.timeout () == 300000, "doubled");
+    slow.backoff (1100000);
+    expect (slow.timeout () == 300000, "expiries within the timeout count once");
+    slow.backoff (1300000);
+    expect (slow.timeout () == 600000, "doubled again");
+    slow.backoff (1900000);
+    expect (slow.timeout () == 1000000, "upper bound");
+
+    // A late ACK takes over from the backoff
+    slow.sample (800000);
+    expect (slow.timeout () > 300000 && slow.timeout () < 1000000, "sample after the backoff");
+
+    // Before the first sample it doubles the fixed timeout
+    pzq::ack_estimator_t unsampled;
+    unsampled.set_fixed (200000);
+    unsampled.set_bounds (100000, 1000000);
+    unsampled.backoff (0);
+    expect (unsampled.timeout () == 400000, "backoff without samples");
+
+    fixed.backoff (0);
+    expect (fixed.timeout () == 5000000, "a fixed timeout does not back off");
+
+    return expect_status ();
+}
@@ -0,0 +1,47 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PZQ_EXPECT_HPP
+# define PZQ_EXPECT_HPP
+
+#include <cstdio>
+
+/*
+  Checks shared by the unit tests. A failed expectation is printed and
+  counted, the test goes on so one run reports every failure and main
+  returns expect_status ().
+*/
+namespace
+{
+    int expect_failures = 0;
+
+    bool expect (bool condition, const char *what)
+    {
+        if (!condition)
+        {
+            printf ("FAILED: %s\n", what);
+            expect_failures++;
+        }
+        return condition;
+    }
+
+    int expect_status ()
+    {
+        return expect_failures ? 1 : 0;
+    }
+}
+
+#endif
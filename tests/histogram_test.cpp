@@ -0,0 +1,88 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "histogram.hpp"
+#include "expect.hpp"
+
+#include <sstream>
+
+namespace
+{
+    // Within the precision of the histogram
+    bool close_to (uint64_t value, uint64_t expected)
+    {
+        uint64_t diff = (value > expected) ? value - expected : expected - value;
+        return diff * 16 <= expected;
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    pzq::histogram_t histogram;
+
+    expect (histogram.percentile (50.0) == 0, "empty");
+    expect (histogram.min () == 0 && histogram.max () == 0, "empty bounds");
+
+    // Small values are exact
+    for (uint64_t i = 1; i <= 10; i++)
+        histogram.record (i);
+
+    expect (histogram.percentile (50.0) == 5, "exact median");
+    expect (histogram.percentile (100.0) == 10, "exact maximum");
+    expect (histogram.min () == 1 && histogram.mean () == 5, "min and mean");
+
+    histogram.reset ();
+    expect (histogram.count () == 0, "reset");
+
+    // 1 to 1000000 microseconds, every value once
+    for (uint64_t i = 1; i <= 1000000; i++)
+        histogram.record (i);
+
+    expect (close_to (histogram.percentile (50.0), 500000), "p50");
+    expect (close_to (histogram.percentile (90.0), 900000), "p90");
+    expect (close_to (histogram.percentile (99.0), 990000), "p99");
+    expect (close_to (histogram.percentile (99.9), 999000), "p999");
+    expect (histogram.percentile (100.0) == 1000000, "the maximum is exact");
+
+    // Extremes land in the first and the last bucket
+    pzq::histogram_t extremes;
+    extremes.record (0);
+    extremes.record (~(uint64_t) 0);
+    expect (extremes.percentile (50.0) == 0, "zero");
+    expect (extremes.percentile (100.0) == ~(uint64_t) 0, "largest value");
+
+    std::ostringstream out;
+    histogram.print (out);
+    expect (out.str ().find ("count=1000000 min=1 ") == 0, "print");
+
+    // Halves recorded apart add up to the whole
+    pzq::histogram_t low, high;
+    for (uint64_t i = 1; i <= 500000; i++)
+        low.record (i);
+    for (uint64_t i = 500001; i <= 1000000; i++)
+        high.record (i);
+
+    low.merge (high);
+    expect (low.count () == 1000000 && low.min () == 1 && low.max () == 1000000, "merged bounds");
+    expect (low.mean () == histogram.mean (), "merged mean");
+    expect (low.percentile (99.0) == histogram.percentile (99.0), "merged p99");
+
+    pzq::histogram_t empty;
+    empty.merge (pzq::histogram_t ());
+    expect (empty.count () == 0 && empty.min () == 0, "merging empty");
+
+    return expect_status ();
+}
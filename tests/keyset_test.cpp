@@ -0,0 +1,74 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "keyset.hpp"
+#include "expect.hpp"
+
+#include <cstdio>
+#include <vector>
+
+int main (int argc, char *argv [])
+{
+    pzq::key_set_t set;
+    std::vector<std::string> keys;
+    std::string frame;
+    size_t length = 0;
+
+    // Added out of order and twice, as ACKs arrive
+    for (int i = 0; i < 1000; i++)
+    {
+        char key [64];
+        int len = snprintf (key, sizeof (key), "%llu|%08d-f86e-11da-bd1a-00112444be1e",
+                            1317227600000000ULL + (i * 7919) % 1000, (i * 7919) % 1000);
+        set.add (key, len);
+        length = len;
+        if (i % 10 == 0)
+            set.add (key, len);
+    }
+    expect (set.size () == 1100, "size counts every add");
+
+    set.encode (frame);
+    expect (set.empty (), "encode empties the set");
+    // Sorted neighbours share at least the first 13 digits of the timestamp
+    expect (frame.size () <= 1000 * (length - 13 + 2), "neighbours share their prefix");
+
+    expect (pzq::key_set_t::decode (frame.data (), frame.size (), keys), "decodes");
+    expect (keys.size () == 1000, "duplicates are dropped");
+    for (size_t i = 1; i < keys.size (); i++)
+        expect (keys [i - 1] < keys [i], "keys come out sorted");
+    expect (keys.front () == "1317227600000000|00000000-f86e-11da-bd1a-00112444be1e", "first key");
+    expect (keys.back () == "1317227600000999|00000999-f86e-11da-bd1a-00112444be1e", "last key");
+
+    // A key that is a prefix of the next one, and an empty key
+    set.add ("ab", 2);
+    set.add ("", 0);
+    set.add ("a", 1);
+    set.encode (frame);
+
+    keys.clear ();
+    expect (pzq::key_set_t::decode (frame.data (), frame.size (), keys), "decodes prefixes");
+    expect (keys.size () == 3 && keys [0] == "" && keys [1] == "a" && keys [2] == "ab", "prefixes");
+
+    set.encode (frame);
+    expect (frame.empty (), "an empty set encodes to nothing");
+
+    keys.clear ();
+    expect (!pzq::key_set_t::decode ("\x05\x01x", 3, keys), "shared prefix longer than the key");
+    expect (!pzq::key_set_t::decode ("\x00\x09x", 3, keys), "rest longer than the frame");
+    expect (!pzq::key_set_t::decode ("\x80", 1, keys), "truncated length");
+
+    return expect_status ();
+}
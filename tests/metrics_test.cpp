@@ -0,0 +1,67 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "metrics.hpp"
+#include "expect.hpp"
+
+#include <sstream>
+
+namespace
+{
+    void count (pzq::metrics_t *metrics, int n)
+    {
+        pzq::metric_shard_t *shard = metrics->shard ();
+        for (int i = 0; i < n; i++)
+            shard->add (pzq::metric_expired_messages);
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    pzq::metrics_t metrics;
+
+    // Four writers, each on a shard of its own
+    boost::thread_group writers;
+    for (int i = 0; i < 4; i++)
+        writers.create_thread (boost::bind (&count, &metrics, 100000));
+    writers.join_all ();
+
+    expect (metrics.value (pzq::metric_expired_messages) == 400000, "shards add up");
+
+    pzq::metric_shard_t *shard = metrics.shard ();
+    shard->set (pzq::metric_messages, 7);
+    shard->set (pzq::metric_messages, 5);
+    expect (metrics.value (pzq::metric_messages) == 5, "a gauge holds the last value");
+
+    uint64_t values [pzq::metric_count];
+    metrics.snapshot (values);
+
+    std::ostringstream text;
+    pzq::metrics_t::write_prometheus (text, values);
+    expect (text.str ().find ("# TYPE pzq_messages gauge\npzq_messages 5\n") != std::string::npos, "prometheus gauge");
+    expect (text.str ().find ("# TYPE pzq_expired_messages_total counter\npzq_expired_messages_total 400000\n") != std::string::npos,
+            "prometheus counter");
+
+    std::ostringstream json;
+    pzq::metrics_t::write_json (json, values);
+    expect (json.str ().find ("{\"messages\":5,") == 0, "json");
+    expect (json.str ().find ("\"expired_messages\":400000") != std::string::npos, "json counter");
+
+    pzq::metrics_reader_t reader (boost::shared_ptr<pzq::metrics_t> (new pzq::metrics_t));
+    expect (reader.latest (true)->find ("\"messages\":0") != std::string::npos, "the reader renders up front");
+
+    return expect_status ();
+}
@@ -0,0 +1,354 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+  Partitioned write scaling. Starts clusters of 1, 2 and 4 nodes on ipc
+  endpoints, every node a process of its own joining through the first
+  one. Once every node sees the whole ring, one producer process per
+  node fetches the partition map from the monitor socket and sends its
+  messages straight to the primaries, following REDIRECTs if the map has
+  gone stale. Every producer sends the same number of messages, with
+  linear scaling the total throughput grows with the number of nodes.
+*/
+
+#include "pzq.hpp"
+#include "socket.hpp"
+#include "store.hpp"
+#include "manager.hpp"
+#include "cluster.hpp"
+#include "ackcache.hpp"
+#include "ring.hpp"
+
+#include <cstdio>
+#include <sstream>
+#include <map>
+#include <set>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+    const int partitions = 256;
+    int linger = 0;
+
+    std::string dsn (const char *what, int node)
+    {
+        std::ostringstream ss;
+        ss << "ipc:///tmp/pzq-partition-bench-" << what << "-" << node;
+        return ss.str ();
+    }
+
+    boost::shared_ptr<pzq::socket_t> make_socket (zmq::context_t &context, int type)
+    {
+        boost::shared_ptr<pzq::socket_t> socket (new pzq::socket_t (context, type));
+        socket.get ()->setsockopt (ZMQ_LINGER, &linger, sizeof (int));
+        return socket;
+    }
+
+    boost::shared_ptr<pzq::socket_t> connect_node (zmq::context_t *context, const std::string &address)
+    {
+        boost::shared_ptr<pzq::socket_t> socket = make_socket (*context, ZMQ_DEALER);
+        socket->connect (address.c_str ());
+        return socket;
+    }
+
+    // A pzq node, runs until the parent closes the control pipe
+    void run_node (int node, int control)
+    {
+        zmq::context_t context (1);
+
+        boost::shared_ptr<pzq::clock_service_t> clock (new pzq::clock_service_t);
+        boost::shared_ptr<pzq::timer_service_t> timers (new pzq::timer_service_t (clock));
+
+        std::ostringstream path;
+        path << "/tmp/pzq-partition-bench-" << node << ".kct";
+        remove (path.str ().c_str ());
+        remove ((path.str () + ".inflight").c_str ());
+        remove ((path.str () + ".replicas").c_str ());
+
+        boost::shared_ptr<pzq::datastore_t> store (new pzq::datastore_t);
+        store->set_clock (clock);
+        store->open (path.str (), 31457280);
+
+        boost::shared_ptr<pzq::socket_t> in = make_socket (context, ZMQ_ROUTER);
+        in->bind (dsn ("in", node).c_str ());
+        boost::shared_ptr<pzq::socket_t> out = make_socket (context, ZMQ_DEALER);
+        out->bind (dsn ("out", node).c_str ());
+        boost::shared_ptr<pzq::socket_t> monitor = make_socket (context, ZMQ_ROUTER);
+        monitor->bind (dsn ("monitor", node).c_str ());
+        boost::shared_ptr<pzq::socket_t> wakeup = make_socket (context, ZMQ_PULL);
+        wakeup->bind ("inproc://pzq-wakeup");
+        boost::shared_ptr<pzq::socket_t> sub = make_socket (context, ZMQ_SUB);
+        sub->setsockopt (ZMQ_SUBSCRIBE, "CLUSTER", 7);
+        sub->bind (dsn ("bus", node).c_str ());
+        boost::shared_ptr<pzq::socket_t> pub = make_socket (context, ZMQ_PUB);
+
+        // Everyone joins through the first node
+        pzq::peerlist_t seeds;
+        if (node > 0)
+            seeds.push_back (pzq::peer_t ("", connect_node (&context, dsn ("in", 0)), dsn ("in", 0)));
+
+        boost::shared_ptr<pzq::cluster_t> cluster (new pzq::cluster_t (context, 0, seeds, 1024, 1000000, pub, sub,
+                                                                       dsn ("bus", node), store, clock));
+        cluster->setMembership (dsn ("in", node), boost::bind (&connect_node, &context, _1), 8.0);
+        cluster->setPartitions (partitions, 64);
+
+        boost::shared_ptr<pzq::ackcache_t> acks (new pzq::ackcache_t (1000000, clock));
+
+        pzq::manager_t manager;
+        manager.set_clock (clock);
+        manager.set_timers (timers);
+        manager.set_datastore (store);
+        manager.set_sockets (in, out, monitor);
+        manager.set_wakeup_socket (wakeup);
+        manager.set_cluster (cluster);
+        manager.set_ack_cache (acks);
+        manager.start ();
+
+        char c;
+        while (read (control, &c, 1) > 0)
+            ;
+
+        manager.stop ();
+    }
+
+    /*
+      Primary address of every partition as node seen by node, true once
+      the map names as many primaries as there are nodes
+    */
+    bool partition_map (zmq::context_t &context, int node, int nodes, std::vector<std::string> &owners)
+    {
+        pzq::socket_t monitor (context, ZMQ_DEALER);
+        monitor.setsockopt (ZMQ_LINGER, &linger, sizeof (int));
+        monitor.connect (dsn ("monitor", node).c_str ());
+
+        pzq::message_t request;
+        request.append ("PARTITIONS");
+        monitor.send_many (request);
+
+        zmq::pollitem_t item = { monitor, 0, ZMQ_POLLIN, 0 };
+        if (zmq::poll (&item, 1, 1000) <= 0)
+            return false;
+
+        // [""][partitions: N\npartition: <p> <address>\n...]
+        pzq::message_t reply;
+        monitor.recv_many (reply);
+
+        std::string text;
+        reply.back (text);
+
+        std::istringstream lines (text);
+        std::string label, address;
+        std::set<std::string> primaries;
+        int p, filled = 0;
+
+        owners.assign (partitions, std::string ());
+        std::getline (lines, label);
+
+        while (lines >> label >> p >> address)
+        {
+            if (p >= 0 && p < partitions && owners [p].empty ())
+            {
+                owners [p] = address;
+                primaries.insert (address);
+                filled++;
+            }
+        }
+        return filled == partitions && (int) primaries.size () == nodes;
+    }
+
+    // Returns the number of messages that failed
+    int run_producer (int producer, int messages, int window, const std::vector<std::string> &owners)
+    {
+        zmq::context_t context (1);
+
+        std::map<std::string, size_t> index;
+        std::vector<boost::shared_ptr<pzq::socket_t> > sockets;
+        std::vector<zmq::pollitem_t> items;
+
+        char payload [256];
+        memset (payload, 'x', sizeof (payload));
+
+        int sent = 0, done = 0, failed = 0, redirects = 0;
+
+        while (done < messages)
+        {
+            while (sent < messages && sent - done < window)
+            {
+                char id [32];
+                int len = snprintf (id, sizeof (id), "%d-%d", producer, sent);
+                const std::string &owner = owners [pzq::ring_t::partition (id, len, partitions)];
+
+                if (!index.count (owner))
+                {
+                    index [owner] = sockets.size ();
+                    sockets.push_back (connect_node (&context, owner));
+                    zmq::pollitem_t item = { *sockets.back (), 0, ZMQ_POLLIN, 0 };
+                    items.push_back (item);
+                }
+
+                pzq::message_t message;
+                message.append (id, len);
+                message.append ();
+                message.append (payload, sizeof (payload));
+                sockets [index [owner]]->send_many (message);
+                sent++;
+            }
+
+            zmq::poll (&items [0], (int) items.size (), -1);
+
+            for (size_t i = 0, n = items.size (); i < n; i++)
+            {
+                if (!(items [i].revents & ZMQ_POLLIN))
+                    continue;
+
+                // [id][status][""][status message]
+                pzq::message_t ack;
+                sockets [i]->recv_many (ack);
+
+                if (ack.size () >= 2 && *static_cast<char *> (ack [1].data ()) == '1')
+                {
+                    done++;
+                    continue;
+                }
+
+                std::string status;
+                if (ack.size () > 3)
+                    ack.back (status);
+
+                if (status.compare (0, 9, "REDIRECT ") != 0)
+                {
+                    failed++;
+                    done++;
+                    continue;
+                }
+
+                // The map went stale, follow the node
+                std::string owner = status.substr (9);
+                if (!index.count (owner))
+                {
+                    index [owner] = sockets.size ();
+                    sockets.push_back (connect_node (&context, owner));
+                    zmq::pollitem_t item = { *sockets.back (), 0, ZMQ_POLLIN, 0 };
+                    items.push_back (item);
+                }
+
+                pzq::message_t message;
+                message.append (ack [0]);
+                message.append ();
+                message.append (payload, sizeof (payload));
+                sockets [index [owner]]->send_many (message);
+                redirects++;
+            }
+        }
+
+        if (failed || redirects)
+            printf ("producer %d: failed=%d redirects=%d\n", producer, failed, redirects);
+        return failed;
+    }
+
+    void run (int nodes, int messages, int window)
+    {
+        std::vector<pid_t> node_pids;
+        std::vector<int> controls;
+
+        for (int i = 0; i < nodes; i++)
+        {
+            int fds [2];
+            if (pipe (fds) != 0)
+                return;
+
+            pid_t pid = fork ();
+            if (pid == 0)
+            {
+                close (fds [1]);
+                run_node (i, fds [0]);
+                _exit (0);
+            }
+            close (fds [0]);
+            controls.push_back (fds [1]);
+            node_pids.push_back (pid);
+        }
+
+        // Wait until every node agrees on the ring
+        std::vector<std::string> owners;
+        bool converged = false;
+        {
+            zmq::context_t context (1);
+            uint64_t deadline = pzq::microsecond_timestamp () + 10000000;
+
+            while (!converged && pzq::microsecond_timestamp () < deadline)
+            {
+                converged = true;
+                for (int i = 0; i < nodes && converged; i++)
+                    converged = partition_map (context, i, nodes, owners);
+
+                if (!converged)
+                    usleep (100000);
+            }
+        }
+
+        if (converged)
+        {
+            std::vector<pid_t> producer_pids;
+            uint64_t start = pzq::microsecond_timestamp ();
+
+            for (int i = 0; i < nodes; i++)
+            {
+                pid_t pid = fork ();
+                if (pid == 0)
+                    _exit (run_producer (i, messages, window, owners) ? 1 : 0);
+                producer_pids.push_back (pid);
+            }
+
+            int failed = 0;
+            for (size_t i = 0; i < producer_pids.size (); i++)
+            {
+                int status;
+                waitpid (producer_pids [i], &status, 0);
+                if (!WIFEXITED (status) || WEXITSTATUS (status))
+                    failed++;
+            }
+
+            uint64_t elapsed = pzq::microsecond_timestamp () - start;
+            int total = nodes * messages;
+
+            printf ("nodes=%d messages=%d elapsed=%.3fs throughput=%.0f msg/s failed_producers=%d\n",
+                    nodes, total, elapsed / 1000000.0,
+                    total * 1000000.0 / (elapsed ? elapsed : 1), failed);
+        }
+        else
+            printf ("nodes=%d: the ring did not converge\n", nodes);
+
+        for (size_t i = 0; i < controls.size (); i++)
+            close (controls [i]);
+        for (size_t i = 0; i < node_pids.size (); i++)
+            waitpid (node_pids [i], NULL, 0);
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    int messages = (argc > 1) ? atoi (argv [1]) : 100000;
+    int window = (argc > 2) ? atoi (argv [2]) : 1000;
+
+    const int clusters [] = { 1, 2, 4 };
+    for (size_t i = 0; i < sizeof (clusters) / sizeof (clusters [0]); i++)
+        run (clusters [i], messages, window);
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include "profile.hpp"
+#include "expect.hpp"
+
+#include <sstream>
+
+namespace
+{
+    bool contains (const std::string &text, const char *line)
+    {
+        return text.find (line) != std::string::npos;
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    pzq::loop_profile_t profile (1000);
+
+    // Two rounds: 400 blocked in poll, then the handlers that ran
+    profile.mark (pzq::loop_poll, 1400);
+    profile.mark (pzq::loop_producer_in, 1450);
+    profile.mark (pzq::loop_consumer_out, 1500);
+    profile.mark (pzq::loop_timers, 1510);
+
+    profile.mark (pzq::loop_poll, 1800);
+    profile.mark (pzq::loop_consumer_in, 1990);
+    profile.mark (pzq::loop_timers, 2000);
+
+    expect (profile.iterations () == 2, "iterations");
+
+    std::ostringstream out;
+    profile.print (out, 2000);
+    std::string text = out.str ();
+
+    expect (contains (text, "interval: 1000\n"), "interval");
+    expect (contains (text, "iterations_per_second: 2000\n"), "rate");
+    expect (contains (text, "busy: 31.00\n"), "busy share");
+    expect (contains (text, "longest_stall: 190 consumer_in\n"), "longest stall");
+    expect (contains (text, "poll: calls=2 time=690 share=69.00 longest=400\n"), "poll");
+    expect (contains (text, "producer_in: calls=1 time=50 share=5.00 longest=50\n"), "producer_in");
+    expect (contains (text, "timers: calls=2 time=20 share=2.00 longest=10\n"), "timers");
+    expect (contains (text, "monitor: calls=0 time=0 share=0.00 longest=0\n"), "idle section");
+
+    // Reading starts a new interval
+    expect (profile.iterations () == 0, "reset on print");
+
+    std::ostringstream empty;
+    profile.print (empty, 2000);
+    expect (contains (empty.str (), "longest_stall: 0 none\n"), "nothing ran");
+    expect (contains (empty.str (), "iterations_per_second: 0\n"), "empty interval");
+
+    // A clock that goes backwards charges nothing
+    profile.mark (pzq::loop_poll, 1500);
+    std::ostringstream back;
+    profile.print (back, 2500);
+    expect (contains (back.str (), "poll: calls=1 time=0 "), "no negative time");
+
+    return expect_status ();
+}
@@ -0,0 +1,199 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+  Replicated produce throughput. Runs a four node cluster inside one
+  process, every node with its own manager thread, store and cluster,
+  wired together over inproc sockets. A producer keeps a window of
+  messages outstanding against the first node and counts the ACKs.
+
+  Runs with 0 to 3 replicas, the network is left out of the picture so
+  the figures show the cost of replication in pzq itself.
+*/
+
+#include "pzq.hpp"
+#include "socket.hpp"
+#include "store.hpp"
+#include "manager.hpp"
+#include "cluster.hpp"
+#include "ackcache.hpp"
+
+#include <cstdio>
+#include <sstream>
+
+namespace
+{
+    const int nodes = 4;
+    int linger = 0;
+
+    std::string dsn (const char *what, int run, int node)
+    {
+        std::ostringstream ss;
+        ss << "inproc://replication-bench-" << what << "-" << run << "-" << node;
+        return ss.str ();
+    }
+
+    std::string node_name (int node)
+    {
+        std::ostringstream ss;
+        ss << "node-" << node;
+        return ss.str ();
+    }
+
+    boost::shared_ptr<pzq::socket_t> make_socket (zmq::context_t &context, int type)
+    {
+        boost::shared_ptr<pzq::socket_t> socket (new pzq::socket_t (context, type));
+        socket.get ()->setsockopt (ZMQ_LINGER, &linger, sizeof (int));
+        return socket;
+    }
+
+    struct node_t
+    {
+        boost::shared_ptr<pzq::clock_service_t> clock;
+        boost::shared_ptr<pzq::timer_service_t> timers;
+        boost::shared_ptr<pzq::datastore_t> store;
+        boost::shared_ptr<pzq::socket_t> in, out, monitor, wakeup, pub, sub;
+        boost::shared_ptr<pzq::cluster_t> cluster;
+        boost::shared_ptr<pzq::ackcache_t> acks;
+        pzq::manager_t manager;
+    };
+
+    void run (zmq::context_t &context, int run, int replicas, int messages, int window)
+    {
+        boost::shared_ptr<node_t> cluster [nodes];
+
+        // inproc wants every bind in place before the connects
+        for (int i = 0; i < nodes; i++)
+        {
+            boost::shared_ptr<node_t> node (new node_t);
+
+            node->clock.reset (new pzq::clock_service_t);
+            node->timers.reset (new pzq::timer_service_t (node->clock));
+
+            std::ostringstream path;
+            path << "/tmp/pzq-replication-bench-" << i << ".kct";
+            remove (path.str ().c_str ());
+            remove ((path.str () + ".inflight").c_str ());
+            remove ((path.str () + ".replicas").c_str ());
+
+            node->store.reset (new pzq::datastore_t);
+            node->store->set_clock (node->clock);
+            node->store->open (path.str (), 31457280);
+
+            node->in = make_socket (context, ZMQ_ROUTER);
+            node->in->bind (dsn ("in", run, i).c_str ());
+            node->out = make_socket (context, ZMQ_DEALER);
+            node->out->bind (dsn ("out", run, i).c_str ());
+            node->monitor = make_socket (context, ZMQ_ROUTER);
+            node->monitor->bind (dsn ("monitor", run, i).c_str ());
+            node->wakeup = make_socket (context, ZMQ_PULL);
+            node->wakeup->bind (dsn ("wakeup", run, i).c_str ());
+            node->sub = make_socket (context, ZMQ_SUB);
+            node->sub->setsockopt (ZMQ_SUBSCRIBE, "CLUSTER", 7);
+            node->sub->bind (dsn ("bus", run, i).c_str ());
+
+            cluster [i] = node;
+        }
+
+        for (int i = 0; i < nodes; i++)
+        {
+            boost::shared_ptr<node_t> node = cluster [i];
+            pzq::peerlist_t peers;
+
+            node->pub = make_socket (context, ZMQ_PUB);
+
+            for (int j = 0; j < nodes; j++)
+            {
+                if (i == j)
+                    continue;
+
+                boost::shared_ptr<pzq::socket_t> peer = make_socket (context, ZMQ_DEALER);
+                peer->connect (dsn ("in", run, j).c_str ());
+                peers.push_back (pzq::peer_t (node_name (j), peer));
+
+                node->pub->connect (dsn ("bus", run, j).c_str ());
+            }
+
+            node->cluster.reset (new pzq::cluster_t (context, replicas, peers, 1024, 1000000,
+                                                     node->pub, node->sub, node_name (i),
+                                                     node->store, node->clock));
+            node->cluster->setBatching (64, 500, 1000000);
+            node->acks.reset (new pzq::ackcache_t (1000000, node->clock));
+
+            node->manager.set_clock (node->clock);
+            node->manager.set_timers (node->timers);
+            node->manager.set_datastore (node->store);
+            node->manager.set_sockets (node->in, node->out, node->monitor);
+            node->manager.set_wakeup_socket (node->wakeup);
+            node->manager.set_cluster (node->cluster);
+            node->manager.set_ack_cache (node->acks);
+            node->manager.start ();
+        }
+
+        pzq::socket_t producer (context, ZMQ_DEALER);
+        producer.setsockopt (ZMQ_LINGER, &linger, sizeof (int));
+        producer.connect (dsn ("in", run, 0).c_str ());
+
+        char payload [256];
+        memset (payload, 'x', sizeof (payload));
+
+        int sent = 0, acked = 0, failed = 0;
+        uint64_t start = pzq::microsecond_timestamp ();
+
+        while (acked < messages)
+        {
+            while (sent < messages && sent - acked < window)
+            {
+                pzq::message_t message;
+                message.append (&sent, sizeof (int));
+                message.append ();
+                message.append (payload, sizeof (payload));
+                producer.send_many (message);
+                sent++;
+            }
+
+            // [id][status][""][status message]
+            pzq::message_t ack;
+            producer.recv_many (ack);
+            acked++;
+
+            if (ack.size () < 2 || *static_cast<char *> (ack [1].data ()) != '1' || ack.size () > 3)
+                failed++;
+        }
+
+        uint64_t elapsed = pzq::microsecond_timestamp () - start;
+
+        printf ("replicas=%d messages=%d elapsed=%.3fs throughput=%.0f msg/s failed=%d\n",
+                replicas, messages, elapsed / 1000000.0,
+                messages * 1000000.0 / (elapsed ? elapsed : 1), failed);
+
+        for (int i = 0; i < nodes; i++)
+            cluster [i]->manager.stop ();
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    int messages = (argc > 1) ? atoi (argv [1]) : 100000;
+    int window = (argc > 2) ? atoi (argv [2]) : 1000;
+
+    zmq::context_t context (1);
+
+    for (int replicas = 0; replicas < nodes; replicas++)
+        run (context, replicas, replicas, messages, window);
+
+    return 0;
+}
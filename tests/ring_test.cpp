@@ -0,0 +1,96 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "ring.hpp"
+#include "expect.hpp"
+
+namespace
+{
+    const int partitions = 1024;
+    const int vnodes = 64;
+
+    // Owner names of every partition, independent of the order of nodes
+    std::vector<std::vector<std::string> > owner_names (const std::vector<std::string> &nodes, int copies)
+    {
+        pzq::ring_t ring;
+        ring.build (nodes, partitions, vnodes, copies);
+
+        std::vector<std::vector<std::string> > names (partitions);
+        for (int p = 0; p < partitions; p++)
+            for (size_t i = 0; i < ring.owners (p).size (); i++)
+                names [p].push_back (nodes [ring.owners (p) [i]]);
+        return names;
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    std::vector<std::string> nodes;
+    nodes.push_back ("tcp://10.0.0.1:11131");
+    nodes.push_back ("tcp://10.0.0.2:11131");
+    nodes.push_back ("tcp://10.0.0.3:11131");
+    nodes.push_back ("tcp://10.0.0.4:11131");
+
+    pzq::ring_t empty;
+    empty.build (std::vector<std::string> (), partitions, vnodes, 2);
+    expect (empty.partitions () == partitions, "partitions");
+    expect (empty.owners (0).empty (), "no owners without nodes");
+
+    // Every node lists itself first and still computes the same owners
+    std::vector<std::vector<std::string> > owners = owner_names (nodes, 2);
+    std::vector<std::string> rotated (nodes.begin () + 2, nodes.end ());
+    rotated.insert (rotated.end (), nodes.begin (), nodes.begin () + 2);
+    expect (owner_names (rotated, 2) == owners, "same owners whatever the order");
+
+    bool distinct = true;
+    std::vector<int> primaries (nodes.size (), 0);
+    for (int p = 0; p < partitions; p++)
+    {
+        distinct &= (owners [p].size () == 2 && owners [p][0] != owners [p][1]);
+        primaries [std::find (nodes.begin (), nodes.end (), owners [p][0]) - nodes.begin ()]++;
+    }
+    expect (distinct, "two distinct owners per partition");
+    for (size_t n = 0; n < nodes.size (); n++)
+        expect (primaries [n] > partitions / 8 && primaries [n] < partitions / 2, "primaries spread over the nodes");
+
+    std::vector<std::vector<std::string> > capped = owner_names (std::vector<std::string> (1, nodes [0]), 3);
+    expect (capped [0].size () == 1, "no more copies than nodes");
+
+    // A fifth node takes about a fifth of the primaries, from the others
+    // only; every other partition keeps its primary
+    std::vector<std::string> grown (nodes);
+    grown.push_back ("tcp://10.0.0.5:11131");
+    std::vector<std::vector<std::string> > after = owner_names (grown, 2);
+
+    int moved = 0;
+    bool only_to_new = true;
+    for (int p = 0; p < partitions; p++)
+    {
+        if (after [p][0] == owners [p][0])
+            continue;
+        moved++;
+        only_to_new &= (after [p][0] == grown.back ());
+    }
+    expect (moved > 0 && moved < partitions / 3, "few partitions move");
+    expect (only_to_new, "moved partitions go to the new node");
+
+    // Message ids map into the partitions, the same way on every node
+    int partition = pzq::ring_t::partition ("1317227600000000|a", 18, partitions);
+    expect (partition >= 0 && partition < partitions, "partition in range");
+    expect (partition == pzq::ring_t::partition ("1317227600000000|a", 18, partitions), "stable partition");
+
+    return expect_status ();
+}
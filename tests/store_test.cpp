@@ -0,0 +1,105 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "store.hpp"
+#include "expect.hpp"
+
+#include <cstdio>
+#include <sstream>
+#include <unistd.h>
+
+namespace
+{
+    class counter_t : public DB::Visitor
+    {
+    public:
+        int count;
+
+        counter_t () : count (0)
+        {}
+
+        const char *visit_full (const char *kbuf, size_t ksiz, const char *vbuf, size_t vsiz, size_t *sp)
+        {
+            count++;
+            return NOP;
+        }
+    };
+
+    void save (pzq::datastore_t &store, const std::string &owner, const std::string &key)
+    {
+        pzq::message_t parts;
+        parts.append ("payload");
+        store.save_replica (owner, parts, key);
+    }
+
+    int replicas_of (pzq::datastore_t &store, const std::string &owner)
+    {
+        counter_t counter;
+        store.iterate_replicas (owner, &counter);
+        return counter.count;
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    std::ostringstream path;
+    path << "/tmp/pzq-store-test-" << getpid () << ".kct";
+
+    {
+        pzq::datastore_t store;
+        store.open (path.str (), 1048576);
+
+        const std::string owner ("tcp://10.0.0.2:11131");
+        save (store, owner, "1317227600000000|a");
+        std::map<std::string, pzq::digest_set_t> before = store.held_digests ();
+        expect (before [owner].get (21953793).count == 1, "saved outside a batch");
+
+        // A batch that fails half way through is rolled back
+        store.begin_batch ();
+        save (store, owner, "1317227600000001|b");
+        save (store, owner, "1317227600000002|c");
+        store.end_batch (false);
+
+        expect (store.replicas () == 1, "rolled back records are gone");
+        expect (store.held_digests ().size () == 1, "no digest for the rolled back batch");
+        expect (store.held_digests ().find (owner)->second.buckets () == before [owner].buckets (),
+                "held digest unchanged by the rollback");
+        expect (replicas_of (store, owner) == 1, "owner index unchanged by the rollback");
+
+        // The same records in a batch that commits
+        store.begin_batch ();
+        save (store, owner, "1317227600000001|b");
+        save (store, owner, "1317227600000002|c");
+        save (store, "tcp://10.0.0.3:11131", "1317227600000003|d");
+        store.end_batch (true);
+
+        expect (store.replicas () == 4, "committed records");
+        expect (store.held_digests ().find (owner)->second.get (21953793).count == 3, "held digest of the commit");
+        expect (store.held_digests ().size () == 2, "a digest per owner");
+        expect (replicas_of (store, owner) == 3, "owner index of the commit");
+
+        // Removing the last replica of an owner drops its digest
+        std::vector<std::string> keys (1, "1317227600000003|d");
+        expect (store.remove_replicas (keys) == 1, "removed");
+        expect (store.held_digests ().size () == 1, "no digest left for the owner");
+    }
+
+    unlink (path.str ().c_str ());
+    unlink ((path.str () + ".replicas").c_str ());
+    unlink ((path.str () + ".inflight").c_str ());
+
+    return expect_status ();
+}
@@ -0,0 +1,64 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "timer.hpp"
+#include "expect.hpp"
+
+#include <vector>
+
+namespace
+{
+    std::vector<int> fired;
+
+    void fire (int n)
+    {
+        fired.push_back (n);
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    boost::shared_ptr<pzq::clock_service_t> clock (new pzq::clock_service_t);
+    pzq::timer_service_t timers (clock);
+
+    expect (timers.poll_timeout () == -1, "no timers means block forever");
+
+    uint64_t now = clock->now ();
+    std::vector<pzq::timer_id_t> ids;
+    for (int i = 0; i < 100; i++)
+        ids.push_back (timers.create (boost::bind (&fire, i)));
+
+    // Scheduled in scrambled order, deadlines in the past fire in order
+    for (int i = 0; i < 100; i++)
+        timers.schedule (ids [(i * 37) % 100], now - 1000000 + ((i * 37) % 100));
+
+    timers.cancel (ids [50]);
+    timers.schedule (ids [10], now + 10000000);
+
+    expect (timers.poll_timeout () == 0, "overdue timer gives a zero timeout");
+
+    timers.run_expired ();
+
+    expect (fired.size () == 98, "cancelled and postponed timers do not fire");
+    for (size_t i = 1; i < fired.size (); i++)
+        expect (fired [i - 1] < fired [i], "timers fire in deadline order");
+
+    long timeout = timers.poll_timeout ();
+    expect (timeout > 9000 && timeout <= 10001, "timeout rounds up to the next deadline");
+    expect (timers.is_scheduled (ids [10]) && !timers.is_scheduled (ids [11]), "is_scheduled");
+
+    return expect_status ();
+}
@@ -0,0 +1,111 @@
+/*
+ *  Copyright 2011 Mikko Koppanen <mikko@kuut.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "trace.hpp"
+#include "time.hpp"
+#include "expect.hpp"
+
+#include <sstream>
+
+namespace
+{
+    int lines (const std::string &text)
+    {
+        int count = 0;
+        for (size_t i = 0; i < text.size (); i++)
+            count += (text [i] == '\n');
+        return count;
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    pzq::tracer_t off;
+    int sampled = 0;
+    for (int i = 0; i < 1000; i++)
+        sampled += off.sample (false);
+    expect (sampled == 0, "no sampling by default");
+    expect (off.sample (true), "a TRACE part is always traced");
+
+    pzq::tracer_t tracer (16);
+    tracer.set_sample (10);
+    sampled = 0;
+    for (int i = 0; i < 1000; i++)
+        sampled += tracer.sample (false);
+    expect (sampled == 100, "one in ten");
+
+    // Stages of keys that are not traced are not recorded
+    expect (!tracer.active (), "nothing traced yet");
+    tracer.record ("other", 5, pzq::trace_dispatch);
+
+    tracer.start ("1|a", 1000);
+    expect (tracer.active (), "tracing");
+    tracer.record ("1|a", 3, pzq::trace_dispatch);
+    tracer.record ("other", 5, pzq::trace_dispatch);
+    tracer.record ("1|a", 3, pzq::trace_ack);
+    tracer.finish ("1|a", 3);
+    expect (!tracer.active (), "removed keys are no longer traced");
+
+    std::ostringstream out;
+    tracer.dump (out);
+    std::string text = out.str ();
+
+    expect (lines (text) == 5, "receive, store, dispatch, ack and remove");
+    expect (text.find ("1000 +0 receive 1|a\n") == 0, "receive comes first at its time");
+    expect (text.find (" dispatch 1|a\n") != std::string::npos, "dispatch");
+    expect (text.find ("other") == std::string::npos, "untraced key");
+
+    // The ring keeps the newest events
+    for (int i = 0; i < 10; i++)
+    {
+        tracer.start ("2|b", 2000);
+        tracer.finish ("2|b", 3);
+    }
+    std::ostringstream wrapped;
+    tracer.dump (wrapped);
+    expect (lines (wrapped.str ()) == 16, "ring size");
+    expect (wrapped.str ().find ("1|a") == std::string::npos, "oldest overwritten");
+
+    // Keys that are never finished are given up after max_age
+    pzq::tracer_t aging (4096, 1000);
+    uint64_t now = pzq::monotonic_timestamp ();
+    aging.start ("3|c", now - 1000000);
+    aging.start ("4|d", now + 1000000);
+    for (int i = 0; i < 1024; i++)
+    {
+        std::ostringstream key;
+        key << "5|" << i;
+        aging.start (key.str (), now - 1000000);
+    }
+    expect (aging.skipped () == 0, "stale keys make room when full");
+    expect (aging.expired () == 1023, "all but the fresh ones expired");
+
+    boost::shared_ptr<pzq::clock_service_t> clock (new pzq::clock_service_t);
+    boost::shared_ptr<pzq::timer_service_t> timers (new pzq::timer_service_t (clock));
+    aging.set_timers (timers);
+    aging.start ("6|e", now - 1000000);
+    expect (timers->poll_timeout () == 0, "aging timer due");
+    timers->run_expired ();
+    expect (aging.expired () == 1026, "aged out on the timer");
+    expect (aging.active (), "the fresh key is still traced");
+
+    std::ostringstream expired;
+    aging.dump (expired);
+    expect (expired.str ().find (" expire 3|c\n") != std::string::npos, "expire event");
+    expect (expired.str ().find (" expire 4|d\n") == std::string::npos, "fresh key kept");
+
+    return expect_status ();
+}